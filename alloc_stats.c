@@ -0,0 +1,259 @@
+/*
+ * alloc_stats.c --- batched allocation statistics
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * ext2fs_block_alloc_stats2() and ext2fs_inode_alloc_stats2() update the
+ * bitmap, the group descriptor counters and flags, the descriptor checksum
+ * and the superblock for every single item. The passes that move every
+ * inode or every relocated block accumulate the counters per group here
+ * instead, and apply them once per group when the batch is flushed.
+ *
+ * The block bitmap is still updated at once, as the allocator searches it
+ * during the pass. The inode bitmap is only written back when the stream
+ * leaves a group, a whole group at a time.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+
+#define GROUP_BLOCKS_DIRTY	0x1
+#define GROUP_INODES_DIRTY	0x2
+
+struct alloc_stats_batch {
+	ext2_filsys	fs;
+	/* per-group deltas, applied by alloc_stats_flush() */
+	__s64		*free_blocks;
+	__s32		*free_inodes;
+	__s32		*used_dirs;
+	ext2_ino_t	*last_ino;
+	unsigned char	*dirty;
+	/* groups touched since the last flush */
+	dgrp_t		*dirty_list;
+	dgrp_t		num_dirty;
+	__s64		sb_free_blocks;
+	__s64		sb_free_inodes;
+	/* inode bitmap of the group being streamed */
+	unsigned char	*ibits;
+	dgrp_t		ibits_group;
+	int		ibits_loaded;
+	unsigned long long mem_bytes;
+};
+
+/*memory of all the open batches, for the accounting report */
+static unsigned long long batches_mem;
+
+errcode_t alloc_stats_open(ext2_filsys fs, alloc_stats_batch_t *ret)
+{
+	alloc_stats_batch_t batch;
+	dgrp_t groups = fs->group_desc_count;
+	errcode_t retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct alloc_stats_batch), &batch);
+	if (retval)
+		return retval;
+	batch->fs = fs;
+	batch->free_blocks = calloc(groups, sizeof(__s64));
+	batch->free_inodes = calloc(groups, sizeof(__s32));
+	batch->used_dirs = calloc(groups, sizeof(__s32));
+	batch->last_ino = calloc(groups, sizeof(ext2_ino_t));
+	batch->dirty = calloc(groups, sizeof(unsigned char));
+	batch->dirty_list = calloc(groups, sizeof(dgrp_t));
+	batch->ibits = calloc(1, fs->super->s_inodes_per_group / 8 + 1);
+	if (!batch->free_blocks || !batch->free_inodes || !batch->used_dirs || !batch->last_ino || !batch->dirty || !batch->dirty_list || !batch->ibits) {
+		alloc_stats_close(&batch);
+		return ENOMEM;
+	}
+	batch->mem_bytes = groups * (unsigned long long)(sizeof(__s64) + 2 * sizeof(__s32) + sizeof(ext2_ino_t) + 1 + sizeof(dgrp_t)) + fs->super->s_inodes_per_group / 8;
+	batches_mem += batch->mem_bytes;
+	mem_account("allocation statistics batches", batches_mem);
+	*ret = batch;
+	return 0;
+}
+
+static void mark_group_dirty(alloc_stats_batch_t batch, dgrp_t group, int what)
+{
+	if (!batch->dirty[group])
+		batch->dirty_list[batch->num_dirty++] = group;
+	batch->dirty[group] |= what;
+}
+
+/*same accounting as ext2fs_block_alloc_stats2(): a whole cluster for a single block */
+void alloc_stats_block(alloc_stats_batch_t batch, blk64_t blk, int inuse)
+{
+	ext2_filsys fs = batch->fs;
+	dgrp_t group = ext2fs_group_of_blk2(fs, blk);
+
+	if (inuse > 0)
+		ext2fs_mark_block_bitmap2(fs->block_map, blk);
+	else
+		ext2fs_unmark_block_bitmap2(fs->block_map, blk);
+	batch->free_blocks[group] -= inuse;
+	batch->sb_free_blocks -= inuse * (__s64)EXT2FS_CLUSTER_RATIO(fs);
+	mark_group_dirty(batch, group, GROUP_BLOCKS_DIRTY);
+}
+
+/*same accounting as ext2fs_block_alloc_stats_range() */
+void alloc_stats_block_range(alloc_stats_batch_t batch, blk64_t blk, blk_t num, int inuse)
+{
+	ext2_filsys fs = batch->fs;
+	dgrp_t group;
+	blk64_t n, last_blk;
+
+	if (inuse == 0 || num == 0)
+		return;
+	if (inuse > 0) {
+		ext2fs_mark_block_bitmap_range2(fs->block_map, blk, num);
+		inuse = 1;
+	} else {
+		ext2fs_unmark_block_bitmap_range2(fs->block_map, blk, num);
+		inuse = -1;
+	}
+	while (num) {
+		group = ext2fs_group_of_blk2(fs, blk);
+		last_blk = ext2fs_group_last_block2(fs, group);
+		n = num;
+		if (blk + num > last_blk)
+			n = last_blk - blk + 1;
+		batch->free_blocks[group] -= inuse * (__s64)n / EXT2FS_CLUSTER_RATIO(fs);
+		batch->sb_free_blocks -= inuse * (__s64)n;
+		mark_group_dirty(batch, group, GROUP_BLOCKS_DIRTY);
+		blk += n;
+		num -= n;
+	}
+}
+
+/*write back the bits of the group being streamed */
+static errcode_t store_inode_bits(alloc_stats_batch_t batch)
+{
+	ext2_filsys fs = batch->fs;
+	errcode_t retval;
+
+	if (!batch->ibits_loaded)
+		return 0;
+	batch->ibits_loaded = 0;
+	retval = ext2fs_set_inode_bitmap_range2(fs->inode_map, (__u64)batch->ibits_group * fs->super->s_inodes_per_group + 1, fs->super->s_inodes_per_group, batch->ibits);
+	if (!retval)
+		ext2fs_mark_ib_dirty(fs);
+	return retval;
+}
+
+/*same accounting as ext2fs_inode_alloc_stats2() */
+errcode_t alloc_stats_inode(alloc_stats_batch_t batch, ext2_ino_t ino, int inuse, int isdir)
+{
+	ext2_filsys fs = batch->fs;
+	dgrp_t group = ext2fs_group_of_ino(fs, ino);
+	unsigned int bit = (ino - 1) % fs->super->s_inodes_per_group;
+	errcode_t retval;
+
+	if (ino > fs->super->s_inodes_count)
+		return EXT2_ET_BAD_INODE_NUM;
+
+	if (!batch->ibits_loaded || batch->ibits_group != group) {
+		retval = store_inode_bits(batch);
+		if (retval)
+			return retval;
+		retval = ext2fs_get_inode_bitmap_range2(fs->inode_map, (__u64)group * fs->super->s_inodes_per_group + 1, fs->super->s_inodes_per_group, batch->ibits);
+		if (retval)
+			return retval;
+		batch->ibits_group = group;
+		batch->ibits_loaded = 1;
+	}
+	if (inuse > 0)
+		batch->ibits[bit >> 3] |= 1 << (bit & 7);
+	else
+		batch->ibits[bit >> 3] &= ~(1 << (bit & 7));
+
+	batch->free_inodes[group] -= inuse;
+	if (isdir)
+		batch->used_dirs[group] += inuse;
+	if (ino > batch->last_ino[group])
+		batch->last_ino[group] = ino;
+	batch->sb_free_inodes -= inuse;
+	mark_group_dirty(batch, group, GROUP_INODES_DIRTY);
+	return 0;
+}
+
+/*
+ * Apply the accumulated statistics to the group descriptors and the
+ * superblock, computing the checksum of each touched group once.
+ */
+errcode_t alloc_stats_flush(alloc_stats_batch_t batch)
+{
+	ext2_filsys fs = batch->fs;
+	ext2_ino_t ipg = fs->super->s_inodes_per_group, first_unused;
+	dgrp_t i, group;
+	int touched = 0;
+	errcode_t retval;
+
+	retval = store_inode_bits(batch);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < batch->num_dirty; i++) {
+		group = batch->dirty_list[i];
+		touched |= batch->dirty[group];
+		if (batch->dirty[group] & GROUP_BLOCKS_DIRTY) {
+			ext2fs_bg_free_blocks_count_set(fs, group, ext2fs_bg_free_blocks_count(fs, group) + batch->free_blocks[group]);
+			ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
+		}
+		if (batch->dirty[group] & GROUP_INODES_DIRTY) {
+			ext2fs_bg_free_inodes_count_set(fs, group, ext2fs_bg_free_inodes_count(fs, group) + batch->free_inodes[group]);
+			ext2fs_bg_used_dirs_count_set(fs, group, ext2fs_bg_used_dirs_count(fs, group) + batch->used_dirs[group]);
+			ext2fs_bg_flags_clear(fs, group, EXT2_BG_INODE_UNINIT);
+			if (ext2fs_has_group_desc_csum(fs)) {
+				first_unused = ipg - ext2fs_bg_itable_unused(fs, group) + group * ipg + 1;
+				if (batch->last_ino[group] >= first_unused)
+					ext2fs_bg_itable_unused_set(fs, group, group * ipg + ipg - batch->last_ino[group]);
+			}
+		}
+		ext2fs_group_desc_csum_set(fs, group);
+		batch->free_blocks[group] = 0;
+		batch->free_inodes[group] = 0;
+		batch->used_dirs[group] = 0;
+		batch->last_ino[group] = 0;
+		batch->dirty[group] = 0;
+	}
+
+	if (touched & GROUP_BLOCKS_DIRTY) {
+		ext2fs_free_blocks_count_add(fs->super, batch->sb_free_blocks);
+		ext2fs_mark_bb_dirty(fs);
+	}
+	if (touched & GROUP_INODES_DIRTY)
+		fs->super->s_free_inodes_count += batch->sb_free_inodes;
+	if (touched)
+		ext2fs_mark_super_dirty(fs);
+	batch->sb_free_blocks = 0;
+	batch->sb_free_inodes = 0;
+	batch->num_dirty = 0;
+	return 0;
+}
+
+/*flush and free the batch; the statistics are lost if the flush fails */
+errcode_t alloc_stats_close(alloc_stats_batch_t *ret)
+{
+	alloc_stats_batch_t batch = *ret;
+	errcode_t retval = 0;
+
+	if (!batch)
+		return 0;
+	if (batch->dirty)
+		retval = alloc_stats_flush(batch);
+	free(batch->free_blocks);
+	free(batch->free_inodes);
+	free(batch->used_dirs);
+	free(batch->last_ino);
+	free(batch->dirty);
+	free(batch->dirty_list);
+	free(batch->ibits);
+	batches_mem -= batch->mem_bytes;
+	mem_account("allocation statistics batches", batches_mem);
+	ext2fs_free_mem(&batch);
+	*ret = NULL;
+	return retval;
+}
@@ -0,0 +1,382 @@
+/*
+ * batch.c --- convert many filesystems in one run
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * The manifest lists one filesystem per line:
+ *
+ *	device -r|-c value [controller]
+ *
+ * Every filesystem is planned before any of them is modified. The
+ * conversions then run as child processes, at most max_jobs at a time and
+ * at most jobs_per_controller on the same disk controller, and within the
+ * memory limit if one is set. The biggest filesystems are started first.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+
+#define BATCH_MAX_JOBS	1024
+
+enum job_state {
+	job_pending,
+	job_unchanged,
+	job_running,
+	job_done,
+	job_failed
+};
+
+struct batch_job {
+	char		*device;
+	int		ratio_type;
+	unsigned long long value;
+	char		controller[64];
+	unsigned int	new_inodes_per_group;
+	unsigned int	old_inodes, new_inodes;
+	unsigned long long mem_estimate;
+	__u64		used_blocks;
+	char		log_file[PATH_MAX];
+	enum job_state	state;
+	pid_t		pid;
+	int		exit_code;
+	struct timeval	start, end;
+};
+
+static double elapsed(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/*
+ * The controller of a block device is the last PCI function in its sysfs
+ * path (the HBA or the NVMe controller). Image files share the device
+ * that holds them.
+ */
+static void find_controller(const char *device, char *controller, size_t len)
+{
+	char path[PATH_MAX], real[PATH_MAX], *comp, *save = NULL;
+	unsigned int dom, bus, slot, func;
+	struct stat st;
+
+	if (stat(device, &st) < 0) {
+		snprintf(controller, len, "%s", device);
+		return;
+	}
+	if (!S_ISBLK(st.st_mode)) {
+		snprintf(controller, len, "dev:%u:%u", major(st.st_dev), minor(st.st_dev));
+		return;
+	}
+	snprintf(controller, len, "blk:%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(path, real))
+		return;
+	for (comp = strtok_r(real, "/", &save); comp; comp = strtok_r(NULL, "/", &save))
+		if (sscanf(comp, "%4x:%2x:%2x.%1x", &dom, &bus, &slot, &func) == 4 && strlen(comp) == 12)
+			snprintf(controller, len, "pci:%s", comp);
+}
+
+static int read_manifest(const char *manifest, struct batch_job *jobs)
+{
+	FILE *f = fopen(manifest, "r");
+	char line[PATH_MAX + 128], device[PATH_MAX], mode[8], controller[64];
+	int num_jobs = 0, lineno = 0, n;
+	unsigned long long value;
+
+	if (!f) {
+		com_err(program_name, errno, _("while opening the manifest %s"), manifest);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\n")] == 0)
+			continue;
+		n = sscanf(line, "%4095s %7s %llu %63s", device, mode, &value, controller);
+		if (n < 3 || (strcmp(mode, "-r") && strcmp(mode, "-c"))) {
+			fprintf(stderr, _("%s:%d: expected 'device -r|-c value [controller]'\n"), manifest, lineno);
+			num_jobs = -1;
+			break;
+		}
+		if (num_jobs == BATCH_MAX_JOBS) {
+			fprintf(stderr, _("%s: more than %d filesystems\n"), manifest, BATCH_MAX_JOBS);
+			num_jobs = -1;
+			break;
+		}
+		jobs[num_jobs].device = strdup(device);
+		if (!jobs[num_jobs].device) {
+			com_err(program_name, ENOMEM, _("while reading the manifest %s"), manifest);
+			num_jobs = -1;
+			break;
+		}
+		jobs[num_jobs].ratio_type = (mode[1] == 'r');
+		jobs[num_jobs].value = value;
+		if (n == 4)
+			snprintf(jobs[num_jobs].controller, sizeof(jobs[num_jobs].controller), "%s", controller);
+		else
+			find_controller(device, jobs[num_jobs].controller, sizeof(jobs[num_jobs].controller));
+		num_jobs++;
+	}
+	fclose(f);
+	return num_jobs;
+}
+
+/*
+ * Compute the new geometry of a filesystem, read-only. As in the single
+ * filesystem mode, an invalid request stops the program: nothing has
+ * been modified yet.
+ */
+static errcode_t plan_job(struct batch_job *job, struct batch_options *opts)
+{
+	ext2_filsys fs;
+	int mount_flags;
+	errcode_t retval;
+
+	retval = ext2fs_check_if_mounted(job->device, &mount_flags);
+	if (retval)
+		return retval;
+	if (mount_flags & EXT2_MF_MOUNTED) {
+		printf("%s is mounted. Online change is not supported\n", job->device);
+		return EBUSY;
+	}
+	retval = ext2fs_open2(job->device, NULL, EXT2_FLAG_64BITS, 0, 0, unix_io_manager, &fs);
+	if (retval)
+		return retval;
+
+	retval = calculate_new_inodes_per_group(fs, job->ratio_type, job->value, &job->new_inodes_per_group, opts->force);
+	if (!retval) {
+		job->old_inodes = fs->super->s_inodes_count;
+		job->new_inodes = job->new_inodes_per_group * fs->group_desc_count;
+		job->used_blocks = ext2fs_blocks_count(fs->super) - ext2fs_free_blocks_count(fs->super);
+		job->mem_estimate = mem_plan_bitmaps(fs);
+		/*the child shrinks its block cache to fit, it doesn't fail for it */
+		job->mem_estimate += mem_plan_cache(job->mem_estimate);
+		if (job->new_inodes_per_group == fs->super->s_inodes_per_group)
+			job->state = job_unchanged;
+		/*it is started alone, and fits itself in the limit as it can */
+		if (mem_limit && job->mem_estimate > mem_limit)
+			printf("%s is not expected to fit in the memory limit (%llu MiB needed), it will run alone\n", job->device, job->mem_estimate >> 20);
+	}
+	ext2fs_close_free(&fs);
+	return retval;
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+	const struct batch_job *ja = a, *jb = b;
+
+	if (ja->used_blocks != jb->used_blocks)
+		return ja->used_blocks < jb->used_blocks ? 1 : -1;
+	return 0;
+}
+
+static int start_job(struct batch_job *job, struct batch_options *opts)
+{
+	char *args[32], value[32], mem[32], profile[PATH_MAX], debug[16], threads[16], readahead[32], cache[32];
+	const char *base = strrchr(job->device, '/') ? strrchr(job->device, '/') + 1 : job->device;
+	int i, n = 0, fd;
+
+	snprintf(job->log_file, sizeof(job->log_file), "%s/%s.log", opts->log_dir, base);
+	args[n++] = program_name;
+	if (opts->force)
+		args[n++] = "-f";
+	if (opts->flags & RESIZE_LAZY_ITABLE_INIT)
+		args[n++] = "-l";
+	for (i = RESIZE_LOG_INFO; i < opts->verbosity && n < 12; i++)
+		args[n++] = "-v";
+	if (opts->debug_flags) {
+		snprintf(debug, sizeof(debug), "%d", opts->debug_flags);
+		args[n++] = "-d";
+		args[n++] = debug;
+	}
+	if (mem_limit) {
+		snprintf(mem, sizeof(mem), "%llu", mem_limit);
+		args[n++] = "-m";
+		args[n++] = mem;
+	}
+	if (migrate_threads > 1) {
+		snprintf(threads, sizeof(threads), "%d", migrate_threads);
+		args[n++] = "-t";
+		args[n++] = threads;
+	}
+	if (readahead_depth != READAHEAD_DEFAULT_DEPTH) {
+		snprintf(readahead, sizeof(readahead), "%lu", readahead_depth);
+		args[n++] = "--readahead";
+		args[n++] = readahead;
+	}
+	if (!bulk_direct_io)
+		args[n++] = "--no-direct-io";
+	if (spill_dir) {
+		args[n++] = "--spill-dir";
+		args[n++] = (char *)spill_dir;
+	}
+	if (verify_mode)
+		args[n++] = "--verify";
+	if (cache_io_size != CACHE_IO_DEFAULT_SIZE) {
+		snprintf(cache, sizeof(cache), "%llu", cache_io_size);
+		args[n++] = "--cache";
+		args[n++] = cache;
+	}
+	if (opts->profile) {
+		snprintf(profile, sizeof(profile), "%s/%s.profile.json", opts->log_dir, base);
+		args[n++] = "-j";
+		args[n++] = profile;
+	}
+	snprintf(value, sizeof(value), "%llu", job->value);
+	args[n++] = job->ratio_type ? "-r" : "-c";
+	args[n++] = value;
+	args[n++] = job->device;
+	args[n] = NULL;
+
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	if (job->pid < 0)
+		return errno;
+	if (job->pid == 0) {
+		fd = open(job->log_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			_exit(126);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+		execv("/proc/self/exe", args);
+		execvp(program_name, args);
+		_exit(127);
+	}
+	gettimeofday(&job->start, 0);
+	job->state = job_running;
+	printf("[%s] started %s, log in %s\n", job->controller, job->device, job->log_file);
+	return 0;
+}
+
+static void print_report(struct batch_job *jobs, int num_jobs, struct timeval *start, struct timeval *end)
+{
+	static const char *state_names[] = { "not started", "unchanged", "running", "done", "FAILED" };
+	double sum = 0;
+	int i, failed = 0;
+
+	printf("\n%-24s %-20s %-11s %12s %12s %10s\n", "device", "controller", "status", "old inodes", "new inodes", "time (s)");
+	for (i = 0; i < num_jobs; i++) {
+		double t = (jobs[i].state == job_done || jobs[i].state == job_failed) ? elapsed(&jobs[i].start, &jobs[i].end) : 0;
+
+		sum += t;
+		failed += (jobs[i].state != job_done && jobs[i].state != job_unchanged);
+		printf("%-24s %-20s %-11s %12u %12u %10.1f", jobs[i].device, jobs[i].controller, state_names[jobs[i].state], jobs[i].old_inodes, jobs[i].new_inodes, t);
+		if (jobs[i].state == job_failed)
+			printf("  exit code %d, see %s", jobs[i].exit_code, jobs[i].log_file);
+		printf("\n");
+	}
+	printf("\n%d filesystems, %d failed. Elapsed %.1f s, %.1f s of conversions (x%.1f)\n",
+		num_jobs, failed, elapsed(start, end), sum, elapsed(start, end) > 0 ? sum / elapsed(start, end) : 0);
+}
+
+static int running_on(struct batch_job *jobs, int num_jobs, const char *controller)
+{
+	int i, n = 0;
+
+	for (i = 0; i < num_jobs; i++)
+		if (jobs[i].state == job_running && !strcmp(jobs[i].controller, controller))
+			n++;
+	return n;
+}
+
+int batch_main(const char *manifest, struct batch_options *opts)
+{
+	struct batch_job *jobs;
+	struct timeval start, end;
+	unsigned long long mem_in_use = 0;
+	int num_jobs, i, running = 0, status, ret = 0;
+	errcode_t retval;
+	pid_t pid;
+
+	jobs = calloc(BATCH_MAX_JOBS, sizeof(struct batch_job));
+	if (!jobs)
+		return 1;
+	num_jobs = read_manifest(manifest, jobs);
+	if (num_jobs <= 0) {
+		ret = 1;
+		goto out;
+	}
+	if (opts->max_jobs <= 0)
+		opts->max_jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (opts->jobs_per_controller <= 0)
+		opts->jobs_per_controller = 1;
+
+	/*plan everything before touching any filesystem */
+	for (i = 0; i < num_jobs; i++) {
+		printf("Planning %s (controller %s)\n", jobs[i].device, jobs[i].controller);
+		retval = plan_job(&jobs[i], opts);
+		if (retval) {
+			com_err(program_name, retval, _("while planning %s, no filesystem has been modified"), jobs[i].device);
+			ret = 1;
+			goto out;
+		}
+	}
+	qsort(jobs, num_jobs, sizeof(struct batch_job), compare_jobs);
+	printf("\nConverting %d filesystems, %d at a time, %d per controller\n", num_jobs, opts->max_jobs, opts->jobs_per_controller);
+
+	gettimeofday(&start, 0);
+	while (1) {
+		/*start whatever fits, biggest first */
+		for (i = 0; i < num_jobs && running < opts->max_jobs; i++) {
+			if (jobs[i].state != job_pending)
+				continue;
+			if (running_on(jobs, num_jobs, jobs[i].controller) >= opts->jobs_per_controller)
+				continue;
+			if (mem_limit && running && mem_in_use + jobs[i].mem_estimate > mem_limit)
+				continue;
+			retval = start_job(&jobs[i], opts);
+			if (retval) {
+				com_err(program_name, retval, _("while starting the conversion of %s"), jobs[i].device);
+				jobs[i].state = job_failed;
+				jobs[i].exit_code = -1;
+				gettimeofday(&jobs[i].start, 0);
+				jobs[i].end = jobs[i].start;
+				continue;
+			}
+			running++;
+			mem_in_use += jobs[i].mem_estimate;
+		}
+		if (!running)
+			break;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < num_jobs; i++) {
+			if (jobs[i].state != job_running || jobs[i].pid != pid)
+				continue;
+			gettimeofday(&jobs[i].end, 0);
+			jobs[i].exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			jobs[i].state = jobs[i].exit_code ? job_failed : job_done;
+			printf("[%s] %s %s in %.1f s\n", jobs[i].controller, jobs[i].device, jobs[i].exit_code ? "FAILED" : "finished", elapsed(&jobs[i].start, &jobs[i].end));
+			running--;
+			mem_in_use -= jobs[i].mem_estimate;
+		}
+	}
+
+	gettimeofday(&end, 0);
+	print_report(jobs, num_jobs, &start, &end);
+	for (i = 0; i < num_jobs; i++)
+		if (jobs[i].state != job_done && jobs[i].state != job_unchanged)
+			ret = 1;
+
+ out:
+	/*the manifest may have stopped half way: every device read so far was duplicated */
+	for (i = 0; i < BATCH_MAX_JOBS && jobs[i].device; i++)
+		free(jobs[i].device);
+	free(jobs);
+	return ret;
+}
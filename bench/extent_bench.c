@@ -0,0 +1,349 @@
+/*
+ * extent_bench.c --- microbenchmark of the extent.c translation map
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * Drives ext2fs_add_extent_entry(), ext2fs_extent_translate() and
+ * ext2fs_iterate_extent() with synthetic traces shaped like the maps
+ * built by the engines, and reports ns/op, memory and cache misses.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+#include <time.h>
+#include <sys/resource.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
+
+char *program_name = "extent_bench";
+
+/*
+ * A trace is a list of extents given by a deterministic generator, so
+ * that the biggest sizes don't need to be stored in memory twice.
+ */
+struct trace {
+	const char	*name;
+	const char	*desc;
+	/* size of the next extent and its locations */
+	void		(*next)(struct trace *t, __u64 *old_loc, __u64 *new_loc, __u64 *len);
+	__u64		old_cursor, new_cursor;
+	__u64		rng;
+	int		shuffled;
+};
+
+static __u64 xorshift(__u64 *state)
+{
+	__u64 x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/*
+ * reduce: the used inodes above the new inode count are packed in the
+ * free slots below it. Runs of used inodes are short, and so are the
+ * runs of free inodes they go to.
+ */
+static void next_dense_imap(struct trace *t, __u64 *old_loc, __u64 *new_loc, __u64 *len)
+{
+	*len = 1 + xorshift(&t->rng) % 8;
+	*old_loc = t->old_cursor;
+	*new_loc = t->new_cursor;
+	t->old_cursor += *len + xorshift(&t->rng) % 4;
+	t->new_cursor += *len + 1 + xorshift(&t->rng) % 16;
+}
+
+/*
+ * increase: the blocks in the way of the new inode tables are moved to
+ * wherever the allocator finds room. Runs are of very different sizes,
+ * and the destination jumps around.
+ */
+static void next_fragmented_bmap(struct trace *t, __u64 *old_loc, __u64 *new_loc, __u64 *len)
+{
+	__u64 r = xorshift(&t->rng);
+
+	*len = (r % 16) ? 1 + r % 4 : 1 + r % 256;
+	*old_loc = t->old_cursor;
+	if ((r >> 8) % 8 == 0)
+		t->new_cursor += xorshift(&t->rng) % 65536;
+	*new_loc = t->new_cursor;
+	t->old_cursor += *len + (xorshift(&t->rng) % 32);
+	t->new_cursor += *len;
+}
+
+static struct trace traces[] = {
+	{ "dense_imap", "inode map built by reduce", next_dense_imap, 0, 0, 0, 0 },
+	{ "fragmented_bmap", "block map built by increase", next_fragmented_bmap, 0, 0, 0, 0 },
+	{ "shuffled_bmap", "block map added out of order (needs a sort)", next_fragmented_bmap, 0, 0, 0, 1 },
+};
+
+#define FIRST_OLD_LOC	1000000
+#define FIRST_NEW_LOC	1000
+
+static void trace_reset(struct trace *t)
+{
+	t->old_cursor = FIRST_OLD_LOC;
+	t->new_cursor = FIRST_NEW_LOC;
+	t->rng = 88172645463325252ULL;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Memory in use in KiB: the heap in use if the C library can tell, the
+ * resident set otherwise (less precise, freed memory is not given back)
+ */
+static long memory_in_use_kb(void)
+{
+#ifdef HAVE_MALLINFO2
+	struct mallinfo2 mi = mallinfo2();
+
+	return (mi.uordblks + mi.hblkhd) / 1024;
+#else
+	FILE *f = fopen("/proc/self/statm", "r");
+	long size, resident = 0;
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+}
+
+/*
+ * Cache misses of this process, through perf_event_open(). Not every
+ * system allows it (perf_event_paranoid, containers): -1 then.
+ */
+static int perf_fd = -1;
+
+static void cache_misses_init(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static long long cache_misses(void)
+{
+	long long count;
+
+	if (perf_fd < 0 || read(perf_fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+
+struct measure {
+	double		start_ns;
+	long long	start_misses;
+};
+
+static void measure_start(struct measure *m)
+{
+	m->start_misses = cache_misses();
+	m->start_ns = now_ns();
+}
+
+static void measure_report(struct measure *m, const char *trace, __u64 extents, const char *op, __u64 ops, long mem_kb)
+{
+	double ns = now_ns() - m->start_ns;
+	long long misses = cache_misses();
+
+	printf("%-16s %11llu %-16s %12llu %10.1f", trace, (unsigned long long) extents, op, (unsigned long long) ops, ops ? ns / ops : 0);
+	if (misses >= 0 && m->start_misses >= 0)
+		printf(" %12.3f", ops ? (double) (misses - m->start_misses) / ops : 0);
+	else
+		printf(" %12s", "n/a");
+	printf(" %10.1f\n", mem_kb / 1024.0);
+	fflush(stdout);
+}
+
+static void run(struct trace *t, __u64 num_extents, __u64 lookups)
+{
+	ext2_extent map;
+	struct measure m;
+	__u64 i, j, old_loc, new_loc, len, adds = 0, found = 0, last_old;
+	__u64 *order = NULL;
+	long mem_before, mem_kb;
+	errcode_t retval;
+
+	/*
+	 * A shuffled trace adds the extents in a random order of chunks of
+	 * 1024 extents, the generator being sequential by nature.
+	 */
+	if (t->shuffled) {
+		__u64 chunks = (num_extents + 1023) / 1024, tmp, k;
+
+		order = malloc(chunks * sizeof(__u64));
+		if (!order) {
+			com_err(program_name, ENOMEM, "while shuffling the trace");
+			exit(1);
+		}
+		for (i = 0; i < chunks; i++)
+			order[i] = i;
+		trace_reset(t);
+		for (i = chunks - 1; i > 0; i--) {
+			k = xorshift(&t->rng) % (i + 1);
+			tmp = order[i];
+			order[i] = order[k];
+			order[k] = tmp;
+		}
+	}
+
+	mem_before = memory_in_use_kb();
+	retval = ext2fs_create_extent_table(&map, 0);
+	if (retval) {
+		com_err(program_name, retval, "while creating the extent table");
+		exit(1);
+	}
+
+	trace_reset(t);
+	measure_start(&m);
+	if (!t->shuffled) {
+		for (i = 0; i < num_extents; i++) {
+			t->next(t, &old_loc, &new_loc, &len);
+			for (j = 0; j < len; j++)
+				ext2fs_add_extent_entry(map, old_loc + j, new_loc + j);
+			adds += len;
+		}
+	} else {
+		/* chunk c starts at a fixed offset: replay the generator from there */
+		__u64 c, chunks = (num_extents + 1023) / 1024;
+
+		for (c = 0; c < chunks; c++) {
+			t->old_cursor = FIRST_OLD_LOC + order[c] * 1024 * 512;
+			t->new_cursor = FIRST_NEW_LOC + order[c] * 1024 * 512;
+			for (i = 0; i < 1024 && order[c] * 1024 + i < num_extents; i++) {
+				t->next(t, &old_loc, &new_loc, &len);
+				for (j = 0; j < len; j++)
+					ext2fs_add_extent_entry(map, old_loc + j, new_loc + j);
+				adds += len;
+			}
+		}
+	}
+	last_old = t->shuffled ? FIRST_OLD_LOC + num_extents * 512 : t->old_cursor;
+	mem_kb = memory_in_use_kb() - mem_before;
+	measure_report(&m, t->name, num_extents, "add", adds, mem_kb);
+
+	/* the first lookup sorts the table if needed */
+	measure_start(&m);
+	ext2fs_extent_translate(map, FIRST_OLD_LOC);
+	measure_report(&m, t->name, num_extents, "first_translate", 1, mem_kb);
+
+	/* sequential: every location in order, as the inode scan does */
+	measure_start(&m);
+	for (i = 0, old_loc = FIRST_OLD_LOC; i < lookups; i++, old_loc++) {
+		if (old_loc >= last_old)
+			old_loc = FIRST_OLD_LOC;
+		found += !!ext2fs_extent_translate(map, old_loc);
+	}
+	measure_report(&m, t->name, num_extents, "translate_seq", lookups, mem_kb);
+
+	/* random: as the directory entries do */
+	trace_reset(t);
+	measure_start(&m);
+	for (i = 0; i < lookups; i++)
+		found += !!ext2fs_extent_translate(map, FIRST_OLD_LOC + xorshift(&t->rng) % (last_old - FIRST_OLD_LOC));
+	measure_report(&m, t->name, num_extents, "translate_rand", lookups, mem_kb);
+
+	/* mixed: 90% sequential, 10% random */
+	trace_reset(t);
+	measure_start(&m);
+	for (i = 0, old_loc = FIRST_OLD_LOC; i < lookups; i++) {
+		if (xorshift(&t->rng) % 10 == 0) {
+			found += !!ext2fs_extent_translate(map, FIRST_OLD_LOC + xorshift(&t->rng) % (last_old - FIRST_OLD_LOC));
+			continue;
+		}
+		if (++old_loc >= last_old)
+			old_loc = FIRST_OLD_LOC;
+		found += !!ext2fs_extent_translate(map, old_loc);
+	}
+	measure_report(&m, t->name, num_extents, "translate_mixed", lookups, mem_kb);
+
+	measure_start(&m);
+	ext2fs_iterate_extent(map, 0, 0, 0);
+	for (i = 0; ; i++) {
+		ext2fs_iterate_extent(map, &old_loc, &new_loc, &len);
+		if (!len)
+			break;
+	}
+	measure_report(&m, t->name, num_extents, "iterate", i, mem_kb);
+
+	/* keep the compiler from dropping the lookups */
+	if (found == (__u64) -1)
+		printf("%llu\n", (unsigned long long) found);
+
+	ext2fs_free_extent_table(map);
+	free(order);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-t trace] [-m max_extents] [-l lookups]\n\ttraces:", program_name);
+	for (unsigned int i = 0; i < sizeof(traces) / sizeof(traces[0]); i++)
+		fprintf(stderr, " %s", traces[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+	__u64 max_extents = 1000000, lookups = 1000000, size;
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:m:l:")) != EOF) {
+		switch (c) {
+		case 't':
+			only = optarg;
+			break;
+		case 'm':
+			max_extents = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			lookups = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	cache_misses_init();
+	printf("%-16s %11s %-16s %12s %10s %12s %10s\n", "trace", "extents", "op", "ops", "ns/op", "misses/op", "mem_MiB");
+	for (i = 0; i < sizeof(traces) / sizeof(traces[0]); i++) {
+		if (only && strcmp(only, traces[i].name))
+			continue;
+		for (size = 1000; size <= max_extents; size *= 10)
+			run(&traces[i], size, lookups);
+	}
+	return 0;
+}
@@ -0,0 +1,539 @@
+/*
+ * mkbenchfs.c --- build synthetic ext4 images for benchmarking
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * The image is created directly through libext2fs: no root privileges,
+ * loop mounts or real file contents are needed, and the same parameters
+ * and seed always give the same filesystem layout.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifndef _LARGEFILE_SOURCE
+#define _LARGEFILE_SOURCE
+#endif
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+
+#include <errno.h>
+
+#if EXT2_FLAT_INCLUDES
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#else
+#include "ext2fs/ext2_fs.h"
+#include "ext2fs/ext2fs.h"
+#endif
+
+/* blocks allocated at once when laying out a file, the unit of fragmentation */
+#define CHUNK_BLOCKS	16
+
+enum size_dist {
+	SIZE_FIXED,
+	SIZE_UNIFORM,
+	SIZE_EXP
+};
+
+struct bench_params {
+	const char	*image;
+	unsigned long long size;		/* bytes */
+	unsigned int	blocksize;
+	unsigned int	inode_ratio;
+	unsigned int	inode_size;
+	unsigned long	used_inodes;
+	unsigned int	fanout;			/* entries per directory */
+	unsigned int	dir_percent;		/* % of the inodes that are directories */
+	enum size_dist	dist;
+	unsigned long long size_a, size_b;	/* bytes, meaning depends on dist */
+	unsigned int	xattr_percent;		/* % of the files with an xattr */
+	unsigned int	xattr_size;
+	int		flexbg_size;		/* 0: no flex_bg */
+	int		cluster_bits;		/* 0: no bigalloc */
+	int		meta_bg;
+	int		csum;
+	unsigned int	frag_percent;		/* % of chunks placed at a random spot */
+	long		seed;
+};
+
+static char *program_name = "mkbenchfs";
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-b blocksize] [-i inode_ratio] [-I inode_size] [-n used_inodes]\n"
+		"\t[-D fanout] [-p dir_percent] [-s fixed:N|uniform:MIN:MAX|exp:MEAN]\n"
+		"\t[-x percent:size] [-G flexbg_size] [-C cluster_bits] [-M] [-c] [-F frag_percent]\n"
+		"\t[-S seed] image size\n", program_name);
+	exit(1);
+}
+
+static unsigned long long parse_size(const char *str)
+{
+	char *end;
+	unsigned long long val = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'T': case 't':
+		val <<= 10;
+		/* fallthrough */
+	case 'G': case 'g':
+		val <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		val <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		val <<= 10;
+		break;
+	case 0:
+		break;
+	default:
+		fprintf(stderr, "%s: bad size '%s'\n", program_name, str);
+		exit(1);
+	}
+	return val;
+}
+
+static void parse_dist(struct bench_params *p, char *str)
+{
+	char *arg = strchr(str, ':');
+
+	if (!arg)
+		usage();
+	*arg++ = 0;
+	if (!strcmp(str, "fixed")) {
+		p->dist = SIZE_FIXED;
+		p->size_a = parse_size(arg);
+	} else if (!strcmp(str, "uniform")) {
+		char *max = strchr(arg, ':');
+
+		if (!max)
+			usage();
+		*max++ = 0;
+		p->dist = SIZE_UNIFORM;
+		p->size_a = parse_size(arg);
+		p->size_b = parse_size(max);
+	} else if (!strcmp(str, "exp")) {
+		p->dist = SIZE_EXP;
+		p->size_a = parse_size(arg);
+	} else
+		usage();
+}
+
+static unsigned long long pick_file_size(struct bench_params *p)
+{
+	switch (p->dist) {
+	case SIZE_UNIFORM:
+		if (p->size_b <= p->size_a)
+			return p->size_a;
+		return p->size_a + (unsigned long long)(drand48() * (p->size_b - p->size_a));
+	case SIZE_EXP:
+		return (unsigned long long)(-log(1.0 - drand48()) * p->size_a);
+	default:
+		return p->size_a;
+	}
+}
+
+/*
+ * Lay out the blocks of the file in chunks. Each chunk continues the
+ * previous one, or goes to a random spot with probability frag_percent.
+ */
+static errcode_t allocate_file_blocks(ext2_filsys fs, struct bench_params *p, ext2_ino_t ino, blk64_t nblocks)
+{
+	blk64_t lblk = 0, len, goal = ext2fs_find_inode_goal(fs, ino, NULL, 0);
+	errcode_t retval;
+
+	while (lblk < nblocks) {
+		len = nblocks - lblk;
+		if (len > CHUNK_BLOCKS)
+			len = CHUNK_BLOCKS;
+		if (p->frag_percent && (unsigned int)(lrand48() % 100) < p->frag_percent)
+			goal = fs->super->s_first_data_block + lrand48() % (ext2fs_blocks_count(fs->super) - fs->super->s_first_data_block);
+		retval = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_INIT, ino, NULL, goal, lblk, len);
+		if (retval)
+			return retval;
+		lblk += len;
+		goal += len;
+	}
+	return 0;
+}
+
+static errcode_t add_xattr(ext2_filsys fs, struct bench_params *p, ext2_ino_t ino, char *value)
+{
+	struct ext2_xattr_handle *h;
+	errcode_t retval;
+
+	retval = ext2fs_xattrs_open(fs, ino, &h);
+	if (retval)
+		return retval;
+	retval = ext2fs_xattrs_read(h);
+	if (!retval)
+		retval = ext2fs_xattr_set(h, "user.bench", value, p->xattr_size);
+	ext2fs_xattrs_close(&h);
+	return retval;
+}
+
+static errcode_t link_entry(ext2_filsys fs, ext2_ino_t dir, const char *name, ext2_ino_t ino, int filetype)
+{
+	errcode_t retval;
+
+	retval = ext2fs_link(fs, dir, name, ino, filetype);
+	if (retval == EXT2_ET_DIR_NO_SPACE) {
+		retval = ext2fs_expand_dir(fs, dir);
+		if (retval)
+			return retval;
+		retval = ext2fs_link(fs, dir, name, ino, filetype);
+	}
+	return retval;
+}
+
+static errcode_t create_file(ext2_filsys fs, struct bench_params *p, ext2_ino_t dir, unsigned long num, char *xattr_value)
+{
+	struct ext2_inode inode;
+	ext2_ino_t ino;
+	unsigned long long size;
+	char name[32];
+	errcode_t retval;
+
+	retval = ext2fs_new_inode(fs, dir, LINUX_S_IFREG | 0644, 0, &ino);
+	if (retval)
+		return retval;
+	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+
+	memset(&inode, 0, sizeof(inode));
+	inode.i_mode = LINUX_S_IFREG | 0644;
+	inode.i_links_count = 1;
+	inode.i_atime = inode.i_ctime = inode.i_mtime = fs->now ? fs->now : time(0);
+	if (ext2fs_has_feature_extents(fs->super)) {
+		ext2_extent_handle_t handle;
+
+		retval = ext2fs_extent_open2(fs, ino, &inode, &handle);
+		if (retval)
+			return retval;
+		ext2fs_extent_free(handle);
+	}
+	retval = ext2fs_write_new_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+	snprintf(name, sizeof(name), "f%lu", num);
+	retval = link_entry(fs, dir, name, ino, EXT2_FT_REG_FILE);
+	if (retval)
+		return retval;
+
+	size = pick_file_size(p);
+	if (size) {
+		retval = allocate_file_blocks(fs, p, ino, (size + fs->blocksize - 1) / fs->blocksize);
+		if (retval)
+			return retval;
+		retval = ext2fs_read_inode(fs, ino, &inode);
+		if (retval)
+			return retval;
+		retval = ext2fs_inode_size_set(fs, &inode, size);
+		if (retval)
+			return retval;
+		retval = ext2fs_write_inode(fs, ino, &inode);
+		if (retval)
+			return retval;
+	}
+
+	if (p->xattr_percent && (unsigned int)(lrand48() % 100) < p->xattr_percent)
+		return add_xattr(fs, p, ino, xattr_value);
+	return 0;
+}
+
+/*
+ * Fill the tree breadth first: each directory gets up to fanout entries,
+ * the new directories are queued to be filled in turn.
+ */
+static errcode_t populate(ext2_filsys fs, struct bench_params *p)
+{
+	ext2_ino_t *queue, ino;
+	unsigned long head = 0, tail = 0, used, entries = 0;
+	char name[32], *xattr_value = NULL;
+	errcode_t retval = 0;
+
+	queue = malloc(sizeof(ext2_ino_t) * (p->used_inodes + 1));
+	if (!queue)
+		return ENOMEM;
+	if (p->xattr_percent) {
+		xattr_value = malloc(p->xattr_size);
+		if (!xattr_value) {
+			retval = ENOMEM;
+			goto out;
+		}
+		memset(xattr_value, 'x', p->xattr_size);
+	}
+	queue[tail++] = EXT2_ROOT_INO;
+
+	for (used = 0; used < p->used_inodes; used++) {
+		if (entries == p->fanout && head + 1 < tail) {
+			head++;
+			entries = 0;
+		}
+		if ((unsigned int)(lrand48() % 100) < p->dir_percent) {
+			retval = ext2fs_new_inode(fs, queue[head], LINUX_S_IFDIR | 0755, 0, &ino);
+			if (retval)
+				goto out;
+			snprintf(name, sizeof(name), "d%lu", used);
+			retval = ext2fs_mkdir(fs, queue[head], ino, name);
+			if (retval)
+				goto out;
+			queue[tail++] = ino;
+		} else {
+			retval = create_file(fs, p, queue[head], used, xattr_value);
+			if (retval)
+				goto out;
+		}
+		entries++;
+
+		if ((used + 1) % 100000 == 0) {
+			printf("\r%lu/%lu inodes", used + 1, p->used_inodes);
+			fflush(stdout);
+		}
+	}
+	printf("\r%lu/%lu inodes\n", used, p->used_inodes);
+
+out:
+	free(queue);
+	free(xattr_value);
+	return retval;
+}
+
+static errcode_t create_base_dirs(ext2_filsys fs)
+{
+	ext2_ino_t ino;
+	errcode_t retval;
+	int i;
+
+	retval = ext2fs_mkdir(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_mkdir(fs, EXT2_ROOT_INO, 0, "lost+found");
+	if (retval)
+		return retval;
+	retval = ext2fs_lookup(fs, EXT2_ROOT_INO, "lost+found", 10, 0, &ino);
+	if (retval)
+		return retval;
+	/* same as mke2fs: give lost+found at least 16k */
+	for (i = 1; i < EXT2_NDIR_BLOCKS && (unsigned int)i * fs->blocksize < 16384; i++) {
+		retval = ext2fs_expand_dir(fs, ino);
+		if (retval)
+			return retval;
+	}
+
+	for (ino = EXT2_ROOT_INO + 1; ino < EXT2_FIRST_INODE(fs->super); ino++)
+		ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	ext2fs_mark_inode_bitmap2(fs->inode_map, EXT2_BAD_INO);
+	ext2fs_inode_alloc_stats2(fs, EXT2_BAD_INO, +1, 0);
+	return ext2fs_update_bb_inode(fs, 0);
+}
+
+static errcode_t make_image(struct bench_params *p)
+{
+	struct ext2_super_block param;
+	ext2_filsys fs;
+	errcode_t retval;
+	unsigned long long blocks = p->size / p->blocksize;
+	dgrp_t group;
+	int fd, i;
+
+	fd = open(p->image, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+		return errno;
+	/* sparse: everything reads as zeroes, including the inode tables */
+	if (ftruncate(fd, p->size)) {
+		close(fd);
+		return errno;
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	param.s_rev_level = EXT2_DYNAMIC_REV;
+	param.s_log_block_size = ffs(p->blocksize >> EXT2_MIN_BLOCK_LOG_SIZE) - 1;
+	ext2fs_blocks_count_set(&param, blocks);
+	param.s_inodes_count = p->size / p->inode_ratio;
+	param.s_inode_size = p->inode_size;
+	param.s_min_extra_isize = param.s_want_extra_isize = p->inode_size > EXT2_GOOD_OLD_INODE_SIZE ? 32 : 0;
+
+	ext2fs_set_feature_filetype(&param);
+	ext2fs_set_feature_sparse_super(&param);
+	ext2fs_set_feature_large_file(&param);
+	ext2fs_set_feature_dir_nlink(&param);
+	ext2fs_set_feature_huge_file(&param);
+	ext2fs_set_feature_extents(&param);
+	ext2fs_set_feature_xattr(&param);
+	if (p->inode_size > EXT2_GOOD_OLD_INODE_SIZE)
+		ext2fs_set_feature_extra_isize(&param);
+	if (blocks > 0xFFFFFFFFULL)
+		ext2fs_set_feature_64bit(&param);
+	if (p->csum)
+		ext2fs_set_feature_metadata_csum(&param);
+	if (p->flexbg_size) {
+		ext2fs_set_feature_flex_bg(&param);
+		param.s_log_groups_per_flex = ffs(p->flexbg_size) - 1;
+	}
+	if (p->cluster_bits) {
+		ext2fs_set_feature_bigalloc(&param);
+		param.s_log_cluster_size = param.s_log_block_size + p->cluster_bits;
+	}
+	if (p->meta_bg)
+		ext2fs_set_feature_meta_bg(&param);
+
+	retval = ext2fs_initialize(p->image, EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_64BITS, &param, unix_io_manager, &fs);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < 16; i++) {
+		fs->super->s_uuid[i] = lrand48();
+		((unsigned char *) fs->super->s_hash_seed)[i] = lrand48();
+	}
+	fs->super->s_def_hash_version = EXT2_HASH_HALF_MD4;
+	ext2fs_init_csum_seed(fs);
+
+	retval = ext2fs_allocate_tables(fs);
+	if (retval)
+		goto errout;
+	retval = ext2fs_convert_subcluster_bitmap(fs, &fs->block_map);
+	if (retval)
+		goto errout;
+	for (group = 0; group < fs->group_desc_count; group++) {
+		ext2fs_bg_flags_set(fs, group, EXT2_BG_INODE_ZEROED);
+		ext2fs_group_desc_csum_set(fs, group);
+	}
+
+	retval = create_base_dirs(fs);
+	if (retval)
+		goto errout;
+	retval = populate(fs, p);
+	if (retval)
+		goto errout;
+
+	/* leave it as freshly checked, so the tool accepts it without fsck */
+	fs->super->s_mtime = fs->super->s_lastcheck = time(0);
+	fs->super->s_state = EXT2_VALID_FS;
+	ext2fs_mark_super_dirty(fs);
+	return ext2fs_close_free(&fs);
+
+errout:
+	ext2fs_free(fs);
+	return retval;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_params p;
+	char *arg;
+	errcode_t retval;
+	int c;
+
+	memset(&p, 0, sizeof(p));
+	p.blocksize = 4096;
+	p.inode_ratio = 16384;
+	p.inode_size = 256;
+	p.used_inodes = 10000;
+	p.fanout = 100;
+	p.dir_percent = 10;
+	p.dist = SIZE_EXP;
+	p.size_a = 64 * 1024;
+	p.xattr_size = 64;
+	p.flexbg_size = 16;
+	p.csum = 1;
+	p.seed = 1;
+
+	add_error_table(&et_ext2_error_table);
+	if (argc && *argv)
+		program_name = *argv;
+
+	while ((c = getopt(argc, argv, "b:i:I:n:D:p:s:x:G:C:McF:S:")) != EOF) {
+		switch (c) {
+		case 'b':
+			p.blocksize = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			p.inode_ratio = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			p.inode_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			p.used_inodes = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			p.fanout = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			p.dir_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			parse_dist(&p, optarg);
+			break;
+		case 'x':
+			arg = strchr(optarg, ':');
+			if (!arg)
+				usage();
+			p.xattr_percent = strtoul(optarg, NULL, 0);
+			p.xattr_size = strtoul(arg + 1, NULL, 0);
+			break;
+		case 'G':
+			p.flexbg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			p.cluster_bits = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			p.meta_bg = 1;
+			break;
+		case 'c':
+			p.csum = 0;
+			break;
+		case 'F':
+			p.frag_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			p.seed = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 2 != argc)
+		usage();
+	p.image = argv[optind];
+	p.size = parse_size(argv[optind + 1]);
+
+	if (p.blocksize < EXT2_MIN_BLOCK_SIZE || p.blocksize > EXT2_MAX_BLOCK_SIZE || (p.blocksize & (p.blocksize - 1))) {
+		fprintf(stderr, "%s: invalid blocksize %u\n", program_name, p.blocksize);
+		exit(1);
+	}
+	if (p.flexbg_size & (p.flexbg_size - 1)) {
+		fprintf(stderr, "%s: the flex_bg size must be a power of 2\n", program_name);
+		exit(1);
+	}
+	if (p.dir_percent > 100 || p.frag_percent > 100 || p.xattr_percent > 100 || !p.fanout) {
+		fprintf(stderr, "%s: percentages must be in 0-100 and the fanout at least 1\n", program_name);
+		exit(1);
+	}
+	srand48(p.seed);
+
+	retval = make_image(&p);
+	if (retval) {
+		com_err(program_name, retval, "while creating %s", p.image);
+		exit(1);
+	}
+	remove_error_table(&et_ext2_error_table);
+	return 0;
+}
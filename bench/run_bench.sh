@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Build synthetic filesystems with mkbenchfs, run inode_count_modifier on
+# them and print the time spent in each phase. No root privileges needed.
+#
+
+LANG=C
+
+if [ "$#" -lt 2 ]; then
+    echo "Need at least two parameters: [full path of the binary to be tested] [full path of mkbenchfs] [workload file] [scratch dir]"
+    echo "Example:"
+    echo $0 " /usr/bin/inode_count_modifier ./mkbenchfs bench/workloads.txt /tmp/bench"
+    exit -1
+fi
+
+path_to_bin=$1
+path_to_mkbenchfs=$2
+workloads=${3:-$(dirname "$0")/workloads.txt}
+scratch=${4:-/tmp/inode_count_modifier_bench}
+results=${scratch}/results.$(date +%Y%m%d-%H%M%S)
+
+mkdir -p ${scratch} ${results} || exit 1
+
+# print the phase tree of a profile: one line per phase, indented by depth
+print_phases() {
+	grep '"name"' $1 | sed -e 's/^\( *\){"name": "\([^"]*\)", "calls": \([0-9]*\), "wall": \([0-9.]*\).*"items": \([0-9]*\).*/\1\2 \3 \4 \5/' | \
+		awk '{ match($0, /^ */); printf("  %-*s%-*s %8s calls %10.3f s %12s items\n", RLENGTH - 4, "", 50 - RLENGTH, $1, $2, $3, $4) }'
+}
+
+run_step() {
+	local name=$1 step=$2 ratio=$3 image=$4
+
+	/usr/bin/time -f "%e s, max rss %M KiB" -o ${results}/${name}.${step}.time \
+		$path_to_bin -j ${results}/${name}.${step}.json -r $ratio $image > ${results}/${name}.${step}.log 2>&1 \
+		|| { echo "$name: $step to ratio $ratio failed, see ${results}/${name}.${step}.log" ; return 1; }
+	e2fsck -fn $image > ${results}/${name}.${step}.fsck 2>&1 \
+		|| { echo "$name: e2fsck failed after $step, see ${results}/${name}.${step}.fsck" ; return 1; }
+	echo "$name: $step to ratio $ratio: $(cat ${results}/${name}.${step}.time)"
+	print_phases ${results}/${name}.${step}.json
+}
+
+rc=0
+while IFS=';' read -r name options size increase_ratio reduce_ratio; do
+	[ -z "$name" ] || [ "${name:0:1}" == "#" ] && continue
+	image=${scratch}/${name}.img
+
+	$path_to_mkbenchfs $options $image $size > ${results}/${name}.mkbenchfs.log 2>&1 \
+		|| { echo "$name: mkbenchfs failed, see ${results}/${name}.mkbenchfs.log" ; rc=1; continue; }
+	e2fsck -fn $image > ${results}/${name}.mkbenchfs.fsck 2>&1 \
+		|| { echo "$name: the generated image is not clean, see ${results}/${name}.mkbenchfs.fsck" ; rc=1; continue; }
+
+	run_step $name increase $increase_ratio $image || { rc=1; continue; }
+	run_step $name reduce $reduce_ratio $image || rc=1
+	rm -f $image
+done < $workloads
+
+echo "Profiles and logs kept in ${results}"
+exit $rc
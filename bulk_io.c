@@ -0,0 +1,152 @@
+/*
+ * bulk_io.c --- direct I/O path for the bulk copies
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * The relocated blocks, the moved and migrated itables and the zeroes
+ * written to new itables are read or written once. Going through the page
+ * cache, they evict everything else on the host and every byte is copied
+ * twice. They go here through a second channel on the device, opened with
+ * O_DIRECT, while the metadata keeps using the cached channel of the
+ * filesystem.
+ *
+ * Ordering between both channels: before a direct read, the dirty blocks
+ * of the block cache in the range are written back to the kernel, which
+ * writes back its own dirty pages before serving a direct read. After a
+ * direct write, the range is dropped from the block cache, and the kernel
+ * invalidates its pages. The cache of the unix io manager under the
+ * cached channel is turned off, as it can't be invalidated by range.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+
+/*zeroes written at a time when the device can't zero a range itself */
+#define BULK_ZERO_BLOCKS	256
+
+int bulk_direct_io = 1;
+
+/*
+ * Open the direct channel. When it isn't possible (no O_DIRECT on the
+ * file, another io manager under the filesystem), the bulk copies go
+ * through the cached channel, as before.
+ */
+errcode_t bulk_io_open(ext2_resize_t rfs)
+{
+	ext2_filsys fs = rfs->old_fs;
+	io_channel io = NULL;
+	errcode_t retval;
+
+	if (!bulk_direct_io || rfs->bulk_io)
+		return 0;
+	if (fs->io->manager != unix_io_manager && fs->io->manager != cache_io_manager)
+		return 0;
+
+	retval = unix_io_manager->open(fs->device_name, IO_FLAG_RW | IO_FLAG_DIRECT_IO | IO_FLAG_THREADS, &io);
+	if (!retval)
+		retval = io_channel_set_blksize(io, fs->blocksize);
+	if (!retval)
+		retval = io_channel_set_options(io, "cache=off");
+	if (!retval)
+		retval = io_channel_set_options(fs->io, "cache=off");
+	if (retval) {
+		log_verbose("Direct I/O not available on %s (%s), the bulk copies go through the page cache\n", fs->device_name, error_message(retval));
+		if (io)
+			io_channel_close(io);
+		return 0;
+	}
+	log_verbose("Bulk copies with direct I/O, alignment %d\n", io->align);
+	rfs->bulk_io = io;
+	return 0;
+}
+
+/*make the direct writes durable and close the channel */
+errcode_t bulk_io_close(ext2_resize_t rfs)
+{
+	errcode_t retval, retval2;
+
+	if (!rfs->bulk_io)
+		return 0;
+	retval = io_channel_flush(rfs->bulk_io);
+	retval2 = io_channel_close(rfs->bulk_io);
+	rfs->bulk_io = NULL;
+	return retval ? retval : retval2;
+}
+
+/*a buffer for the bulk copies, aligned for the direct channel */
+errcode_t bulk_io_get_buf(ext2_resize_t rfs, unsigned long size, void *ptr)
+{
+	unsigned long align = rfs->bulk_io && rfs->bulk_io->align > 8 ? rfs->bulk_io->align : 8;
+
+	return ext2fs_get_memalign(size, align, ptr);
+}
+
+errcode_t bulk_io_read(ext2_resize_t rfs, blk64_t blk, int count, void *buf)
+{
+	errcode_t retval;
+
+	if (!rfs->bulk_io)
+		return io_channel_read_blk64(rfs->old_fs->io, blk, count, buf);
+	retval = cache_io_sync_range(rfs->old_fs->io, blk, count);
+	if (retval)
+		return retval;
+	return io_channel_read_blk64(rfs->bulk_io, blk, count, buf);
+}
+
+errcode_t bulk_io_write(ext2_resize_t rfs, blk64_t blk, int count, const void *buf)
+{
+	errcode_t retval;
+
+	if (!rfs->bulk_io)
+		return io_channel_write_blk64(rfs->old_fs->io, blk, count, buf);
+	cache_io_invalidate(rfs->old_fs->io, blk, count);
+	retval = io_channel_write_blk64(rfs->bulk_io, blk, count, buf);
+	cache_io_invalidate(rfs->old_fs->io, blk, count);
+	return retval;
+}
+
+/*write zeroes, for the devices that can't zero a range themselves */
+errcode_t bulk_io_zero(ext2_resize_t rfs, blk64_t blk, blk64_t count)
+{
+	ext2_filsys fs = rfs->new_fs;
+	char *zero_buf = NULL;
+	blk64_t err_blk;
+	int chunk, err_count;
+	errcode_t retval = 0;
+
+	if (!rfs->bulk_io) {
+		while (count) {
+			chunk = count > (1U << 30) ? (1U << 30) : count;
+			retval = ext2fs_zero_blocks2(fs, blk, chunk, &err_blk, &err_count);
+			if (retval) {
+				fprintf(stderr, _("\nCould not write %d " "blocks in inode table starting at %llu: %s\n"), err_count, (unsigned long long)err_blk, error_message(retval));
+				return retval;
+			}
+			blk += chunk;
+			count -= chunk;
+		}
+		return 0;
+	}
+
+	retval = bulk_io_get_buf(rfs, (unsigned long)fs->blocksize * BULK_ZERO_BLOCKS, &zero_buf);
+	if (retval)
+		return retval;
+	memset(zero_buf, 0, (size_t)fs->blocksize * BULK_ZERO_BLOCKS);
+	while (count) {
+		chunk = count > BULK_ZERO_BLOCKS ? BULK_ZERO_BLOCKS : count;
+		retval = bulk_io_write(rfs, blk, chunk, zero_buf);
+		if (retval) {
+			fprintf(stderr, _("\nCould not write %d " "blocks in inode table starting at %llu: %s\n"), chunk, (unsigned long long)blk, error_message(retval));
+			break;
+		}
+		blk += chunk;
+		count -= chunk;
+	}
+	ext2fs_free_mem(&zero_buf);
+	return retval;
+}
@@ -0,0 +1,771 @@
+/*
+ * cache_io.c --- block cache I/O manager
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * The passes read and write the same metadata blocks many times: group
+ * descriptors, bitmaps, itable blocks through ext2fs_read_inode() and
+ * ext2fs_write_inode(), extent tree blocks through ext2fs_block_iterate3().
+ * The cache of the unix io manager only holds a handful of blocks, so this
+ * io manager sits on top of it (or of the undo io manager) with a cache of
+ * cache_io_size bytes.
+ *
+ * Eviction is a segmented LRU: a block enters the probation segment and
+ * is promoted to the protected one when it is accessed again, so a pass
+ * that streams once over many blocks only evicts other blocks seen once.
+ * Writes are kept in the cache, and the dirty blocks are written back
+ * sorted, in runs of contiguous blocks, when the channel is flushed, when
+ * a dirty block has to be evicted or when half of the cache is dirty.
+ *
+ * Requests bigger than CACHE_IO_MAX_REQUEST blocks (the itable copies) go
+ * to the device directly, after the dirty blocks they overlap have been
+ * written back; the blocks they write are dropped from the cache.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/*requests bigger than this bypass the cache */
+#define CACHE_IO_MAX_REQUEST		64
+/*longest write issued by a write back */
+#define CACHE_IO_WRITEBACK_BLOCKS	256
+/*below this, the cache is not worth it and is disabled */
+#define CACHE_IO_MIN_BLOCKS		(4 * CACHE_IO_MAX_REQUEST)
+
+#define CACHE_FREE		0
+#define CACHE_PROBATION		1
+#define CACHE_PROTECTED		2
+
+unsigned long long cache_io_size = CACHE_IO_DEFAULT_SIZE;
+
+static io_manager backing_io_manager;
+
+struct cache_entry {
+	blk64_t			blk;
+	struct cache_entry	*hash_next;
+	struct cache_entry	*prev, *next;
+	char			*buf;
+	int			segment;
+	/* position in the dirty array + 1, 0 if the block is clean */
+	unsigned long		dirty_idx;
+};
+
+struct cache_stats {
+	unsigned long long	hits;
+	unsigned long long	misses;
+	unsigned long long	writes;
+	unsigned long long	bypassed;
+	unsigned long long	writeback_ops;
+	unsigned long long	writeback_blocks;
+};
+
+struct cache_private {
+	io_channel		real;
+	unsigned long long	size;
+	int			block_size;
+	unsigned long		nblocks;
+	struct cache_entry	*entries;
+	char			*data;
+	struct cache_entry	**hash;
+	unsigned long		hash_mask;
+	/* list heads of the free, probation and protected segments */
+	struct cache_entry	seg[3];
+	unsigned long		seg_count[3];
+	unsigned long		protected_max;
+	struct cache_entry	**dirty;
+	unsigned long		num_dirty;
+	char			*wb_buf;
+	struct cache_stats	stats;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+#endif
+};
+
+/*statistics of the closed channels, for cache_io_report() */
+static struct cache_stats closed_stats;
+static unsigned long long report_size;
+
+static void cache_lock(struct cache_private *data)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&data->lock);
+#endif
+}
+
+static void cache_unlock(struct cache_private *data)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&data->lock);
+#endif
+}
+
+static void list_del(struct cache_private *data, struct cache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	data->seg_count[e->segment]--;
+}
+
+static void list_add_head(struct cache_private *data, int segment, struct cache_entry *e)
+{
+	struct cache_entry *head = &data->seg[segment];
+
+	e->next = head->next;
+	e->prev = head;
+	head->next->prev = e;
+	head->next = e;
+	e->segment = segment;
+	data->seg_count[segment]++;
+}
+
+static unsigned long hash_blk(struct cache_private *data, blk64_t blk)
+{
+	return ((blk * 0x9E3779B97F4A7C15ULL) >> 24) & data->hash_mask;
+}
+
+static struct cache_entry *lookup(struct cache_private *data, blk64_t blk)
+{
+	struct cache_entry *e;
+
+	for (e = data->hash[hash_blk(data, blk)]; e; e = e->hash_next)
+		if (e->blk == blk)
+			return e;
+	return NULL;
+}
+
+static void hash_remove(struct cache_private *data, struct cache_entry *e)
+{
+	struct cache_entry **p = &data->hash[hash_blk(data, e->blk)];
+
+	while (*p != e)
+		p = &(*p)->hash_next;
+	*p = e->hash_next;
+}
+
+static void mark_dirty(struct cache_private *data, struct cache_entry *e)
+{
+	if (e->dirty_idx)
+		return;
+	data->dirty[data->num_dirty++] = e;
+	e->dirty_idx = data->num_dirty;
+}
+
+static void clear_dirty(struct cache_private *data, struct cache_entry *e)
+{
+	struct cache_entry *last;
+
+	if (!e->dirty_idx)
+		return;
+	last = data->dirty[--data->num_dirty];
+	data->dirty[e->dirty_idx - 1] = last;
+	last->dirty_idx = e->dirty_idx;
+	e->dirty_idx = 0;
+}
+
+/*a second access promotes the block, the protected segment overflows into probation */
+static void touch(struct cache_private *data, struct cache_entry *e)
+{
+	struct cache_entry *tail;
+
+	list_del(data, e);
+	list_add_head(data, CACHE_PROTECTED, e);
+	if (data->seg_count[CACHE_PROTECTED] > data->protected_max) {
+		tail = data->seg[CACHE_PROTECTED].prev;
+		list_del(data, tail);
+		list_add_head(data, CACHE_PROBATION, tail);
+	}
+}
+
+static EXT2_QSORT_TYPE dirty_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *ea = *(struct cache_entry * const *)a;
+	const struct cache_entry *eb = *(struct cache_entry * const *)b;
+
+	if (ea->blk != eb->blk)
+		return ea->blk < eb->blk ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write back all the dirty blocks in block order, coalescing the runs of
+ * contiguous blocks. On error, the blocks not written stay dirty.
+ */
+static errcode_t writeback(struct cache_private *data)
+{
+	struct cache_entry **dirty = data->dirty;
+	unsigned long i, j, k, n;
+	errcode_t retval;
+
+	if (!data->num_dirty)
+		return 0;
+	qsort(dirty, data->num_dirty, sizeof(*dirty), dirty_cmp);
+	for (i = 0; i < data->num_dirty; i = j) {
+		for (j = i + 1; j < data->num_dirty && j - i < CACHE_IO_WRITEBACK_BLOCKS && dirty[j]->blk == dirty[j - 1]->blk + 1; j++)
+			;
+		n = j - i;
+		if (n == 1) {
+			retval = io_channel_write_blk64(data->real, dirty[i]->blk, 1, dirty[i]->buf);
+		} else {
+			for (k = 0; k < n; k++)
+				memcpy(data->wb_buf + k * data->block_size, dirty[i + k]->buf, data->block_size);
+			retval = io_channel_write_blk64(data->real, dirty[i]->blk, n, data->wb_buf);
+		}
+		if (retval) {
+			memmove(dirty, dirty + i, (data->num_dirty - i) * sizeof(*dirty));
+			data->num_dirty -= i;
+			for (k = 0; k < data->num_dirty; k++)
+				dirty[k]->dirty_idx = k + 1;
+			return retval;
+		}
+		for (k = i; k < j; k++)
+			dirty[k]->dirty_idx = 0;
+		data->stats.writeback_ops++;
+		data->stats.writeback_blocks += n;
+	}
+	data->num_dirty = 0;
+	return 0;
+}
+
+/*write back the dirty blocks if any of them is in blk..blk+count-1 */
+static errcode_t writeback_range(struct cache_private *data, blk64_t blk, blk64_t count)
+{
+	struct cache_entry *e;
+	unsigned long i;
+	blk64_t b;
+
+	if (count <= data->num_dirty) {
+		for (b = blk; b < blk + count; b++) {
+			e = lookup(data, b);
+			if (e && e->dirty_idx)
+				return writeback(data);
+		}
+	} else {
+		for (i = 0; i < data->num_dirty; i++)
+			if (data->dirty[i]->blk >= blk && data->dirty[i]->blk < blk + count)
+				return writeback(data);
+	}
+	return 0;
+}
+
+static void drop(struct cache_private *data, struct cache_entry *e)
+{
+	clear_dirty(data, e);
+	hash_remove(data, e);
+	list_del(data, e);
+	list_add_head(data, CACHE_FREE, e);
+}
+
+/*forget the cached copies of blk..blk+count-1, dirty or not */
+static void invalidate_range(struct cache_private *data, blk64_t blk, blk64_t count)
+{
+	struct cache_entry *e, *next;
+	blk64_t b;
+	int s;
+
+	if (count <= data->nblocks) {
+		for (b = blk; b < blk + count; b++) {
+			e = lookup(data, b);
+			if (e)
+				drop(data, e);
+		}
+		return;
+	}
+	for (s = CACHE_PROBATION; s <= CACHE_PROTECTED; s++)
+		for (e = data->seg[s].next; e != &data->seg[s]; e = next) {
+			next = e->next;
+			if (e->blk >= blk && e->blk < blk + count)
+				drop(data, e);
+		}
+}
+
+/*an entry for blk, evicting the least recently used block when the cache is full */
+static errcode_t get_entry(struct cache_private *data, blk64_t blk, struct cache_entry **ret)
+{
+	struct cache_entry *e;
+	errcode_t retval;
+
+	if (data->seg_count[CACHE_FREE])
+		e = data->seg[CACHE_FREE].next;
+	else if (data->seg_count[CACHE_PROBATION])
+		e = data->seg[CACHE_PROBATION].prev;
+	else
+		e = data->seg[CACHE_PROTECTED].prev;
+	if (e->dirty_idx) {
+		retval = writeback(data);
+		if (retval)
+			return retval;
+	}
+	if (e->segment != CACHE_FREE)
+		hash_remove(data, e);
+	list_del(data, e);
+	e->blk = blk;
+	e->hash_next = data->hash[hash_blk(data, blk)];
+	data->hash[hash_blk(data, blk)] = e;
+	list_add_head(data, CACHE_PROBATION, e);
+	*ret = e;
+	return 0;
+}
+
+static void free_cache(struct cache_private *data)
+{
+	free(data->entries);
+	free(data->data);
+	free(data->hash);
+	free(data->dirty);
+	free(data->wb_buf);
+	data->entries = NULL;
+	data->data = NULL;
+	data->hash = NULL;
+	data->dirty = NULL;
+	data->wb_buf = NULL;
+	data->nblocks = 0;
+	data->num_dirty = 0;
+	mem_account("block cache", 0);
+}
+
+/*
+ * (Re)build an empty cache of data->size bytes of block_size blocks. If it
+ * can't be allocated, the channel works without cache.
+ */
+static void setup_cache(struct cache_private *data, int block_size)
+{
+	unsigned long nblocks = data->size / block_size, hash_size = 1, i;
+	int s;
+
+	free_cache(data);
+	data->block_size = block_size;
+	if (nblocks < CACHE_IO_MIN_BLOCKS)
+		return;
+	while (hash_size < nblocks)
+		hash_size <<= 1;
+	data->entries = calloc(nblocks, sizeof(struct cache_entry));
+	data->data = malloc((size_t)nblocks * block_size);
+	data->hash = calloc(hash_size, sizeof(struct cache_entry *));
+	data->dirty = malloc(nblocks * sizeof(struct cache_entry *));
+	data->wb_buf = malloc((size_t)CACHE_IO_WRITEBACK_BLOCKS * block_size);
+	if (!data->entries || !data->data || !data->hash || !data->dirty || !data->wb_buf) {
+		printf("Couldn't allocate a block cache of %llu MiB, continuing without it\n", data->size >> 20);
+		free_cache(data);
+		return;
+	}
+	data->nblocks = nblocks;
+	data->hash_mask = hash_size - 1;
+	data->protected_max = nblocks - nblocks / 4;
+	for (s = CACHE_FREE; s <= CACHE_PROTECTED; s++) {
+		data->seg[s].next = data->seg[s].prev = &data->seg[s];
+		data->seg_count[s] = 0;
+	}
+	for (i = 0; i < nblocks; i++) {
+		data->entries[i].buf = data->data + (size_t)i * block_size;
+		list_add_head(data, CACHE_FREE, &data->entries[i]);
+	}
+	mem_account("block cache", nblocks * (unsigned long long)(block_size + sizeof(struct cache_entry) + sizeof(struct cache_entry *)) +
+		    hash_size * sizeof(struct cache_entry *) + CACHE_IO_WRITEBACK_BLOCKS * (unsigned long long)block_size);
+	if (data->size > report_size)
+		report_size = data->size;
+}
+
+/*number of blocks touched by a request, count < 0 being a size in bytes */
+static blk64_t request_blocks(io_channel channel, int count)
+{
+	if (count >= 0)
+		return count;
+	return ((blk64_t)-count + channel->block_size - 1) / channel->block_size;
+}
+
+static struct struct_io_manager struct_cache_io_manager;
+io_manager cache_io_manager = &struct_cache_io_manager;
+
+errcode_t set_cache_io_backing_manager(io_manager manager)
+{
+	backing_io_manager = manager;
+	return 0;
+}
+
+static errcode_t cache_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel io = NULL;
+	struct cache_private *data = NULL;
+	errcode_t retval;
+
+	if (!backing_io_manager)
+		return EXT2_ET_INVALID_ARGUMENT;
+	retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_memzero(sizeof(struct cache_private), &data);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_mem(strlen(name) + 1, &io->name);
+	if (retval)
+		goto errout;
+	strcpy(io->name, name);
+	retval = backing_io_manager->open(name, flags, &data->real);
+	if (retval)
+		goto errout;
+
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	io->manager = cache_io_manager;
+	io->block_size = data->real->block_size;
+	io->flags = data->real->flags;
+	io->align = data->real->align;
+	io->refcount = 1;
+	io->private_data = data;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&data->lock, NULL);
+#endif
+	data->size = cache_io_size;
+	setup_cache(data, io->block_size);
+	*channel = io;
+	return 0;
+
+ errout:
+	if (io && io->name)
+		ext2fs_free_mem(&io->name);
+	if (io)
+		ext2fs_free_mem(&io);
+	if (data)
+		ext2fs_free_mem(&data);
+	return retval;
+}
+
+static errcode_t cache_close(io_channel channel)
+{
+	struct cache_private *data = channel->private_data;
+	errcode_t retval, retval2;
+
+	if (--channel->refcount > 0)
+		return 0;
+	retval = writeback(data);
+	retval2 = io_channel_close(data->real);
+	if (!retval)
+		retval = retval2;
+	closed_stats.hits += data->stats.hits;
+	closed_stats.misses += data->stats.misses;
+	closed_stats.writes += data->stats.writes;
+	closed_stats.bypassed += data->stats.bypassed;
+	closed_stats.writeback_ops += data->stats.writeback_ops;
+	closed_stats.writeback_blocks += data->stats.writeback_blocks;
+	free_cache(data);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&data->lock);
+#endif
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t cache_set_blksize(io_channel channel, int blksize)
+{
+	struct cache_private *data = channel->private_data;
+	errcode_t retval;
+
+	cache_lock(data);
+	retval = writeback(data);
+	if (!retval)
+		retval = io_channel_set_blksize(data->real, blksize);
+	if (!retval) {
+		channel->block_size = blksize;
+		setup_cache(data, blksize);
+	}
+	cache_unlock(data);
+	return retval;
+}
+
+static errcode_t cache_read_blk64(io_channel channel, unsigned long long block, int count, void *buf)
+{
+	struct cache_private *data = channel->private_data;
+	struct cache_entry *e;
+	char *cp = buf;
+	int i, j, k;
+	errcode_t retval = 0;
+
+	if (!data->nblocks)
+		return io_channel_read_blk64(data->real, block, count, buf);
+
+	cache_lock(data);
+	if (count < 0 || count > CACHE_IO_MAX_REQUEST) {
+		data->stats.bypassed++;
+		retval = writeback_range(data, block, request_blocks(channel, count));
+		cache_unlock(data);
+		if (retval)
+			return retval;
+		return io_channel_read_blk64(data->real, block, count, buf);
+	}
+
+	for (i = 0; i < count; i = j) {
+		e = lookup(data, block + i);
+		if (e) {
+			memcpy(cp + (size_t)i * channel->block_size, e->buf, channel->block_size);
+			touch(data, e);
+			data->stats.hits++;
+			j = i + 1;
+			continue;
+		}
+		/*read the whole run of missing blocks at once */
+		for (j = i + 1; j < count && !lookup(data, block + j); j++)
+			;
+		retval = io_channel_read_blk64(data->real, block + i, j - i, cp + (size_t)i * channel->block_size);
+		if (retval)
+			break;
+		data->stats.misses += j - i;
+		for (k = i; k < j; k++) {
+			retval = get_entry(data, block + k, &e);
+			if (retval)
+				break;
+			memcpy(e->buf, cp + (size_t)k * channel->block_size, channel->block_size);
+		}
+		if (retval)
+			break;
+	}
+	cache_unlock(data);
+	return retval;
+}
+
+static errcode_t cache_read_blk(io_channel channel, unsigned long block, int count, void *buf)
+{
+	return cache_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t cache_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf)
+{
+	struct cache_private *data = channel->private_data;
+	struct cache_entry *e;
+	const char *cp = buf;
+	blk64_t nblk;
+	int i;
+	errcode_t retval = 0;
+
+	if (!data->nblocks)
+		return io_channel_write_blk64(data->real, block, count, buf);
+
+	cache_lock(data);
+	if (count < 0 || count > CACHE_IO_MAX_REQUEST) {
+		data->stats.bypassed++;
+		nblk = request_blocks(channel, count);
+		/*a partial last block must reach the device before it is overwritten */
+		if (count < 0)
+			retval = writeback_range(data, block, nblk);
+		invalidate_range(data, block, nblk);
+		cache_unlock(data);
+		if (retval)
+			return retval;
+		retval = io_channel_write_blk64(data->real, block, count, buf);
+		/*and once more, in case another thread cached the old contents meanwhile */
+		cache_lock(data);
+		invalidate_range(data, block, nblk);
+		cache_unlock(data);
+		return retval;
+	}
+
+	for (i = 0; i < count; i++) {
+		e = lookup(data, block + i);
+		if (e) {
+			touch(data, e);
+		} else {
+			retval = get_entry(data, block + i, &e);
+			if (retval)
+				break;
+		}
+		memcpy(e->buf, cp + (size_t)i * channel->block_size, channel->block_size);
+		mark_dirty(data, e);
+		data->stats.writes++;
+	}
+	if (!retval && data->num_dirty > data->nblocks / 2)
+		retval = writeback(data);
+	cache_unlock(data);
+	return retval;
+}
+
+static errcode_t cache_write_blk(io_channel channel, unsigned long block, int count, const void *buf)
+{
+	return cache_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t cache_write_byte(io_channel channel, unsigned long offset, int size, const void *buf)
+{
+	struct cache_private *data = channel->private_data;
+	blk64_t blk = offset / channel->block_size;
+	blk64_t nblk = (offset + size + channel->block_size - 1) / channel->block_size - blk;
+	errcode_t retval = 0;
+
+	if (!data->real->manager->write_byte)
+		return EXT2_ET_UNIMPLEMENTED;
+	if (data->nblocks) {
+		cache_lock(data);
+		retval = writeback_range(data, blk, nblk);
+		invalidate_range(data, blk, nblk);
+		cache_unlock(data);
+		if (retval)
+			return retval;
+	}
+	retval = data->real->manager->write_byte(data->real, offset, size, buf);
+	if (data->nblocks) {
+		cache_lock(data);
+		invalidate_range(data, blk, nblk);
+		cache_unlock(data);
+	}
+	return retval;
+}
+
+static errcode_t cache_flush(io_channel channel)
+{
+	struct cache_private *data = channel->private_data;
+	errcode_t retval;
+
+	cache_lock(data);
+	retval = writeback(data);
+	cache_unlock(data);
+	if (retval)
+		return retval;
+	return io_channel_flush(data->real);
+}
+
+static errcode_t cache_set_option(io_channel channel, const char *option, const char *arg)
+{
+	struct cache_private *data = channel->private_data;
+
+	if (!data->real->manager->set_option)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return data->real->manager->set_option(data->real, option, arg);
+}
+
+static errcode_t cache_get_stats(io_channel channel, io_stats *stats)
+{
+	struct cache_private *data = channel->private_data;
+
+	if (!data->real->manager->get_stats)
+		return EXT2_ET_UNIMPLEMENTED;
+	return data->real->manager->get_stats(data->real, stats);
+}
+
+static errcode_t cache_discard(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	struct cache_private *data = channel->private_data;
+
+	if (data->nblocks) {
+		cache_lock(data);
+		invalidate_range(data, block, count);
+		cache_unlock(data);
+	}
+	return io_channel_discard(data->real, block, count);
+}
+
+static errcode_t cache_zeroout(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	struct cache_private *data = channel->private_data;
+
+	if (data->nblocks) {
+		cache_lock(data);
+		invalidate_range(data, block, count);
+		cache_unlock(data);
+	}
+	return io_channel_zeroout(data->real, block, count);
+}
+
+static errcode_t cache_cache_readahead(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	struct cache_private *data = channel->private_data;
+
+	return io_channel_cache_readahead(data->real, block, count);
+}
+
+static struct struct_io_manager struct_cache_io_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "Block cache I/O Manager",
+	.open		= cache_open,
+	.close		= cache_close,
+	.set_blksize	= cache_set_blksize,
+	.read_blk	= cache_read_blk,
+	.write_blk	= cache_write_blk,
+	.flush		= cache_flush,
+	.write_byte	= cache_write_byte,
+	.set_option	= cache_set_option,
+	.get_stats	= cache_get_stats,
+	.read_blk64	= cache_read_blk64,
+	.write_blk64	= cache_write_blk64,
+	.discard	= cache_discard,
+	.cache_readahead = cache_cache_readahead,
+	.zeroout	= cache_zeroout,
+};
+
+/*
+ * Change the size of the cache of an open channel, writing back its dirty
+ * blocks first. Does nothing on a channel of another io manager.
+ */
+errcode_t cache_io_resize(io_channel channel, unsigned long long size)
+{
+	struct cache_private *data;
+	errcode_t retval;
+
+	if (channel->manager != cache_io_manager)
+		return 0;
+	data = channel->private_data;
+	cache_lock(data);
+	retval = writeback(data);
+	if (!retval) {
+		data->size = size;
+		report_size = size;
+		setup_cache(data, channel->block_size);
+	}
+	cache_unlock(data);
+	return retval;
+}
+
+/*
+ * For the accesses to the device that bypass the channel: write back the
+ * dirty blocks of a range before reading it, drop the range after writing
+ * it. They do nothing on a channel of another io manager.
+ */
+errcode_t cache_io_sync_range(io_channel channel, blk64_t blk, blk64_t count)
+{
+	struct cache_private *data;
+	errcode_t retval;
+
+	if (channel->manager != cache_io_manager)
+		return 0;
+	data = channel->private_data;
+	if (!data->nblocks)
+		return 0;
+	cache_lock(data);
+	retval = writeback_range(data, blk, count);
+	cache_unlock(data);
+	return retval;
+}
+
+void cache_io_invalidate(io_channel channel, blk64_t blk, blk64_t count)
+{
+	struct cache_private *data;
+
+	if (channel->manager != cache_io_manager)
+		return;
+	data = channel->private_data;
+	if (!data->nblocks)
+		return;
+	cache_lock(data);
+	invalidate_range(data, blk, count);
+	cache_unlock(data);
+}
+
+void cache_io_report(void)
+{
+	struct cache_stats *s = &closed_stats;
+	unsigned long long lookups = s->hits + s->misses;
+
+	if (!report_size)
+		return;
+	printf("Block cache: %llu MiB, %llu hits, %llu misses (%.1f%% hit rate), %llu blocks written, "
+	       "%llu written back in %llu writes, %llu requests bypassed\n",
+	       report_size >> 20, s->hits, s->misses, lookups ? 100.0 * s->hits / lookups : 0.0,
+	       s->writes, s->writeback_blocks, s->writeback_ops, s->bypassed);
+}
@@ -0,0 +1,184 @@
+/*
+ * csum.c --- crc32c engine for the migrated inodes
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * Every inode migrated to a new itable, and every renumbered inode, needs
+ * its metadata_csum checksum recomputed, as it is seeded with the inode
+ * number. libext2fs does it with a table-driven crc32c, on every read and
+ * every write. Here the checksum is computed with the SSE4.2 crc32
+ * instruction when the CPU has it, slicing-by-8 tables otherwise, and the
+ * inode is written with WRITE_INODE_NOCSUM.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#endif
+
+/* Castagnoli polynomial, reflected */
+#define CRC32C_POLY	0x82F63B78
+
+static __u32 crc32c_table[8][256];
+
+static __u32 crc32c_sw(__u32 crc, const unsigned char *p, size_t len)
+{
+	__u32 lo, hi;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (__u32)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (__u32)p[7] << 24;
+		crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+			crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+			crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static __u32 crc32c_sse42(__u32 crc, const unsigned char *p, size_t len)
+{
+	__u64 c = crc, word;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&word, p, 8);
+		c = _mm_crc32_u64(c, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+#endif
+
+static __u32 (*crc32c_impl)(__u32 crc, const unsigned char *p, size_t len);
+static const char *crc32c_impl_name;
+
+static void crc32c_init(void)
+{
+	__u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^ (crc32c_table[j - 1][i] >> 8);
+
+	crc32c_impl = crc32c_sw;
+	crc32c_impl_name = "slicing-by-8";
+#ifdef HAVE_CRC32C_SSE42
+	/*check value of crc32c: "123456789" -> 0xe3069283 */
+	if (__builtin_cpu_supports("sse4.2") && ~crc32c_sse42(~0U, (const unsigned char *)"123456789", 9) == 0xe3069283) {
+		crc32c_impl = crc32c_sse42;
+		crc32c_impl_name = "sse4.2";
+	}
+#endif
+}
+
+/*
+ * Same convention as ext2fs_crc32c_le(): no inversion of the input nor of
+ * the result
+ */
+__u32 csum_crc32c(__u32 crc, const void *buf, size_t len)
+{
+	if (!crc32c_impl)
+		crc32c_init();
+	return crc32c_impl(crc, buf, len);
+}
+
+const char *csum_engine_name(void)
+{
+	if (!crc32c_impl)
+		crc32c_init();
+	return crc32c_impl_name;
+}
+
+/*
+ * Same as ext2fs_inode_csum_set(), for an inode of the full on-disk size
+ * in little-endian order
+ */
+static void csum_inode_set(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode_large *inode)
+{
+	int has_hi = EXT2_INODE_SIZE(fs->super) > EXT2_GOOD_OLD_INODE_SIZE && inode->i_extra_isize >= EXT4_INODE_CSUM_HI_EXTRA_END;
+	__u32 crc, inum = ino, gen = inode->i_generation;
+
+	inode->osd2.linux2.l_i_checksum_lo = 0;
+	if (has_hi)
+		inode->i_checksum_hi = 0;
+	crc = csum_crc32c(fs->csum_seed, &inum, sizeof(inum));
+	crc = csum_crc32c(crc, &gen, sizeof(gen));
+	crc = csum_crc32c(crc, inode, EXT2_INODE_SIZE(fs->super));
+	inode->osd2.linux2.l_i_checksum_lo = crc & 0xFFFF;
+	if (has_hi)
+		inode->i_checksum_hi = crc >> 16;
+}
+
+/*
+ * Write a full inode, computing its checksum here. The buffer must hold
+ * the full on-disk inode size.
+ */
+errcode_t csum_write_inode(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, int bufsize)
+{
+#ifdef WORDS_BIGENDIAN
+	/*the checksum covers the little-endian image: leave it to libext2fs */
+	return ext2fs_write_inode2(fs, ino, inode, bufsize, 0);
+#else
+	if (!ext2fs_has_feature_metadata_csum(fs->super) || bufsize < EXT2_INODE_SIZE(fs->super))
+		return ext2fs_write_inode2(fs, ino, inode, bufsize, 0);
+	csum_inode_set(fs, ino, (struct ext2_inode_large *)inode);
+	return ext2fs_write_inode2(fs, ino, inode, bufsize, WRITE_INODE_NOCSUM);
+#endif
+}
+
+/*
+ * Set the checksum of a raw inode record of the full on-disk size, as
+ * read from an itable block
+ */
+void csum_inode_record(ext2_filsys fs, ext2_ino_t ino, void *record)
+{
+#ifndef WORDS_BIGENDIAN
+	csum_inode_set(fs, ino, record);
+#endif
+}
+
+/*
+ * Same as ext2fs_dir_block_csum_set(), for a leaf block with its tail in
+ * little-endian order. gen is the i_generation of the directory dir.
+ */
+void csum_dir_block(ext2_filsys fs, ext2_ino_t dir, __u32 gen, void *block)
+{
+	struct ext2_dir_entry_tail *t = (struct ext2_dir_entry_tail *)((char *)block + fs->blocksize - sizeof(struct ext2_dir_entry_tail));
+	__u32 crc, inum = dir;
+
+	crc = csum_crc32c(fs->csum_seed, &inum, sizeof(inum));
+	crc = csum_crc32c(crc, &gen, sizeof(gen));
+	crc = csum_crc32c(crc, block, (char *)t - (char *)block);
+	t->det_checksum = crc;
+}
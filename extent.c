@@ -30,6 +30,8 @@ struct _ext2_extent {
 	__u64	size;
 	__u64	num;
 	__u64	sorted;
+	/* backing file of list once it has been moved to disk, see spill.c */
+	struct spill_map spill;
 };
 
 /*
@@ -49,6 +51,7 @@ errcode_t ext2fs_create_extent_table(ext2_extent *ret_extent, __u64 size)
 	extent->cursor = 0;
 	extent->num = 0;
 	extent->sorted = 1;
+	extent->spill.fd = -1;
 
 	retval = ext2fs_get_arrayzero(sizeof(struct ext2_extent_entry),
 				extent->size, &extent->list);
@@ -65,7 +68,9 @@ errcode_t ext2fs_create_extent_table(ext2_extent *ret_extent, __u64 size)
  */
 void ext2fs_free_extent_table(ext2_extent extent)
 {
-	if (extent->list)
+	if (extent->spill.addr)
+		spill_map_close(&extent->spill);
+	else if (extent->list)
 		ext2fs_free_mem(&extent->list);
 	extent->list = 0;
 	extent->size = 0;
@@ -83,7 +88,25 @@ errcode_t ext2fs_add_extent_entry(ext2_extent extent, __u64 old_loc, __u64 new_l
 	__u64				newsize;
 	__u64				curr;
 
-	if (extent->num >= extent->size) {
+	if (extent->num >= extent->size && (extent->spill.addr || spill_wanted(sizeof(struct ext2_extent_entry) * extent->size))) {
+		/*
+		 * On disk, the table doubles: the kernel only keeps the
+		 * pages being used in memory
+		 */
+		newsize = extent->size * 2;
+		if (!extent->spill.addr) {
+			retval = spill_map_open(&extent->spill, extent->list, sizeof(struct ext2_extent_entry) * extent->size);
+			if (retval)
+				return retval;
+			ext2fs_free_mem(&extent->list);
+			extent->list = extent->spill.addr;
+		}
+		retval = spill_map_resize(&extent->spill, sizeof(struct ext2_extent_entry) * newsize);
+		if (retval)
+			return retval;
+		extent->list = extent->spill.addr;
+		extent->size = newsize;
+	} else if (extent->num >= extent->size) {
 		newsize = extent->size + 100;
 		retval = ext2fs_resize_mem(sizeof(struct ext2_extent_entry) *
 					   extent->size,
@@ -148,6 +171,8 @@ __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc)
 		qsort(extent->list, extent->num,
 		      sizeof(struct ext2_extent_entry), extent_cmp);
 		extent->sorted = 1;
+		/*the lookups land anywhere in the map, read ahead would load the wrong pages */
+		spill_map_random(&extent->spill);
 	}
 	low = 0;
 	high = extent->num-1;
@@ -189,6 +214,17 @@ __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc)
 	return 0;
 }
 
+/*
+ * Memory used by the extent table
+ */
+__u64 ext2fs_extent_table_memory(ext2_extent extent)
+{
+	if (extent->spill.addr)
+		return sizeof(struct _ext2_extent);
+	return sizeof(struct _ext2_extent) +
+		extent->size * sizeof(struct ext2_extent_entry);
+}
+
 /*
  * For debugging only
  */
@@ -0,0 +1,335 @@
+/*
+ * feasibility.c --- free space needed to increase the inode count
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * Before anything is written, work out how many free blocks the increase
+ * needs, following what the planned path of increase_inode_count.c does:
+ *  - the new itables are placed as plan_itable_placement() places them,
+ *    and cover free blocks, data blocks and old itables. The old itables
+ *    still to be read when they are overwritten are first copied aside;
+ *  - the data blocks under them are relocated by the block mover, which
+ *    takes the free blocks in ascending order. A run of relocated blocks
+ *    stays contiguous unless its destination crosses a used block;
+ *  - each relocated run in the middle of an extent splits it in up to
+ *    three, and the extent tree may need new blocks to hold them. The
+ *    growth of each tree is computed from the fill of its nodes, assuming
+ *    that a full node is split in two halves.
+ * Block mapped files don't grow: their indirect blocks are relocated as
+ * any other block.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+
+/*deepest extent tree followed, ext4 doesn't build trees deeper than 5 levels */
+#define FEAS_MAX_DEPTH		8
+
+/*
+ * Simulate get_new_block() for the blocks block_mover() relocates, and
+ * mark in breaks the relocated clusters whose destination doesn't follow
+ * the destination of the previous cluster: a new extent starts there.
+ */
+static errcode_t mark_relocation_breaks(ext2_filsys fs, ext2fs_block_bitmap reserve_blocks, ext2fs_block_bitmap move_blocks,
+					ext2fs_block_bitmap breaks, blk64_t *fragments)
+{
+	ext2_badblocks_list badblock_list = 0;
+	blk64_t blk, dest = fs->super->s_first_data_block, prev_blk = 0, prev_dest = 0;
+	int ratio = EXT2FS_CLUSTER_RATIO(fs);
+	errcode_t retval;
+
+	retval = ext2fs_read_bb_inode(fs, &badblock_list);
+	if (retval)
+		return retval;
+
+	*fragments = 0;
+	for (blk = B2C(fs->super->s_first_data_block); blk < ext2fs_blocks_count(fs->super); blk += ratio) {
+		if (!ext2fs_test_block_bitmap2(fs->block_map, blk) || !ext2fs_test_block_bitmap2(move_blocks, blk))
+			continue;
+		if (ext2fs_badblocks_list_test(badblock_list, blk))
+			continue;
+		/*the allocator starts at the first block and only goes back to it when the end is reached */
+		while (dest < ext2fs_blocks_count(fs->super)
+		       && (ext2fs_test_block_bitmap2(fs->block_map, dest) || ext2fs_test_block_bitmap2(reserve_blocks, dest)))
+			dest++;
+		if (dest >= ext2fs_blocks_count(fs->super)) {
+			retval = ENOSPC;
+			break;
+		}
+		if (!prev_dest || blk != prev_blk + ratio || dest != prev_dest + ratio) {
+			ext2fs_mark_block_bitmap2(breaks, blk);
+			(*fragments)++;
+		}
+		prev_blk = blk;
+		prev_dest = dest;
+		dest += ratio;
+	}
+
+	ext2fs_badblocks_list_free(badblock_list);
+	return retval;
+}
+
+/*count the extents blocks pblk..pblk+len-1 become once relocated */
+static unsigned int relocated_pieces(ext2_filsys fs, ext2fs_block_bitmap move_blocks, ext2fs_block_bitmap breaks, blk64_t pblk, blk64_t len)
+{
+	blk64_t end = pblk + len - 1, blk = pblk, next, c;
+	int ratio = EXT2FS_CLUSTER_RATIO(fs), moved;
+	unsigned int pieces = 1;
+
+	if (!len || end >= ext2fs_blocks_count(fs->super))
+		return 1;
+	if (ext2fs_find_first_set_block_bitmap2(move_blocks, pblk, end, &next))
+		return 1;
+
+	moved = ext2fs_test_block_bitmap2(move_blocks, blk);
+	while (1) {
+		if (moved) {
+			if (ext2fs_find_first_zero_block_bitmap2(move_blocks, blk, end, &next))
+				next = end + 1;
+			/*the destination of the run may itself be split */
+			for (c = (blk | EXT2FS_CLUSTER_MASK(fs)) + 1; c < next; c += ratio)
+				if (ext2fs_test_block_bitmap2(breaks, c))
+					pieces++;
+			if (next > end)
+				break;
+		} else if (ext2fs_find_first_set_block_bitmap2(move_blocks, blk, end, &next)) {
+			break;
+		}
+		pieces++;
+		blk = next;
+		moved = !moved;
+	}
+	return pieces;
+}
+
+/*new nodes needed when count entries are stored in nodes of max entries, split in halves when full */
+static blk64_t node_splits(blk64_t count, unsigned int max)
+{
+	unsigned int half = max > 1 ? max / 2 : 1;
+
+	if (count <= max)
+		return 0;
+	return (count - max + half - 1) / half;
+}
+
+struct tree_growth {
+	unsigned int	entries[FEAS_MAX_DEPTH];
+	unsigned int	max[FEAS_MAX_DEPTH];
+	blk64_t		added[FEAS_MAX_DEPTH];	/*entries to be inserted in the current node of each level */
+	blk64_t		new_blocks;
+};
+
+/*the current node of this level is complete: its splits are inserted in its parent */
+static void close_node(ext2_filsys fs, struct tree_growth *tg, int level)
+{
+	blk64_t splits, count = tg->entries[level] + tg->added[level];
+
+	if (!tg->added[level])
+		return;
+	if (level) {
+		splits = node_splits(count, tg->max[level]);
+		tg->added[level - 1] += splits;
+		tg->new_blocks += splits;
+	} else if (count > tg->max[0]) {
+		/*the root in the inode is pushed down into a new block, which may be split too */
+		tg->new_blocks += 1 + node_splits(count, (fs->blocksize - sizeof(struct ext3_extent_header)) / sizeof(struct ext3_extent));
+	}
+	tg->added[level] = 0;
+}
+
+/*new extent tree blocks needed by the inode once its blocks are relocated */
+static errcode_t inode_tree_growth(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, ext2fs_block_bitmap move_blocks,
+				   ext2fs_block_bitmap breaks, blk64_t *new_blocks)
+{
+	ext2_extent_handle_t handle;
+	struct ext2fs_extent extent;
+	struct ext2_extent_info info;
+	struct tree_growth tg;
+	errcode_t retval;
+	int level, l;
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+	memset(&tg, 0, sizeof(tg));
+	memset(&info, 0, sizeof(info));
+
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+	while (!retval) {
+		retval = ext2fs_extent_get_info(handle, &info);
+		if (retval)
+			break;
+		level = info.curr_level;
+		if (info.max_depth >= FEAS_MAX_DEPTH)
+			break;
+		if (!(extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT)) {
+			if (info.curr_entry == 1) {
+				/*entering a new node: the previous one at this level, and its children, are complete */
+				for (l = info.max_depth; l >= level; l--)
+					close_node(fs, &tg, l);
+				tg.entries[level] = info.num_entries;
+				tg.max[level] = info.max_entries;
+			}
+			if (extent.e_flags & EXT2_EXTENT_FLAGS_LEAF)
+				tg.added[level] += relocated_pieces(fs, move_blocks, breaks, extent.e_pblk, extent.e_len) - 1;
+		}
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT, &extent);
+	}
+	if (retval == EXT2_ET_EXTENT_NO_NEXT || retval == EXT2_ET_NO_CURRENT_NODE)
+		retval = 0;
+	if (!retval) {
+		for (level = info.max_depth < FEAS_MAX_DEPTH ? info.max_depth : FEAS_MAX_DEPTH - 1; level >= 0; level--)
+			close_node(fs, &tg, level);
+		*new_blocks += tg.new_blocks;
+	}
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
+/*walk all the extent trees, the same way inode_scan_and_fix() does */
+static errcode_t extent_tree_growth(ext2_filsys fs, ext2fs_block_bitmap move_blocks, ext2fs_block_bitmap breaks, blk64_t *new_blocks)
+{
+	ext2_inode_scan scan = NULL;
+	struct ext2_inode *inode = NULL;
+	ext2_ino_t ino;
+	int inode_size = EXT2_INODE_SIZE(fs->super);
+	errcode_t retval;
+
+	*new_blocks = 0;
+	retval = ext2fs_open_inode_scan(fs, 0, &scan);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(inode_size, &inode);
+	if (retval)
+		goto errout;
+
+	while (1) {
+		retval = ext2fs_get_next_inode_full(scan, &ino, inode, inode_size);
+		if (retval)
+			goto errout;
+		if (!ino)
+			break;
+		if (!inode->i_links_count || !(inode->i_flags & EXT4_EXTENTS_FL))
+			continue;
+		if (!ext2fs_test_inode_bitmap2(fs->inode_map, ino))
+			continue;
+		retval = inode_tree_growth(fs, ino, inode, move_blocks, breaks, new_blocks);
+		if (retval) {
+			printf("Error %li while reading the extent tree of inode %u\n", retval, ino);
+			goto errout;
+		}
+	}
+
+ errout:
+	if (inode)
+		ext2fs_free_mem(&inode);
+	ext2fs_close_inode_scan(scan);
+	return retval;
+}
+
+/*
+ * New extent tree blocks needed once the blocks of move_blocks are relocated around
+ * reserve_blocks, and the runs they are relocated in. ENOSPC if they don't fit in the free
+ * space, *fragments then counts the runs placed so far. With exact == 0, the extent trees
+ * aren't read: each relocated run is then supposed to add three blocks to its tree (a leaf,
+ * an index and a new level), which is only exceeded by trees deeper than two levels.
+ */
+errcode_t increase_extent_blocks(ext2_filsys fs, ext2fs_block_bitmap reserve_blocks, ext2fs_block_bitmap move_blocks, int exact,
+				 blk64_t *fragments, blk64_t *extent_blocks)
+{
+	ext2fs_block_bitmap breaks = 0;
+	errcode_t retval;
+
+	*extent_blocks = 0;
+	retval = ext2fs_allocate_block_bitmap(fs, _("relocation breaks"), &breaks);
+	if (retval)
+		return retval;
+	retval = mark_relocation_breaks(fs, reserve_blocks, move_blocks, breaks, fragments);
+	if (retval)
+		goto errout;
+
+	if (exact && *fragments) {
+		retval = extent_tree_growth(fs, move_blocks, breaks, extent_blocks);
+		*extent_blocks = C2B(*extent_blocks);
+	} else {
+		*extent_blocks = 3 * C2B(*fragments);
+	}
+
+ errout:
+	ext2fs_free_block_bitmap(breaks);
+	return retval;
+}
+
+/*
+ * Free blocks needed to grow the itables to itable_blocks blocks, the extent trees counted
+ * as in increase_extent_blocks()
+ */
+errcode_t increase_feasibility(ext2_filsys fs, unsigned int itable_blocks, int exact, struct increase_feasibility *res)
+{
+	ext2fs_block_bitmap reserve_blocks = 0, move_blocks = 0;
+	errcode_t retval;
+
+	memset(res, 0, sizeof(*res));
+	res->itable_blocks = itable_blocks;
+
+	retval = mem_read_bitmaps(fs);
+	if (retval)
+		return retval;
+	retval = plan_itable_placement(fs, itable_blocks, &reserve_blocks, &move_blocks, &res->free_in_itables, &res->evicted, &res->staged);
+	if (retval == EXT2_ET_BLOCK_ALLOC_FAIL)
+		return 0;	/*no room for every itable, the increase would need the iterative path */
+	if (retval)
+		return retval;
+	res->placed = 1;
+
+	retval = increase_extent_blocks(fs, reserve_blocks, move_blocks, exact, &res->fragments, &res->extent_blocks);
+	if (retval == ENOSPC) {
+		/*the evicted blocks don't fit in the free space left */
+		res->min_free = res->free_in_itables + res->evicted + res->staged + 3 * C2B(res->fragments);
+		retval = 0;
+		goto errout;
+	}
+	if (retval)
+		goto errout;
+
+	res->min_free = res->free_in_itables + res->evicted + res->staged + res->extent_blocks;
+	res->feasible = res->min_free <= ext2fs_free_blocks_count(fs->super);
+
+ errout:
+	ext2fs_free_block_bitmap(reserve_blocks);
+	ext2fs_free_block_bitmap(move_blocks);
+	return retval;
+}
+
+/*
+ * The biggest itables, up to max_blocks blocks, that the free space allows, 0 if none bigger than
+ * the current ones. The extent trees growth is the estimate of increase_feasibility(..., 0, ...),
+ * without reading them: a rough bound, which trees deeper than two levels can exceed.
+ */
+errcode_t increase_max_itable_blocks(ext2_filsys fs, unsigned int max_blocks, unsigned int *ret)
+{
+	struct increase_feasibility res;
+	unsigned int low = fs->inode_blocks_per_group, high = max_blocks, mid;
+	errcode_t retval;
+
+	*ret = 0;
+	/*invariant: low is feasible (or the current size), high + 1 is not */
+	while (low < high) {
+		mid = low + (high - low + 1) / 2;
+		retval = increase_feasibility(fs, mid, 0, &res);
+		if (retval)
+			return retval;
+		if (res.feasible)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	if (low > fs->inode_blocks_per_group)
+		*ret = low;
+	return 0;
+}
@@ -20,18 +20,32 @@
  * Increasing the inode count consists of the following phases:
  *
  *	1.  Reset stats for groups in new fs
- *	2.  Allocate new larger inode tables
- *	3.  Migrate inodes to the new itables
- *	4.  Free the space of the old itables
- *	5.  If there were no contiguous free blocks to allocate some of the new itables:
- *	    5.a  Move some data blocks to make room for it
- *	    5.b  Update references to those data blocks in the affected files/folders
- *	    5.c  Go back to step 2 for the new itables pending allocation
+ *	2.  Plan the final location of every new itable from the bitmaps alone,
+ *	    including the data blocks to be evicted and the space of old itables
+ *	    that will be evacuated before the new itable is written there
+ *	3.  Move the evicted data blocks in one pass
+ *	4.  Update references to those data blocks in one pass over the inodes
+ *	5.  For each group, in order: place its new itable, migrate its inodes,
+ *	    and free the old itables that have been completely evacuated
+ *
+ * If no complete plan can be found, we fall back to the iterative approach:
+ *
+ *	a.  Allocate new larger inode tables
+ *	b.  Migrate inodes to the new itables
+ *	c.  Free the space of the old itables
+ *	d.  If there were no contiguous free blocks to allocate some of the new itables:
+ *	    d.1  Move some data blocks to make room for it
+ *	    d.2  Update references to those data blocks in the affected files/folders
+ *	    d.3  Go back to step a. for the new itables pending allocation
  *
  */
 
 #include "config.h"
 #include "resize2fs.h"
+#include "ext2fs/kernel-jbd.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 
 typedef enum {
@@ -41,7 +55,11 @@ typedef enum {
 } itable_status;
 
 static errcode_t inode_relocation_to_bigger_tables(ext2_resize_t rfs, unsigned int new_inodes_per_group);
+
+/*number of threads of the forward migration of the iterative approach, and of the directory rewrite of the reduce path */
+int migrate_threads = 1;
 static errcode_t fix_sb_journal_backup(ext2_filsys fs);
+static errcode_t recreate_journal(ext2_resize_t rfs);
 static void fix_uninit_block_bitmaps(ext2_filsys fs);
 
 errcode_t increase_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (ext2_resize_t rfs, int pass, unsigned long cur, unsigned long max_val), unsigned int new_inodes_per_group)
@@ -49,6 +67,7 @@ errcode_t increase_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (
 	ext2_resize_t rfs;
 	errcode_t retval;
 	struct resource_track rtrack, overall_track;
+	int prof_overall, prof;
 
 	/*
 	 * Create the data structure
@@ -65,8 +84,11 @@ errcode_t increase_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (
 	rfs->progress = progress;
 
 	init_resource_track(&overall_track, "overall resize2fs", fs->io);
+	prof_overall = profile_begin("increase_inode_count");
 	init_resource_track(&rtrack, "read_bitmaps", fs->io);
-	retval = ext2fs_read_bitmaps(fs);
+	prof = profile_begin("read_bitmaps");
+	retval = mem_read_bitmaps(fs);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 	print_resource_track(rfs, &rtrack, fs->io);
@@ -76,20 +98,39 @@ errcode_t increase_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (
 	ext2fs_flush(fs);
 
 	init_resource_track(&rtrack, "fix_uninit_block_bitmaps 1", fs->io);
+	prof = profile_begin("fix_uninit_block_bitmaps");
 	fix_uninit_block_bitmaps(fs);
+	profile_end(prof);
 	print_resource_track(rfs, &rtrack, fs->io);
-	retval = ext2fs_dup_handle(fs, &rfs->new_fs);
+	retval = dup_fs_handle(fs, &rfs->new_fs);
+	if (retval)
+		goto errout;
+	retval = bulk_io_open(rfs);
 	if (retval)
 		goto errout;
 
 	init_resource_track(&rtrack, "inode_relocation_to_bigger_tables", fs->io);
+	prof = profile_begin("inode_relocation_to_bigger_tables");
 	retval = inode_relocation_to_bigger_tables(rfs, new_inodes_per_group);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 	print_resource_track(rfs, &rtrack, fs->io);
 
+	if (rfs->journal_blocks) {
+		init_resource_track(&rtrack, "recreate_journal", fs->io);
+		prof = profile_begin("recreate_journal");
+		retval = recreate_journal(rfs);
+		profile_end(prof);
+		if (retval)
+			goto errout;
+		print_resource_track(rfs, &rtrack, fs->io);
+	}
+
 	init_resource_track(&rtrack, "fix_sb_journal_backup", fs->io);
+	prof = profile_begin("fix_sb_journal_backup");
 	retval = fix_sb_journal_backup(rfs->new_fs);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 	print_resource_track(rfs, &rtrack, fs->io);
@@ -104,7 +145,13 @@ errcode_t increase_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (
 
 	print_resource_track(rfs, &overall_track, fs->io);
 
-	retval = ext2fs_close_free(&rfs->new_fs);
+	prof = profile_begin("close_and_flush");
+	retval = bulk_io_close(rfs);
+	unshare_block_map(rfs->new_fs, rfs->old_fs);
+	if (!retval)
+		retval = ext2fs_close_free(&rfs->new_fs);
+	profile_end(prof);
+	profile_end(prof_overall);
 	if (retval)
 		goto errout;
 
@@ -123,7 +170,11 @@ errcode_t increase_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (
 	return 0;
 
  errout:
+	profile_end(prof_overall);
+	bulk_io_close(rfs);
 	if (rfs->new_fs) {
+		/*the caller closes the old fs, with the block bitmap*/
+		unshare_block_map(rfs->old_fs, rfs->new_fs);
 		ext2fs_free(rfs->new_fs);
 		rfs->new_fs = NULL;
 	}
@@ -203,6 +254,160 @@ static errcode_t fix_sb_journal_backup(ext2_filsys fs)
 	return 0;
 }
 
+/*
+ * The kernel writes the journal sequentially, so it is created as a single extent when possible.
+ * Relocated by block_mover() like any data, the part of it under the new itables would end up
+ * scattered in the free space. When the journal has nothing to replay, its content doesn't matter:
+ * if it overlaps the planned itables, it is freed before the eviction, and created again once the
+ * new itables are in place. A journal that needs recovery (only possible with -f) is relocated
+ * like any data, so that no committed transaction is lost.
+ */
+struct journal_scan {
+	ext2_resize_t	rfs;
+	blk64_t		overlap, moved;
+	int		unmark;
+};
+
+static int journal_scan_block(ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+			      blk64_t ref_block EXT2FS_ATTR((unused)), int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
+{
+	struct journal_scan *js = priv_data;
+
+	if (ext2fs_test_block_bitmap2(js->rfs->reserve_blocks, *blocknr))
+		js->overlap++;
+	if (ext2fs_test_block_bitmap2(js->rfs->move_blocks, *blocknr)) {
+		js->moved++;
+		if (js->unmark)
+			ext2fs_unmark_block_bitmap2(js->rfs->move_blocks, *blocknr);
+	}
+	return 0;
+}
+
+/*the size of the journal and of its fast commit area, from its superblock */
+static errcode_t read_journal_size(ext2_filsys fs, struct ext2_inode *inode, blk64_t *journal_blocks, blk64_t *fc_blocks)
+{
+	journal_superblock_t *jsb;
+	blk64_t pblk = 0;
+	char *buf;
+	errcode_t retval;
+
+	retval = ext2fs_bmap2(fs, fs->super->s_journal_inum, inode, NULL, 0, 0, NULL, &pblk);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	retval = io_channel_read_blk64(fs->io, pblk, 1, buf);
+	if (retval)
+		goto errout;
+	jsb = (journal_superblock_t *)buf;
+	*journal_blocks = ext2fs_be32_to_cpu(jsb->s_maxlen);
+	*fc_blocks = jbd2_has_feature_fast_commit(jsb) ? (blk64_t)jbd2_journal_get_num_fc_blks(jsb) : 0;
+	if (!pblk || ext2fs_be32_to_cpu(jsb->s_header.h_magic) != JBD2_MAGIC_NUMBER ||
+	    *journal_blocks > EXT2_I_SIZE(inode) / fs->blocksize || *fc_blocks >= *journal_blocks)
+		retval = EXT2_ET_CORRUPT_JOURNAL_SB;
+ errout:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+/*
+ * Decide if the journal is to be created again instead of relocated, and take it out of the
+ * eviction plan. *journal_need is set to the free blocks the new journal needs on top of the
+ * ones its old blocks outside the new itables give back.
+ */
+static errcode_t plan_journal_recreation(ext2_resize_t rfs, blk64_t *evicted, blk64_t *journal_need)
+{
+	ext2_filsys fs = rfs->old_fs;
+	struct journal_scan js;
+	struct ext2_inode inode;
+	blk64_t journal_blocks, fc_blocks;
+	errcode_t retval;
+
+	rfs->journal_blocks = 0;
+	*journal_need = 0;
+	/*on bigalloc, the clusters of the journal may be shared with other files */
+	if (!ext2fs_has_feature_journal(fs->super) || !fs->super->s_journal_inum || ext2fs_has_feature_bigalloc(fs->super))
+		return 0;
+	if (ext2fs_has_feature_journal_needs_recovery(fs->super))
+		return 0;
+
+	memset(&js, 0, sizeof(js));
+	js.rfs = rfs;
+	retval = ext2fs_block_iterate3(fs, fs->super->s_journal_inum, BLOCK_FLAG_READ_ONLY, NULL, journal_scan_block, &js);
+	if (retval || !js.overlap)
+		return retval;
+
+	retval = ext2fs_read_inode(fs, fs->super->s_journal_inum, &inode);
+	if (retval)
+		return retval;
+	retval = read_journal_size(fs, &inode, &journal_blocks, &fc_blocks);
+	if (retval)
+		return retval;
+	js.unmark = 1;
+	js.overlap = js.moved = 0;
+	retval = ext2fs_block_iterate3(fs, fs->super->s_journal_inum, BLOCK_FLAG_READ_ONLY, NULL, journal_scan_block, &js);
+	if (retval)
+		return retval;
+	*evicted -= js.moved;
+	rfs->journal_blocks = journal_blocks;
+	rfs->journal_fc_blocks = fc_blocks;
+	*journal_need = js.overlap;
+	printf("plan_new_itables: the journal overlaps %llu blocks of the new itables, it will be created again (%llu blocks)\n",
+		js.overlap, rfs->journal_blocks);
+	return 0;
+}
+
+static int journal_free_block(ext2_filsys fs EXT2FS_ATTR((unused)), blk64_t *blocknr, e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+			      blk64_t ref_block EXT2FS_ATTR((unused)), int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
+{
+	ext2_resize_t rfs = priv_data;
+
+	ext2fs_block_alloc_stats2(rfs->new_fs, *blocknr, -1);
+	return 0;
+}
+
+/*free the blocks of the journal in both fs. The inode is migrated with no blocks */
+static errcode_t free_journal(ext2_resize_t rfs)
+{
+	ext2_filsys fs = rfs->old_fs;
+	struct ext2_inode inode;
+	errcode_t retval;
+
+	retval = ext2fs_block_iterate3(fs, fs->super->s_journal_inum, BLOCK_FLAG_READ_ONLY, NULL, journal_free_block, rfs);
+	if (retval)
+		return retval;
+	retval = ext2fs_read_inode(fs, fs->super->s_journal_inum, &inode);
+	if (retval)
+		return retval;
+	log_verbose("Freeing the journal, inode %u\n", fs->super->s_journal_inum);
+	return ext2fs_punch(fs, fs->super->s_journal_inum, &inode, NULL, 0, ~0ULL);
+}
+
+/*
+ * Create the journal again with the same size and fast commit area, where mke2fs would put it.
+ * It is always zeroed: it is likely to land on the old journal, whose transactions carry the
+ * same checksum seed and could be replayed by the new one after a crash.
+ */
+static errcode_t recreate_journal(ext2_resize_t rfs)
+{
+	ext2_filsys fs = rfs->new_fs;
+	struct ext2fs_journal_params jparams;
+	errcode_t retval;
+
+	memset(&jparams, 0, sizeof(jparams));
+	jparams.num_journal_blocks = rfs->journal_blocks - rfs->journal_fc_blocks;
+	jparams.num_fc_blocks = rfs->journal_fc_blocks;
+
+	/*the allocator of the block mover is not needed anymore, the new itables are all in place */
+	fs->get_alloc_block = NULL;
+	printf("Creating the journal again, %llu blocks\n", rfs->journal_blocks);
+	retval = ext2fs_add_journal_inode3(fs, &jparams, ~0ULL, 0);
+	if (retval)
+		printf("Error %li while creating the journal again\n", retval);
+	return retval;
+}
+
 static void init_block_alloc(ext2_resize_t rfs)
 {
 
@@ -219,7 +424,7 @@ static blk64_t get_new_block(ext2_resize_t rfs)
 	while (1) {
 		if (rfs->new_blk >= ext2fs_blocks_count(fs->super)) {
 			rfs->new_blk = fs->super->s_first_data_block;
-			printf("Moving search back to first block for allocations\n");
+			log_debug(RESIZE_DEBUG_BMOVE, "Moving search back to first block for allocations\n");
 			continue;
 		}
 		if (initial == rfs->new_blk) {
@@ -239,35 +444,22 @@ static errcode_t resize2fs_get_alloc_block(ext2_filsys fs, blk64_t goal EXT2FS_A
 {
 	ext2_resize_t rfs = (ext2_resize_t) fs->priv_data;
 	blk64_t blk;
-	int group;
 	int is_new_fs = (fs == rfs->new_fs);
 
-	printf("get_alloc_block allocating %s...\n", is_new_fs ? "in new fs" : "in old fs");
+	log_debug(RESIZE_DEBUG_BMOVE, "get_alloc_block allocating %s...\n", is_new_fs ? "in new fs" : "in old fs");
 	blk = get_new_block(rfs);
 	if (!blk)
 		return ENOSPC;
-	printf("get_alloc_block got %llu\n", (unsigned long long)blk);
+	log_debug(RESIZE_DEBUG_BMOVE, "get_alloc_block got %llu\n", (unsigned long long)blk);
 
 	/*move_blocks now contains allocated blocks not to be remapped */
 	ext2fs_mark_block_bitmap2(rfs->move_blocks, blk);
 
-	/*We need to update stats (which will also mark block and clear uninit) in the other fs
-	   to avoid bitmap inconsistencies in fsck for unoptimized/expanded? extent trees whose
-	   new blocks get allocated by this function */
-	if (is_new_fs) {
-		ext2fs_block_alloc_stats2(rfs->old_fs, blk, +1);
-
-		ext2fs_mark_block_bitmap2(rfs->new_fs->block_map, blk);
-		group = ext2fs_group_of_blk2(rfs->new_fs, blk);
-		ext2fs_clear_block_uninit(rfs->new_fs, group);
-	} else {
+	/*The caller accounts the block in fs, which marks it in the shared block bitmap. When the
+	   extent tree of a file grows through the old fs, the new fs still has to count it */
+	if (!is_new_fs)
 		ext2fs_block_alloc_stats2(rfs->new_fs, blk, +1);
 
-		ext2fs_mark_block_bitmap2(rfs->old_fs->block_map, blk);
-		group = ext2fs_group_of_blk2(rfs->old_fs, blk);
-		ext2fs_clear_block_uninit(rfs->old_fs, group);
-	}
-
 	*ret = (blk64_t) blk;
 	return 0;
 }
@@ -277,11 +469,13 @@ static errcode_t block_mover(ext2_resize_t rfs, itable_status *new_itable_status
 	blk64_t blk, old_blk, new_blk;
 	ext2_filsys fs = rfs->new_fs;
 	ext2_filsys old_fs = rfs->old_fs;
-	errcode_t retval;
+	errcode_t retval, err;
 	__u64 c, size;
 	int to_move, moved;
 	ext2_badblocks_list badblock_list = 0;
 	int bb_modified = 0;
+	int prof;
+	alloc_stats_batch_t new_stats = NULL;
 	ext2_filsys fs_bb_inode = (new_itable_status[ext2fs_group_of_ino(rfs->new_fs, EXT2_BAD_INO)] == itable_status_filled) ? rfs->new_fs : rfs->old_fs;
 
 	rfs->old_fs->get_alloc_block = resize2fs_get_alloc_block;
@@ -291,13 +485,19 @@ static errcode_t block_mover(ext2_resize_t rfs, itable_status *new_itable_status
 	if (retval)
 		return retval;
 
+	prof = profile_begin("block_mover");
 	new_blk = fs->super->s_first_data_block;
 	if (!rfs->itable_buf) {
-		retval = ext2fs_get_array(fs->blocksize, fs->inode_blocks_per_group, &rfs->itable_buf);
+		retval = bulk_io_get_buf(rfs, fs->blocksize * fs->inode_blocks_per_group, &rfs->itable_buf);
 		if (retval)
 			goto errout;
+		mem_account("inode table buffer", (unsigned long long)fs->blocksize * fs->inode_blocks_per_group);
 	}
 	retval = ext2fs_create_extent_table(&rfs->bmap, 0);
+	if (retval)
+		goto errout;
+	/*the group descriptors are updated once per group, at the end */
+	retval = alloc_stats_open(rfs->new_fs, &new_stats);
 	if (retval)
 		goto errout;
 
@@ -322,11 +522,14 @@ static errcode_t block_mover(ext2_resize_t rfs, itable_status *new_itable_status
 			printf("block_mover ENOSPC old_block %llu\n", blk);
 			break;
 		}
-		ext2fs_block_alloc_stats2(rfs->new_fs, new_blk, +1);
-		ext2fs_block_alloc_stats2(rfs->old_fs, new_blk, +1);
-		ext2fs_add_extent_entry(rfs->bmap, B2C(blk), B2C(new_blk));
+		alloc_stats_block(new_stats, new_blk, +1);
+		retval = ext2fs_add_extent_entry(rfs->bmap, B2C(blk), B2C(new_blk));
+		if (retval)
+			goto errout;
 		to_move++;
 	}
+	mem_account("block relocation map", ext2fs_extent_table_memory(rfs->bmap));
+	profile_add_items(C2B(to_move));
 
 	if (to_move == 0) {
 		if (rfs->bmap) {
@@ -343,6 +546,14 @@ static errcode_t block_mover(ext2_resize_t rfs, itable_status *new_itable_status
 	retval = ext2fs_iterate_extent(rfs->bmap, 0, 0, 0);
 	if (retval)
 		goto errout;
+	if (verify_mode)
+		verify_new_pass();
+
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_BLOCK_RELOC_PASS, 0, C2B(to_move));
+		if (retval)
+			goto errout;
+	}
 
 	while (1) {
 		retval = ext2fs_iterate_extent(rfs->bmap, &old_blk, &new_blk, &size);
@@ -354,37 +565,52 @@ static errcode_t block_mover(ext2_resize_t rfs, itable_status *new_itable_status
 		new_blk = C2B(new_blk);
 		size = C2B(size);
 
-		printf("Moving %llu blocks %llu->%llu\n", (unsigned long long)size, (unsigned long long)old_blk, (unsigned long long)new_blk);
-
+		log_debug(RESIZE_DEBUG_BMOVE, "Moving %llu blocks %llu->%llu\n", (unsigned long long)size, (unsigned long long)old_blk, (unsigned long long)new_blk);
 		do {
 			c = size;
 			if (c > fs->inode_blocks_per_group)
 				c = fs->inode_blocks_per_group;
-			retval = io_channel_read_blk64(fs->io, old_blk, c, rfs->itable_buf);
+			retval = bulk_io_read(rfs, old_blk, c, rfs->itable_buf);
 			if (retval)
 				goto errout;
-			retval = io_channel_write_blk64(fs->io, new_blk, c, rfs->itable_buf);
+			if (verify_mode) {
+				/*blocks relocated by an earlier iteration of make_room_for_new_itables() */
+				retval = verify_moved_blocks(old_blk, c);
+				if (!retval)
+					retval = verify_record_blocks(new_blk, c, rfs->itable_buf, fs->blocksize);
+				if (retval)
+					goto errout;
+			}
+			retval = bulk_io_write(rfs, new_blk, c, rfs->itable_buf);
 			if (retval)
 				goto errout;
 
-			ext2fs_block_alloc_stats_range(rfs->new_fs, old_blk, c, -1);
-			ext2fs_block_alloc_stats_range(rfs->old_fs, old_blk, c, -1);
+			alloc_stats_block_range(new_stats, old_blk, c, -1);
 			size -= c;
 			new_blk += c;
 			old_blk += c;
 			moved += c;
 
+			if (rfs->progress) {
+				retval = (rfs->progress)(rfs, E2_RSZ_BLOCK_RELOC_PASS, moved, C2B(to_move));
+				if (retval)
+					goto errout;
+			}
 		} while (size > 0);
 	}
 
 	io_channel_flush(fs->io);
 
  errout:
+	err = alloc_stats_close(&new_stats);
+	if (!retval)
+		retval = err;
 	if (badblock_list) {
 		if (!retval && bb_modified)
 			retval = ext2fs_update_bb_inode(fs_bb_inode, badblock_list);
 		ext2fs_badblocks_list_free(badblock_list);
 	}
+	profile_end(prof);
 	return retval;
 }
 
@@ -399,16 +625,24 @@ static int update_block_reference(ext2_filsys fs, blk64_t *block_nr, e2_blkcnt_t
 	block = *block_nr;
 	if (pb->rfs->bmap) {
 		new_block = extent_translate(fs, pb->rfs->bmap, block);
+		/*an extent or indirect block is written again with the new pointers */
+		if (new_block && blockcnt < 0 && verify_mode) {
+			retval = verify_forget_block(new_block);
+			if (retval) {
+				pb->error = retval;
+				return BLOCK_ABORT;
+			}
+		}
 		if (new_block) {
 			if (ext2fs_test_block_bitmap2(pb->rfs->move_blocks, block)) {
-				printf("ino=%u, blockcnt=%lld, %llu->%llu, frees (%s): %llu. Already moved and re-allocated - nothing to do\n", pb->old_ino, (long long)blockcnt, (unsigned long long)block, (unsigned long long)new_block, fs == pb->rfs->new_fs ? "new_fs" : "old_fs", ext2fs_free_blocks_count(fs->super));
+				log_debug(RESIZE_DEBUG_BMOVE, "ino=%u, blockcnt=%lld, %llu->%llu, frees (%s): %llu. Already moved and re-allocated - nothing to do\n", pb->old_ino, (long long)blockcnt, (unsigned long long)block, (unsigned long long)new_block, fs == pb->rfs->new_fs ? "new_fs" : "old_fs", ext2fs_free_blocks_count(fs->super));
 				return 0;
 			}
 			*block_nr = new_block;
 			ret |= BLOCK_CHANGED;
 			pb->changed = 1;
 
-			printf("ino=%u, blockcnt=%lld, %llu->%llu, frees (%s): %llu\n", pb->old_ino, (long long)blockcnt, (unsigned long long)block, (unsigned long long)new_block, fs == pb->rfs->new_fs ? "new_fs" : "old_fs", ext2fs_free_blocks_count(fs->super));
+			log_debug(RESIZE_DEBUG_BMOVE, "ino=%u, blockcnt=%lld, %llu->%llu, frees (%s): %llu\n", pb->old_ino, (long long)blockcnt, (unsigned long long)block, (unsigned long long)new_block, fs == pb->rfs->new_fs ? "new_fs" : "old_fs", ext2fs_free_blocks_count(fs->super));
 
 
 			/*If not a metadata block, unmark it now, so it can be reallocated for other stuff (like extent tree growth).
@@ -446,11 +680,16 @@ static errcode_t migrate_ea_block(ext2_extent bmap, ext2_filsys fs, ext2_ino_t i
 		return 0;
 
 	/* Set the new ACL block */
-	printf("migrate_ea_block, inode %u, old_block %llu, new_block %llu\n", ino, ext2fs_file_acl_block(fs, inode), new_block);
+	log_debug(RESIZE_DEBUG_BMOVE, "migrate_ea_block, inode %u, old_block %llu, new_block %llu\n", ino, ext2fs_file_acl_block(fs, inode), new_block);
 	ext2fs_file_acl_block_set(fs, inode, new_block);
 
 	/* Update checksum */
 	if (ext2fs_has_feature_metadata_csum(fs->super)) {
+		if (verify_mode) {
+			err = verify_forget_block(new_block);
+			if (err)
+				return err;
+		}
 		err = ext2fs_get_mem(fs->blocksize, &buf);
 		if (err)
 			return err;
@@ -470,15 +709,32 @@ static errcode_t migrate_ea_block(ext2_extent bmap, ext2_filsys fs, ext2_ino_t i
 	return err;
 }
 
+/*request the itables of inodes first..last, from the handle each group is read from */
+static void readahead_scan_inodes(ext2_resize_t rfs, itable_status *new_itable_status, ext2_ino_t first, ext2_ino_t last)
+{
+	ext2_ino_t ipg = rfs->new_fs->super->s_inodes_per_group, group_last;
+	dgrp_t group;
+
+	while (first <= last) {
+		group = ext2fs_group_of_ino(rfs->new_fs, first);
+		group_last = (group + 1) * ipg;
+		if (group_last > last)
+			group_last = last;
+		readahead_inodes(new_itable_status[group] == itable_status_filled ? rfs->new_fs : rfs->old_fs, first, group_last);
+		first = group_last + 1;
+	}
+}
+
 static errcode_t inode_scan_and_fix(ext2_resize_t rfs, itable_status *new_itable_status)
 {
 	struct process_block_struct pb;
-	ext2_ino_t ino;
+	ext2_ino_t ino, ra_next = 1, ra_first, ra_last;
 	struct ext2_inode *inode = NULL;
 	errcode_t retval;
 	char *block_buf = 0;
 	int inode_size;
 	ext2_filsys fs;
+	int prof = profile_begin("inode_scan_and_fix");
 
 	set_com_err_hook(quiet_com_err_proc);
 
@@ -496,10 +752,25 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs, itable_status *new_itable
 		goto errout;
 	}
 
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_INODE_SCAN_PASS, 0, rfs->old_fs->group_desc_count);
+		if (retval)
+			goto errout;
+	}
+
 	for (ino = 1; ino <= rfs->old_fs->super->s_inodes_count; ino++) {
 		if (!ino)
 			break;
 
+		if (rfs->progress && (ino % rfs->old_fs->super->s_inodes_per_group) == 0) {
+			retval = (rfs->progress)(rfs, E2_RSZ_INODE_SCAN_PASS, ino / rfs->old_fs->super->s_inodes_per_group, rfs->old_fs->group_desc_count);
+			if (retval)
+				goto errout;
+		}
+
+		if (readahead_inode_window(rfs->old_fs, ino, &ra_next, &ra_first, &ra_last))
+			readahead_scan_inodes(rfs, new_itable_status, ra_first, ra_last);
+
 		if (new_itable_status[ext2fs_group_of_ino(rfs->new_fs, ino)] == itable_status_filled)
 			fs = rfs->new_fs;
 		else
@@ -512,6 +783,7 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs, itable_status *new_itable
 		if (inode->i_links_count == 0 && ino != EXT2_RESIZE_INO)
 			continue;	/* inode not in use */
 
+		profile_add_items(1);
 		pb.changed = 0;
 
 		/* Remap EA block */
@@ -532,6 +804,7 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs, itable_status *new_itable
 			pb.ino = ino;
 			pb.old_ino = ino;
 			pb.has_extents = inode->i_flags & EXT4_EXTENTS_FL;
+			readahead_extent_tree(fs, inode);
 			retval = ext2fs_block_iterate3(fs, ino, 0, block_buf, update_block_reference, &pb);
 			if (retval || pb.error)
 				printf("ext2fs_block_iterate3: retval %lu, pb.error %lu, ino %u\n", retval, pb.error, ino);
@@ -554,10 +827,12 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs, itable_status *new_itable
 	if (rfs->bmap) {
 		ext2fs_free_extent_table(rfs->bmap);
 		rfs->bmap = 0;
+		mem_account("block relocation map", 0);
 	}
 	if (block_buf)
 		ext2fs_free_mem(&block_buf);
 	free(inode);
+	profile_end(prof);
 	return retval;
 }
 
@@ -577,7 +852,7 @@ static errcode_t fix_itables_stats_bigalloc(ext2_filsys fs, blk64_t start, unsig
 	blk = start + len - 1;
 	group_of_block = ext2fs_group_of_blk2(fs, blk);
 
-	printf("fix_itables_stats_bigalloc, before: start: %llu, len %u, group: %u, free in group %u, free in super: %llu\n", start, len, group_of_block, ext2fs_bg_free_blocks_count(fs, group_of_block), ext2fs_free_blocks_count(fs->super));
+	log_debug(RESIZE_DEBUG_ITABLEMOVE, "fix_itables_stats_bigalloc, before: start: %llu, len %u, group: %u, free in group %u, free in super: %llu\n", start, len, group_of_block, ext2fs_bg_free_blocks_count(fs, group_of_block), ext2fs_free_blocks_count(fs->super));
 
 	rem = (blk + 1) % cluster_size;
 	if (rem) {
@@ -587,19 +862,76 @@ static errcode_t fix_itables_stats_bigalloc(ext2_filsys fs, blk64_t start, unsig
 		ext2fs_free_blocks_count_add(fs->super, -(cluster_size - rem));
 		ext2fs_mark_super_dirty(fs);
 		ext2fs_mark_bb_dirty(fs);
-		printf("->modif done for inuse 1\n");
+		log_debug(RESIZE_DEBUG_ITABLEMOVE, "->modif done for inuse 1\n");
 	}
 
-	printf("fix_itables_stats_bigalloc, after: start: %llu, len %u, group: %u, free in group %u, free in super: %llu\n", start, len, group_of_block, ext2fs_bg_free_blocks_count(fs, group_of_block), ext2fs_free_blocks_count(fs->super));
+	log_debug(RESIZE_DEBUG_ITABLEMOVE, "fix_itables_stats_bigalloc, after: start: %llu, len %u, group: %u, free in group %u, free in super: %llu\n", start, len, group_of_block, ext2fs_bg_free_blocks_count(fs, group_of_block), ext2fs_free_blocks_count(fs->super));
 
  errout:
 	return retval;
 }
 
+/*
+ * zero a run of new itables. The device does it when it can: io_channel_zeroout() uses
+ * fallocate(FALLOC_FL_ZERO_RANGE/PUNCH_HOLE), which is write-zeroes/discard on a block device.
+ * Otherwise, fall back to writing zeroes.
+ */
+static errcode_t zero_itable_blocks(ext2_resize_t rfs, blk64_t start, blk64_t len)
+{
+	errcode_t retval;
+
+	if (!len)
+		return 0;
+	retval = io_channel_zeroout(rfs->new_fs->io, start, len);
+	if (!retval)
+		return 0;
+	log_verbose("zeroout of %llu blocks at %llu not done by the device (%li), writing zeroes\n", len, start, retval);
+	return bulk_io_zero(rfs, start, len);
+}
+
+/*
+ * With RESIZE_LAZY_ITABLE_INIT, only the start of a new itable, up to the last inode in use,
+ * is initialized. The rest is left for the kernel lazyinit thread, as with mke2fs -E lazy_itable_init.
+ * Returns how many inodes of the new group have to be migrated.
+ */
+static unsigned int lazy_used_inodes(ext2_resize_t rfs, dgrp_t new_group)
+{
+	ext2_ino_t first_ino = new_group * rfs->new_fs->super->s_inodes_per_group + 1;
+	ext2_ino_t ino, last_ino = first_ino + rfs->new_fs->super->s_inodes_per_group - 1;
+
+	if (first_ino > rfs->old_fs->super->s_inodes_count)
+		return 0;
+	if (last_ino > rfs->old_fs->super->s_inodes_count || last_ino < first_ino)
+		last_ino = rfs->old_fs->super->s_inodes_count;
+	for (ino = last_ino; ino >= first_ino; ino--) {
+		if (ino < EXT2_FIRST_INODE(rfs->new_fs->super) || ext2fs_test_inode_bitmap2(rfs->old_fs->inode_map, ino))
+			return ino - first_ino + 1;
+	}
+	return 0;
+}
+
+/*number of blocks of the new itable of the group that must be zeroed before migrating its inodes*/
+static blk64_t itable_blocks_to_init(ext2_resize_t rfs, dgrp_t new_group)
+{
+	if (!(rfs->flags & RESIZE_LAZY_ITABLE_INIT))
+		return rfs->new_fs->inode_blocks_per_group;
+	return ext2fs_div_ceil(lazy_used_inodes(rfs, new_group) * EXT2_INODE_SIZE(rfs->new_fs->super), rfs->new_fs->blocksize);
+}
+
+/*the new itable is either fully zeroed, or left for lazyinit to finish*/
+static void set_itable_zeroed_flag(ext2_resize_t rfs, dgrp_t group, blk64_t zeroed_blocks)
+{
+	if (zeroed_blocks == rfs->new_fs->inode_blocks_per_group)
+		ext2fs_bg_flags_set(rfs->new_fs, group, EXT2_BG_INODE_ZEROED);
+	else
+		ext2fs_bg_flags_clear(rfs->new_fs, group, EXT2_BG_INODE_ZEROED);
+	ext2fs_group_desc_csum_set(rfs->new_fs, group);
+}
+
 static errcode_t allocate_new_itables(ext2_resize_t rfs, itable_status *new_itable_status, unsigned int *allocated_new_itables)
 {
 
-	blk64_t itable_start;
+	blk64_t itable_start, zero_start = 0, zero_len = 0, init_len;
 	errcode_t retval;
 	dgrp_t group = 0;
 	int len = 0;
@@ -609,23 +941,27 @@ static errcode_t allocate_new_itables(ext2_resize_t rfs, itable_status *new_itab
 			ext2fs_inode_table_loc_set(rfs->new_fs, group, 0);
 			retval = ext2fs_allocate_group_table(rfs->new_fs, group, 0);
 			if (retval == EXT2_ET_BLOCK_ALLOC_FAIL) {
-				printf("unsuccessful ext2fs_allocate_group_table for group %u with EXT2_ET_BLOCK_ALLOC_FAIL (%li) - will retry later\n", group, retval);
+				log_verbose("unsuccessful ext2fs_allocate_group_table for group %u with EXT2_ET_BLOCK_ALLOC_FAIL (%li) - will retry later\n", group, retval);
 			} else if (!retval) {
 				itable_start = ext2fs_inode_table_loc(rfs->new_fs, group);
 				len = rfs->new_fs->inode_blocks_per_group;
 				/*ext2fs_allocate_group_table() doesn't update stats in group if flex_bg is not set, we have to do it ourselves */
 				if (!ext2fs_has_feature_flex_bg(rfs->new_fs->super))
 					ext2fs_block_alloc_stats_range(rfs->new_fs, itable_start, len, +1);
-				ext2fs_block_alloc_stats_range(rfs->old_fs, itable_start, len, +1);
-				retval = ext2fs_zero_blocks2(rfs->new_fs, itable_start, len, &itable_start, &len);
-				if (retval) {
-					fprintf(stderr, _("\nCould not write %d " "blocks in inode table starting at %llu: %s\n"), len, (unsigned long long)itable_start, error_message(retval));
-					exit(1);
+				init_len = itable_blocks_to_init(rfs, group);
+				set_itable_zeroed_flag(rfs, group, init_len);
+				/*the itables of a flex group are usually adjacent: zero them with a single request */
+				if (zero_len && zero_start + zero_len == itable_start) {
+					zero_len += init_len;
+				} else {
+					if (zero_len && zero_itable_blocks(rfs, zero_start, zero_len))
+						exit(1);
+					zero_start = itable_start;
+					zero_len = init_len;
 				}
-				printf("successful ext2fs_allocate_group_table for group %u with retval %li in block %llu\n", group, retval, itable_start);
+				log_verbose("successful ext2fs_allocate_group_table for group %u with retval %li in block %llu\n", group, retval, itable_start);
 				if (ext2fs_has_feature_bigalloc(rfs->new_fs->super)) {
 					fix_itables_stats_bigalloc(rfs->new_fs, itable_start, len);
-					fix_itables_stats_bigalloc(rfs->old_fs, itable_start, len);
 				}
 				new_itable_status[group] = itable_status_allocated;
 				(*allocated_new_itables)++;
@@ -635,6 +971,8 @@ static errcode_t allocate_new_itables(ext2_resize_t rfs, itable_status *new_itab
 			}
 		}
 	}
+	if (zero_len && zero_itable_blocks(rfs, zero_start, zero_len))
+		exit(1);
 
 	io_channel_flush(rfs->new_fs->io);
 
@@ -643,138 +981,478 @@ static errcode_t allocate_new_itables(ext2_resize_t rfs, itable_status *new_itab
 	return retval;
 }
 
-static errcode_t migrate_inodes_forward_loop(ext2_resize_t rfs, unsigned int *evacuated_inodes, itable_status *new_itable_status)
+/*migrate to the new itable of new_group all the inodes it will hold, reading them from the old itables*/
+static errcode_t migrate_group_inodes(ext2_resize_t rfs, dgrp_t new_group, struct ext2_inode *inode, alloc_stats_batch_t stats, unsigned int *evacuated_inodes, itable_status *new_itable_status)
 {
-	ext2_ino_t ino_num = 0;
-	struct ext2_inode *inode = NULL;
-	int inode_size = 0;
-	dgrp_t new_group = 0, old_group = 0;
-	errcode_t retval;
-
-	inode_size = EXT2_INODE_SIZE(rfs->new_fs->super);
-	inode = malloc(inode_size);
-	if (!inode) {
-		retval = ENOMEM;
-		goto errout;
-	}
+	ext2_ino_t ino_num, first_ino, last_ino, lazy_last_ino;
+	int inode_size = EXT2_INODE_SIZE(rfs->new_fs->super);
+	dgrp_t old_group;
+	errcode_t retval = 0;
 
-	for (ino_num = 1; ino_num <= rfs->old_fs->super->s_inodes_count; ino_num++) {
-		if (!ino_num) {
-			/*Overflow case... rfs->old_fs->super->s_inodes_count is already MAX of ext2_ino_t
-			   and we are running the increaser?? It shall not be even possible!
-			   Break just in case. The itable_status_filled shall have been set when treating the last inode */
-			break;
+	first_ino = new_group * rfs->new_fs->super->s_inodes_per_group + 1;
+	last_ino = first_ino + rfs->new_fs->super->s_inodes_per_group - 1;
+	if (last_ino > rfs->old_fs->super->s_inodes_count || last_ino < first_ino)
+		last_ino = rfs->old_fs->super->s_inodes_count;
+
+	/*lazy init: the unused inodes at the end are not written, but their old itables are evacuated all the same */
+	if ((rfs->flags & RESIZE_LAZY_ITABLE_INIT) && first_ino <= last_ino) {
+		lazy_last_ino = first_ino - 1 + lazy_used_inodes(rfs, new_group);
+		for (ino_num = lazy_last_ino + 1; ino_num && ino_num <= last_ino; ino_num++) {
+			evacuated_inodes[ext2fs_group_of_ino(rfs->old_fs, ino_num)]++;
+			if (ino_num == last_ino)
+				break;
 		}
+		last_ino = lazy_last_ino;
+	}
 
-		new_group = ext2fs_group_of_ino(rfs->new_fs, ino_num);
+	/*the new itable may be beyond the old inode count, it was already zeroed: nothing to migrate*/
+	for (ino_num = first_ino; ino_num && ino_num <= last_ino; ino_num++) {
 		old_group = ext2fs_group_of_ino(rfs->old_fs, ino_num);
-		if (new_itable_status[new_group] != itable_status_allocated) {
-			if (new_group == rfs->new_fs->group_desc_count - 1)	/*no more groups? break loop */
-				break;
-			ino_num = (new_group + 1) * rfs->new_fs->super->s_inodes_per_group;
-			continue;
-		}
 
-		retval = ext2fs_read_inode2(rfs->old_fs, ino_num, inode, inode_size, 0); /*we might use READ_INODE_NOCSUM instead of checking retval */
-		printf("Migrating inode %u to new itable: links_count: %u, i_size_lo: %u, i_blocks: %u, old group: %u, new group: %u, read_retval: %li",
+		retval = ext2fs_read_inode2(rfs->old_fs, ino_num, inode, inode_size, READ_INODE_NOCSUM);
+		log_debug(RESIZE_DEBUG_INODEMAP, "Migrating inode %u to new itable: links_count: %u, i_size_lo: %u, i_blocks: %u, old group: %u, new group: %u, read_retval: %li",
 			ino_num, inode->i_links_count, inode->i_size, inode->i_blocks, old_group, new_group, retval);
 		/*we require to run fsck before changing the inode count, and that will fix inode checksums on used inodes. However, an unused inode with a wrong
-		   checksum will not be detected by fsck. We don't want to stop the whole process now and leave a messy fs because of that, just log it and continue */
-		if (retval && retval != EXT2_ET_INODE_CSUM_INVALID)
-			goto errout;
+		   checksum will not be detected by fsck. We don't want to stop the whole process now because of that: the checksum is not verified here,
+		   and it is recomputed when the inode is written to the new itable */
+		if (retval)
+			return retval;
 
 		evacuated_inodes[old_group]++;
+		profile_add_items(1);
 
 		if (inode->i_links_count != 0 || ino_num < EXT2_FIRST_INODE(rfs->new_fs->super)) {
-			ext2fs_inode_alloc_stats2(rfs->new_fs, ino_num, +1, LINUX_S_ISDIR(inode->i_mode));
+			retval = alloc_stats_inode(stats, ino_num, +1, LINUX_S_ISDIR(inode->i_mode));
+			if (retval)
+				return retval;
 		}
 
-		retval = ext2fs_write_inode2(rfs->new_fs, ino_num, inode, inode_size, 0);
-		printf(" - write_retval: %li\n", retval);
+		retval = csum_write_inode(rfs->new_fs, ino_num, inode, inode_size);
+		log_debug(RESIZE_DEBUG_INODEMAP, " - write_retval: %li\n", retval);
 		if (retval)
-			goto errout;
+			return retval;
 
-		/*are we about to completely migrate the current new itable? */
-		if (ino_num == rfs->old_fs->super->s_inodes_count || ext2fs_group_of_ino(rfs->new_fs, ino_num + 1) != new_group) {
-			new_itable_status[new_group] = itable_status_filled;
-		}
+		/*Overflow case... rfs->old_fs->super->s_inodes_count is already MAX of ext2_ino_t
+		   and we are running the increaser?? It shall not be even possible! Break just in case. */
+		if (ino_num == last_ino)
+			break;
 	}
 
- errout:
-	if (inode)
-		free(inode);
-	return retval;
+	new_itable_status[new_group] = itable_status_filled;
+	return alloc_stats_flush(stats);
 }
 
-static errcode_t make_room_for_new_itables(ext2_resize_t rfs, itable_status *new_itable_status)
+#if defined(HAVE_PTHREAD_H) && !defined(WORDS_BIGENDIAN)
+/*
+ * Parallel migration: in the iterative approach, all the groups with an
+ * allocated itable are independent. Their new itables are in free space,
+ * and the old itables they read from are only freed after the loop.
+ * Workers take runs of consecutive groups of the same flex group, read
+ * the old itable blocks and write each new itable with raw block I/O, so
+ * no libext2fs structure is shared but the I/O channel (opened with
+ * EXT2_FLAG_THREADS). The statistics, evacuated_inodes[] and the group
+ * status are merged under a lock, one group at a time.
+ */
+struct migrate_unit {
+	dgrp_t		first_group, num_groups;
+};
+
+struct parallel_migrate {
+	ext2_resize_t	rfs;
+	unsigned int	*evacuated_inodes;
+	itable_status	*new_itable_status;
+	alloc_stats_batch_t stats;
+	struct migrate_unit *units;
+	unsigned int	num_units, next_unit;
+	/* last inode to migrate of each group, lazy init included */
+	ext2_ino_t	*last_ino;
+	dgrp_t		groups_done;
+	errcode_t	retval;
+	pthread_mutex_t	lock;
+};
+
+/*the first and last inodes of the new group that still exist in the old fs */
+static int group_migrate_range(ext2_resize_t rfs, dgrp_t group, ext2_ino_t *first_ino, ext2_ino_t *last_ino)
 {
-	unsigned int j;
-	int flexbg_size = 0, retried_from_beginning = 0;
-	dgrp_t g;
-	blk64_t blk, blk2, first_blk, last_blk;
-	blk64_t pledged_blocks = 50;	/* start at 50 as a safe margin for extent trees rebalancing.. TODO: what would be a good start number */
+	*first_ino = group * rfs->new_fs->super->s_inodes_per_group + 1;
+	*last_ino = *first_ino + rfs->new_fs->super->s_inodes_per_group - 1;
+	if (*last_ino > rfs->old_fs->super->s_inodes_count || *last_ino < *first_ino)
+		*last_ino = rfs->old_fs->super->s_inodes_count;
+	return *first_ino <= *last_ino;
+}
+
+/*build the new itable of a group in new_buf, from the old itable blocks */
+static errcode_t build_new_itable(struct parallel_migrate *pm, dgrp_t group, ext2_ino_t last, char *new_buf, char *old_buf)
+{
+	ext2_resize_t rfs = pm->rfs;
+	ext2_filsys old_fs = rfs->old_fs;
+	int inode_size = EXT2_INODE_SIZE(old_fs->super);
+	ext2_ino_t first, ino, end, old_ipg = old_fs->super->s_inodes_per_group;
+	dgrp_t old_group;
+	blk64_t blk, count;
+	unsigned int offset;
 	errcode_t retval;
-	ext2_filsys fs = rfs->old_fs;
-	ext2fs_block_bitmap meta_bmap;
-	ext2_badblocks_list badblock_list = 0;
 
-	init_block_alloc(rfs);
+	first = group * rfs->new_fs->super->s_inodes_per_group + 1;
+	for (ino = first; ino <= last && ino >= first; ino = end + 1) {
+		old_group = (ino - 1) / old_ipg;
+		end = (old_group + 1) * old_ipg;
+		if (end > last)
+			end = last;
+		/*the blocks of the old itable holding inodes ino..end */
+		blk = (__u64)((ino - 1) % old_ipg) * inode_size / old_fs->blocksize;
+		offset = (__u64)((ino - 1) % old_ipg) * inode_size % old_fs->blocksize;
+		count = ext2fs_div_ceil(offset + (__u64)(end - ino + 1) * inode_size, old_fs->blocksize);
+		retval = bulk_io_read(rfs, ext2fs_inode_table_loc(old_fs, old_group) + blk, count, old_buf);
+		if (retval)
+			return retval;
+		memcpy(new_buf + (__u64)(ino - first) * inode_size, old_buf + offset, (__u64)(end - ino + 1) * inode_size);
+		if (end == last)
+			break;
+	}
+	return 0;
+}
 
-	retval = ext2fs_allocate_block_bitmap(fs, _("blocks to be moved"), &rfs->move_blocks);
-	if (retval)
-		return retval;
+/*account the migrated inodes of a group, under the lock */
+static errcode_t merge_migrated_group(struct parallel_migrate *pm, dgrp_t group, ext2_ino_t last, char *new_buf)
+{
+	ext2_resize_t rfs = pm->rfs;
+	int inode_size = EXT2_INODE_SIZE(rfs->new_fs->super);
+	ext2_ino_t first, ino, all_last;
+	struct ext2_inode *inode;
+	errcode_t retval;
 
-	retval = ext2fs_allocate_block_bitmap(fs, _("reserved blocks"), &rfs->reserve_blocks);
-	if (retval)
-		return retval;
+	group_migrate_range(rfs, group, &first, &all_last);
+	for (ino = first; ino <= all_last && ino >= first; ino++) {
+		pm->evacuated_inodes[ext2fs_group_of_ino(rfs->old_fs, ino)]++;
+		if (ino <= last) {
+			inode = (struct ext2_inode *)(new_buf + (__u64)(ino - first) * inode_size);
+			if (inode->i_links_count != 0 || ino < EXT2_FIRST_INODE(rfs->new_fs->super)) {
+				retval = alloc_stats_inode(pm->stats, ino, +1, LINUX_S_ISDIR(inode->i_mode));
+				if (retval)
+					return retval;
+			}
+		}
+		if (ino == all_last)
+			break;
+	}
+	pm->new_itable_status[group] = itable_status_filled;
+	pm->groups_done++;
+	retval = alloc_stats_flush(pm->stats);
+	if (!retval && rfs->progress)
+		retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, pm->groups_done, rfs->new_fs->group_desc_count);
+	return retval;
+}
 
-	retval = ext2fs_allocate_block_bitmap(fs, _("meta-data blocks"), &meta_bmap);
-	if (retval)
-		return retval;
+static void *migrate_worker(void *arg)
+{
+	struct parallel_migrate *pm = arg;
+	ext2_resize_t rfs = pm->rfs;
+	ext2_filsys fs = rfs->new_fs;
+	int inode_size = EXT2_INODE_SIZE(fs->super);
+	char *new_buf = NULL, *old_buf = NULL, *rec;
+	struct migrate_unit *unit;
+	ext2_ino_t first, last, ino;
+	dgrp_t group;
+	errcode_t retval = 0;
+
+	/*each worker has its own buffers: one new itable, and one old itable (plus a block for the offset) */
+	retval = bulk_io_get_buf(rfs, fs->blocksize * fs->inode_blocks_per_group, &new_buf);
+	if (!retval)
+		retval = bulk_io_get_buf(rfs, rfs->old_fs->blocksize * (rfs->old_fs->inode_blocks_per_group + 1), &old_buf);
+
+	while (!retval) {
+		pthread_mutex_lock(&pm->lock);
+		if (pm->retval || pm->next_unit == pm->num_units) {
+			pthread_mutex_unlock(&pm->lock);
+			break;
+		}
+		unit = &pm->units[pm->next_unit++];
+		pthread_mutex_unlock(&pm->lock);
+
+		for (group = unit->first_group; !retval && group < unit->first_group + unit->num_groups; group++) {
+			last = pm->last_ino[group];
+			first = group * fs->super->s_inodes_per_group + 1;
+			if (last >= first) {
+				memset(new_buf, 0, (size_t)fs->blocksize * fs->inode_blocks_per_group);
+				retval = build_new_itable(pm, group, last, new_buf, old_buf);
+				if (retval)
+					break;
+				if (ext2fs_has_feature_metadata_csum(fs->super)) {
+					for (ino = first, rec = new_buf; ino <= last && ino >= first; ino++, rec += inode_size)
+						csum_inode_record(fs, ino, rec);
+				}
+				retval = bulk_io_write(rfs, ext2fs_inode_table_loc(fs, group),
+					ext2fs_div_ceil((__u64)(last - first + 1) * inode_size, fs->blocksize), new_buf);
+				if (retval)
+					break;
+			}
+			pthread_mutex_lock(&pm->lock);
+			retval = merge_migrated_group(pm, group, last, new_buf);
+			pthread_mutex_unlock(&pm->lock);
+		}
+	}
 
-	retval = ext2fs_read_bb_inode(new_itable_status[ext2fs_group_of_ino(rfs->new_fs, EXT2_BAD_INO)] == itable_status_filled ? rfs->new_fs : rfs->old_fs, &badblock_list);
 	if (retval) {
-		printf("Error while reading badblock list in make_room_for_new_itables()\n");
-		return retval;
+		pthread_mutex_lock(&pm->lock);
+		if (!pm->retval)
+			pm->retval = retval;
+		pthread_mutex_unlock(&pm->lock);
 	}
+	ext2fs_free_mem(&new_buf);
+	ext2fs_free_mem(&old_buf);
+	return NULL;
+}
 
-	retval = mark_table_blocks(rfs->old_fs, meta_bmap); /*mark as used in meta_bmap the SB, BGD, reserved GDT, bitmaps, itables and MMP from the OLD FS*/
-	if (retval)
-		return retval;
+static errcode_t migrate_inodes_parallel(ext2_resize_t rfs, alloc_stats_batch_t stats, unsigned int *evacuated_inodes, itable_status *new_itable_status)
+{
+	struct parallel_migrate pm;
+	pthread_t *threads = NULL;
+	dgrp_t group, flexbg_size = 1;
+	ext2_ino_t first, last;
+	int i, started = 0;
+	errcode_t retval;
 
-	for (g = 0; g < fs->group_desc_count; g++) {
-		blk = ext2fs_inode_table_loc(rfs->new_fs, g);
-		if (blk) {
-			ext2fs_mark_block_bitmap_range2(meta_bmap, blk, rfs->new_fs->inode_blocks_per_group);
-			printf("mark in meta_bmap for group %u the inode blocks %llu to %llu\n", g, blk, blk + rfs->new_fs->inode_blocks_per_group);
+	memset(&pm, 0, sizeof(pm));
+	pm.rfs = rfs;
+	pm.stats = stats;
+	pm.evacuated_inodes = evacuated_inodes;
+	pm.new_itable_status = new_itable_status;
+	pm.units = calloc(rfs->new_fs->group_desc_count, sizeof(struct migrate_unit));
+	pm.last_ino = calloc(rfs->new_fs->group_desc_count, sizeof(ext2_ino_t));
+	threads = calloc(migrate_threads, sizeof(pthread_t));
+	if (!pm.units || !pm.last_ino || !threads) {
+		retval = ENOMEM;
+		goto errout;
+	}
+	if (ext2fs_has_feature_flex_bg(rfs->new_fs->super))
+		flexbg_size = 1U << rfs->new_fs->super->s_log_groups_per_flex;
+
+	/*the bitmaps are not thread safe: compute the ranges here */
+	for (group = 0; group < rfs->new_fs->group_desc_count; group++) {
+		if (new_itable_status[group] != itable_status_allocated)
+			continue;
+		if (!group_migrate_range(rfs, group, &first, &last))
+			pm.last_ino[group] = 0;
+		else if (rfs->flags & RESIZE_LAZY_ITABLE_INIT)
+			pm.last_ino[group] = first - 1 + lazy_used_inodes(rfs, group);
+		else
+			pm.last_ino[group] = last;
+		if (pm.num_units && pm.units[pm.num_units - 1].first_group + pm.units[pm.num_units - 1].num_groups == group && group % flexbg_size)
+			pm.units[pm.num_units - 1].num_groups++;
+		else {
+			pm.units[pm.num_units].first_group = group;
+			pm.units[pm.num_units++].num_groups = 1;
 		}
 	}
+	for (group = 0; group < rfs->new_fs->group_desc_count; group++)
+		if (new_itable_status[group] == itable_status_filled)
+			pm.groups_done++;
+
+	/*the inode cache and the old itables must be on disk before the raw reads */
+	retval = ext2fs_flush_icache(rfs->old_fs);
+	if (!retval)
+		retval = io_channel_flush(rfs->old_fs->io);
+	if (retval)
+		goto errout;
+	/*initialize the crc32c engine before the workers use it */
+	csum_engine_name();
 
-	flexbg_size = 1U << fs->super->s_log_groups_per_flex;
+	log_verbose("Migrating %u runs of groups with %d threads\n", pm.num_units, migrate_threads);
+	pthread_mutex_init(&pm.lock, NULL);
+	for (i = 0; i < migrate_threads; i++) {
+		if (pthread_create(&threads[i], NULL, migrate_worker, &pm))
+			break;
+		started++;
+	}
+	if (!started)
+		migrate_worker(&pm);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pm.lock);
+	retval = pm.retval;
 
-	for (g = 0; g < fs->group_desc_count; g++) {
-		if (ext2fs_free_blocks_count(rfs->new_fs->super) < rfs->new_fs->inode_blocks_per_group + pledged_blocks) {
-			printf("breaking loop before running out of space, free: %llu, pledged: %llu, ipg: %u\n", ext2fs_free_blocks_count(rfs->new_fs->super), pledged_blocks, rfs->new_fs->inode_blocks_per_group);
-			break;	/*don't search if we are not going to find */
-		}
+	/*the inode cache may hold the records written by the workers */
+	if (!retval)
+		retval = ext2fs_flush_icache(rfs->new_fs);
 
-		if (ext2fs_has_feature_flex_bg(fs->super)) {
-			if (!(g % (1U << fs->super->s_log_groups_per_flex))) {
-				first_blk = ext2fs_group_first_block2(fs, g & ~(flexbg_size - 1));
-				last_blk = (g | (flexbg_size - 1) >= fs->group_desc_count - 1) ? ext2fs_blocks_count(rfs->old_fs->super) - 1 : ext2fs_group_first_block2(fs, (g | (flexbg_size - 1)) + 1) - 1;
-				retried_from_beginning = 0;
-			}
-		}
-		if (new_itable_status[g] != itable_status_not_allocated) {
-			printf(" --->no need to make room for a new itable for group %u\n", g);
+ errout:
+	free(pm.units);
+	free(pm.last_ino);
+	free(threads);
+	return retval;
+}
+#endif
 
-		} else {
+static errcode_t migrate_inodes_forward_loop(ext2_resize_t rfs, unsigned int *evacuated_inodes, itable_status *new_itable_status)
+{
+	struct ext2_inode *inode = NULL;
+	alloc_stats_batch_t stats = NULL;
+	dgrp_t new_group;
+	errcode_t retval = 0;
+
+	inode = malloc(EXT2_INODE_SIZE(rfs->new_fs->super));
+	if (!inode) {
+		retval = ENOMEM;
+		goto errout;
+	}
+	retval = alloc_stats_open(rfs->new_fs, &stats);
+	if (retval)
+		goto errout;
+
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, 0, rfs->new_fs->group_desc_count);
+		if (retval)
+			goto errout;
+	}
+
+#if defined(HAVE_PTHREAD_H) && !defined(WORDS_BIGENDIAN)
+	if (migrate_threads > 1) {
+		int prof = profile_begin("migrate_parallel");
+
+		retval = migrate_inodes_parallel(rfs, stats, evacuated_inodes, new_itable_status);
+		profile_end(prof);
+		if (retval)
+			goto errout;
+	}
+	/*all the allocated groups are filled now, the loop below does nothing */
+#endif
+	for (new_group = 0; new_group < rfs->new_fs->group_desc_count; new_group++) {
+		if (new_itable_status[new_group] != itable_status_allocated)
+			continue;
+		retval = migrate_group_inodes(rfs, new_group, inode, stats, evacuated_inodes, new_itable_status);
+		if (retval)
+			goto errout;
+		if (rfs->progress) {
+			retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, new_group + 1, rfs->new_fs->group_desc_count);
+			if (retval)
+				goto errout;
+		}
+	}
+
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, rfs->new_fs->group_desc_count, rfs->new_fs->group_desc_count);
+		if (retval)
+			goto errout;
+	}
+
+ errout:
+	alloc_stats_close(&stats);
+	if (inode)
+		free(inode);
+	return retval;
+}
+
+/*free the old itable of a group, once all its inodes have been migrated to the new itables*/
+static void free_old_itable(ext2_resize_t rfs, dgrp_t group)
+{
+	blk64_t itable_start = ext2fs_inode_table_loc(rfs->old_fs, group);
+	unsigned int itables_blocks_to_be_freed = rfs->old_fs->inode_blocks_per_group;
+
+	if (ext2fs_has_feature_bigalloc(rfs->new_fs->super)) {
+		tweak_values_for_bigalloc(rfs, &itable_start, &itables_blocks_to_be_freed);
+	}
+	log_verbose("Freeing old itable of group %u, blocks %llu - %llu\n", group, itable_start, itable_start + itables_blocks_to_be_freed - 1);
+	ext2fs_block_alloc_stats_range(rfs->new_fs, itable_start, itables_blocks_to_be_freed, -1);
+	ext2fs_inode_table_loc_set(rfs->old_fs, group, 0);
+}
+
+/*move the blocks marked in rfs->move_blocks, and update all the references to them*/
+static errcode_t move_and_remap_blocks(ext2_resize_t rfs, itable_status *new_itable_status)
+{
+	errcode_t retval;
+
+	retval = block_mover(rfs, new_itable_status);
+	if (retval) {
+		printf("block_mover returned with status %li\n", retval);
+		return retval;
+	}
+
+	/* At this point rfs->move_blocks is not needed anymore for its original purpose.
+	   So we will use it to mark blocks allocated by the resize2fs_get_alloc_block,
+	   and to avoid remapping those blocks in the update_block_reference.
+	   First of all, reset the whole bitmap */
+	ext2fs_free_block_bitmap(rfs->move_blocks);
+	rfs->move_blocks = 0;
+	retval = ext2fs_allocate_block_bitmap(rfs->old_fs, _("blocks already moved"), &rfs->move_blocks);
+	if (retval)
+		return retval;
+
+	retval = inode_scan_and_fix(rfs, new_itable_status);
+	if (retval)
+		printf("inode_scan_and_fix returned with status %li\n", retval);
+	return retval;
+}
+
+static errcode_t make_room_for_new_itables(ext2_resize_t rfs, itable_status *new_itable_status)
+{
+	unsigned int j;
+	int flexbg_size = 0, retried_from_beginning = 0;
+	dgrp_t g;
+	blk64_t blk, blk2, first_blk, last_blk;
+	blk64_t pledged_blocks = 50;	/* start at 50 as a safe margin for extent trees rebalancing.. TODO: what would be a good start number */
+	errcode_t retval;
+	ext2_filsys fs = rfs->old_fs;
+	ext2fs_block_bitmap meta_bmap;
+	ext2_badblocks_list badblock_list = 0;
+
+	init_block_alloc(rfs);
+
+	retval = ext2fs_allocate_block_bitmap(fs, _("blocks to be moved"), &rfs->move_blocks);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_allocate_block_bitmap(fs, _("reserved blocks"), &rfs->reserve_blocks);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_allocate_block_bitmap(fs, _("meta-data blocks"), &meta_bmap);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_read_bb_inode(new_itable_status[ext2fs_group_of_ino(rfs->new_fs, EXT2_BAD_INO)] == itable_status_filled ? rfs->new_fs : rfs->old_fs, &badblock_list);
+	if (retval) {
+		printf("Error while reading badblock list in make_room_for_new_itables()\n");
+		return retval;
+	}
+
+	retval = mark_table_blocks(rfs->old_fs, meta_bmap); /*mark as used in meta_bmap the SB, BGD, reserved GDT, bitmaps, itables and MMP from the OLD FS*/
+	if (retval)
+		return retval;
+
+	for (g = 0; g < fs->group_desc_count; g++) {
+		blk = ext2fs_inode_table_loc(rfs->new_fs, g);
+		if (blk) {
+			ext2fs_mark_block_bitmap_range2(meta_bmap, blk, rfs->new_fs->inode_blocks_per_group);
+			log_debug(RESIZE_DEBUG_ITABLEMOVE, "mark in meta_bmap for group %u the inode blocks %llu to %llu\n", g, blk, blk + rfs->new_fs->inode_blocks_per_group);
+		}
+	}
+
+	flexbg_size = 1U << fs->super->s_log_groups_per_flex;
+
+	for (g = 0; g < fs->group_desc_count; g++) {
+		if (ext2fs_free_blocks_count(rfs->new_fs->super) < rfs->new_fs->inode_blocks_per_group + pledged_blocks) {
+			printf("breaking loop before running out of space, free: %llu, pledged: %llu, ipg: %u\n", ext2fs_free_blocks_count(rfs->new_fs->super), pledged_blocks, rfs->new_fs->inode_blocks_per_group);
+			break;	/*don't search if we are not going to find */
+		}
+
+		if (ext2fs_has_feature_flex_bg(fs->super)) {
+			if (!(g % (1U << fs->super->s_log_groups_per_flex))) {
+				first_blk = ext2fs_group_first_block2(fs, g & ~(flexbg_size - 1));
+				last_blk = (g | (flexbg_size - 1) >= fs->group_desc_count - 1) ? ext2fs_blocks_count(rfs->old_fs->super) - 1 : ext2fs_group_first_block2(fs, (g | (flexbg_size - 1)) + 1) - 1;
+				retried_from_beginning = 0;
+			}
+		}
+		if (new_itable_status[g] != itable_status_not_allocated) {
+			log_verbose(" --->no need to make room for a new itable for group %u\n", g);
+
+		} else {
 			if (!ext2fs_has_feature_flex_bg(fs->super)) {
 				first_blk = ext2fs_group_first_block2(fs, g);
 				last_blk = (g == fs->group_desc_count - 1) ? ext2fs_blocks_count(rfs->old_fs->super) - 1 : ext2fs_group_first_block2(fs, g + 1) - 1;
 			}
  search_for_space:
-			printf("making room in group %u, searching in blocks %llu - %llu\n", g, first_blk, last_blk);
+			log_verbose("making room in group %u, searching in blocks %llu - %llu\n", g, first_blk, last_blk);
 			for (blk = first_blk; blk <= last_blk; blk++) {
 
 				if (ext2fs_has_group_desc_csum(fs) && ext2fs_bg_flags_test(rfs->old_fs, ext2fs_group_of_blk2(rfs->old_fs, blk), EXT2_BG_BLOCK_UNINIT)) {
@@ -794,7 +1472,7 @@ static errcode_t make_room_for_new_itables(ext2_resize_t rfs, itable_status *new
 					}
 				}
 				if (j == rfs->new_fs->inode_blocks_per_group) {
-					printf(" --->blocks to move in group %u are %llu - %llu\n", g, blk, blk2 - 1);
+					log_verbose(" --->blocks to move in group %u are %llu - %llu\n", g, blk, blk2 - 1);
 					ext2fs_mark_block_bitmap_range2(rfs->move_blocks, blk, rfs->new_fs->inode_blocks_per_group);
 					ext2fs_mark_block_bitmap_range2(rfs->reserve_blocks, blk, rfs->new_fs->inode_blocks_per_group);
 					/* multiplied by 2, to account for possible extent tree rebalancing...TODO: check is it optimal? */
@@ -819,28 +1497,9 @@ static errcode_t make_room_for_new_itables(ext2_resize_t rfs, itable_status *new
 		}
 	}
 
-	printf("Free old %llu, Free new blocks %llu\n", ext2fs_free_blocks_count(rfs->old_fs->super), ext2fs_free_blocks_count(rfs->new_fs->super));
-
-	retval = block_mover(rfs, new_itable_status);
-	if (retval) {
-		printf("block_mover returned with status %li\n", retval);
-		goto errout;
-	}
-
-	/* At this point rfs->move_blocks is not needed anymore for its original purpose.
-	   So we will use it to mark blocks allocated by the resize2fs_get_alloc_block,
-	   and to avoid remapping those blocks in the update_block_reference.
-	   First of all, reset the whole bitmap */
-	ext2fs_free_block_bitmap(rfs->move_blocks);
-	retval = ext2fs_allocate_block_bitmap(fs, _("blocks already moved"), &rfs->move_blocks);
-	if (retval)
-		return retval;
+	printf("Free blocks %llu\n", ext2fs_free_blocks_count(rfs->new_fs->super));
 
-	retval = inode_scan_and_fix(rfs, new_itable_status);
-	if (retval) {
-		printf("inode_scan_and_fix returned with status %li\n", retval);
-		goto errout;
-	}
+	retval = move_and_remap_blocks(rfs, new_itable_status);
 
  errout:
 	if (meta_bmap)
@@ -861,51 +1520,597 @@ static errcode_t make_room_for_new_itables(ext2_resize_t rfs, itable_status *new
 
 }
 
-static errcode_t inode_relocation_to_bigger_tables(ext2_resize_t rfs, unsigned int new_inodes_per_group)
+/*check that blocks [blk, blk + len) can hold a new itable. Returns the number of blocks accepted, len if all of them*/
+static unsigned int check_itable_window(ext2_resize_t rfs, ext2fs_block_bitmap busy, ext2fs_block_bitmap reusable, ext2_badblocks_list badblock_list,
+					blk64_t blk, unsigned int len, int allow_evict)
 {
+	ext2_filsys fs = rfs->old_fs;
+	unsigned int j;
+
+	for (j = 0; j < len; blk++, j++) {
+		if (ext2fs_test_block_bitmap2(busy, blk)
+		    || ext2fs_test_block_bitmap2(rfs->reserve_blocks, blk)
+		    || ext2fs_badblocks_list_test(badblock_list, blk))
+			break;
+		if (!allow_evict && ext2fs_test_block_bitmap2(fs->block_map, blk) && !ext2fs_test_block_bitmap2(reusable, blk))
+			break;
+	}
+	return j;
+}
+
+/*search in [first_blk, last_blk] for a place for a new itable. With allow_evict == 0, only free blocks and
+  the space of old itables already evacuated are accepted. Otherwise, data blocks are accepted too, they will be evicted*/
+static int find_itable_window(ext2_resize_t rfs, ext2fs_block_bitmap busy, ext2fs_block_bitmap reusable, ext2_badblocks_list badblock_list,
+				unsigned int len, blk64_t first_blk, blk64_t last_blk, int allow_evict, blk64_t *ret)
+{
+	ext2_filsys fs = rfs->old_fs;
+	unsigned int j, cluster_size = EXT2FS_CLUSTER_RATIO(fs);
+	blk64_t blk;
+
+	/*itables start on a cluster boundary, so on bigalloc they never share a cluster with anything else
+	  but the itable of the previous group, see find_packed_itable_window() */
+	blk = first_blk;
+	if (blk % cluster_size)
+		blk += cluster_size - (blk % cluster_size);
+
+	while (blk + len - 1 <= last_blk) {
+		j = check_itable_window(rfs, busy, reusable, badblock_list, blk, len, allow_evict);
+		if (j == len) {
+			*ret = blk;
+			return 1;
+		}
+		blk += j + 1;
+		if (blk % cluster_size)
+			blk += cluster_size - (blk % cluster_size);
+	}
+	return 0;
+}
 
+/*
+ * On bigalloc, when inode_blocks_per_group is not a multiple of the cluster size, try to place the
+ * new itable right after the one of the previous group, in the rest of its last cluster, as mke2fs
+ * packs the tables of a flex_bg. That cluster is already reserved for the previous itable.
+ * Without flex_bg, the itable must stay within [first_blk, last_blk], its own group.
+ */
+static int find_packed_itable_window(ext2_resize_t rfs, ext2fs_block_bitmap busy, ext2fs_block_bitmap reusable, ext2_badblocks_list badblock_list,
+				     unsigned int len, blk64_t prev_itable, blk64_t first_blk, blk64_t last_blk, int allow_evict, blk64_t *ret)
+{
+	ext2_filsys fs = rfs->old_fs;
+	unsigned int shared;
+	blk64_t blk = prev_itable + len;
+
+	if (!ext2fs_has_feature_bigalloc(fs->super) || !prev_itable || !(blk & EXT2FS_CLUSTER_MASK(fs)))
+		return 0;
+	if (blk < first_blk || blk + len - 1 > last_blk)
+		return 0;
+	shared = EXT2FS_CLUSTER_RATIO(fs) - (blk & EXT2FS_CLUSTER_MASK(fs));
+	if (shared >= len) {
+		*ret = blk;
+		return 1;
+	}
+	if (check_itable_window(rfs, busy, reusable, badblock_list, blk + shared, len - shared, allow_evict) != len - shared)
+		return 0;
+	*ret = blk;
+	return 1;
+}
+
+/*prefer any place not requiring to move data, then the flex_bg area, like ext2fs_allocate_group_table() does */
+static int find_new_itable_place(ext2_resize_t rfs, ext2fs_block_bitmap busy, ext2fs_block_bitmap reusable, ext2_badblocks_list badblock_list,
+				 unsigned int len, blk64_t prev_itable, blk64_t first_blk, blk64_t last_blk, int flex_bg, blk64_t preset, blk64_t *ret)
+{
+	ext2_filsys fs = rfs->old_fs;
+	blk64_t low = flex_bg ? fs->super->s_first_data_block : first_blk, high = flex_bg ? ext2fs_blocks_count(fs->super) - 1 : last_blk;
+	int found = 0, allow_evict;
+
+	if (preset) {
+		/*the place comes from a saved plan: only check that it is still usable */
+		if (find_packed_itable_window(rfs, busy, reusable, badblock_list, len, prev_itable, low, high, 1, ret) && *ret == preset)
+			return 1;
+		if ((preset & EXT2FS_CLUSTER_MASK(fs)) || preset < low || preset + len - 1 > high
+		    || check_itable_window(rfs, busy, reusable, badblock_list, preset, len, 1) != len)
+			return 0;
+		*ret = preset;
+		return 1;
+	}
+
+	for (allow_evict = 0; allow_evict < 2 && !found; allow_evict++) {
+		found = find_packed_itable_window(rfs, busy, reusable, badblock_list, len, prev_itable, low, high, allow_evict, ret);
+		if (!found)
+			found = find_itable_window(rfs, busy, reusable, badblock_list, len, first_blk, last_blk, allow_evict, ret);
+		if (!found && flex_bg)
+			found = find_itable_window(rfs, busy, reusable, badblock_list, len, fs->super->s_first_data_block, ext2fs_blocks_count(fs->super) - 1, allow_evict, ret);
+	}
+	return found;
+}
+
+static void mark_itable_reusable(ext2_filsys fs, ext2fs_block_bitmap busy, ext2fs_block_bitmap reusable, dgrp_t group)
+{
+	blk64_t blk = ext2fs_inode_table_loc(fs, group);
+
+	ext2fs_unmark_block_bitmap_range2(busy, blk, fs->inode_blocks_per_group);
+	ext2fs_mark_block_bitmap_range2(reusable, blk, fs->inode_blocks_per_group);
+}
+
+/*
+ * Work out, from the bitmaps alone, the final location of every new itable.
+ *
+ * The new itables are migrated in group order. Filling the new itable of group g only reads
+ * inodes from old groups >= g (the new groups are bigger), and when its turn arrives the old
+ * itables whose inodes all went to new groups < g have already been evacuated. So the new itable
+ * of group g may be placed over free blocks, over data blocks (which will be evicted before any
+ * migration starts) and over those old itables.
+ *
+ * When there is no such place, typically for the short last group without flex_bg, the old
+ * itables read while filling group g are accepted too. They are marked in staged[] and copied
+ * to a staging area before the migration, see stage_old_itables().
+ *
+ * With preset_loc, the places of a saved plan are checked instead of searched, see plan_file.c
+ *
+ * On success, rfs->reserve_blocks holds all the planned itables of len blocks, rfs->move_blocks
+ * holds the data blocks to be evicted, *evicted is their count and *free_in_itables the count of
+ * free blocks covered by the new itables.
+ */
+static errcode_t place_new_itables(ext2_resize_t rfs, unsigned int len, const blk64_t *preset_loc, blk64_t *planned_itable_loc, char *staged,
+				   blk64_t *free_in_itables, blk64_t *evicted)
+{
+	ext2_filsys fs = rfs->old_fs;
+	ext2fs_block_bitmap busy = 0, reusable = 0;
+	ext2_badblocks_list badblock_list = 0;
+	blk64_t blk, first_blk, last_blk, itable;
+	__u64 old_ipg = fs->super->s_inodes_per_group, new_ipg = (__u64)len * fs->blocksize / EXT2_INODE_SIZE(fs->super);
+	dgrp_t g, h, next_reusable = 0, flexbg_size = 1, packed = 0;
+	int found, flex_bg = ext2fs_has_feature_flex_bg(fs->super) && fs->super->s_log_groups_per_flex;
+	/*on bigalloc, the old itables may share their clusters with the bitmaps: they are never reused */
+	int reuse = !ext2fs_has_feature_bigalloc(fs->super);
 	errcode_t retval;
-	ext2_ino_t ino_num = 0;
-	dgrp_t group = 0, allocated_new_itables = 0, prev_allocated_new_itables = 0xFFFFFFFF;	/*0xFFFFFFFF to identify the first iteration */
-	unsigned int *evacuated_inodes = NULL, itables_blocks_to_be_freed;
-	itable_status *new_itable_status = NULL;
-	blk64_t itable_start;
 
-	evacuated_inodes = (unsigned int *)calloc(rfs->new_fs->group_desc_count, sizeof(unsigned int));
-	if (evacuated_inodes == NULL) {
-		printf("alloc_error evacuated_inodes\n");
-		retval = ENOMEM;
+	*evicted = 0;
+	*free_in_itables = 0;
+	if (flex_bg)
+		flexbg_size = 1U << fs->super->s_log_groups_per_flex;
+
+	retval = ext2fs_allocate_block_bitmap(fs, _("blocks to be moved"), &rfs->move_blocks);
+	if (retval)
 		goto errout;
-	}
-	/* using calloc as itable_status_not_allocated = 0 */
-	new_itable_status = (itable_status *) calloc(rfs->new_fs->group_desc_count, sizeof(itable_status));
-	if (new_itable_status == NULL) {
-		printf("alloc_error new_itable_status\n");
-		retval = ENOMEM;
+	retval = ext2fs_allocate_block_bitmap(fs, _("reserved blocks"), &rfs->reserve_blocks);
+	if (retval)
+		goto errout;
+	retval = ext2fs_allocate_block_bitmap(fs, _("meta-data blocks"), &busy);
+	if (retval)
 		goto errout;
+	retval = ext2fs_allocate_block_bitmap(fs, _("evacuated itables"), &reusable);
+	if (retval)
+		goto errout;
+	retval = ext2fs_read_bb_inode(fs, &badblock_list);
+	if (retval)
+		goto errout;
+
+	retval = mark_table_blocks(fs, busy); /*mark as used the SB, BGD, reserved GDT, bitmaps, itables and MMP from the OLD FS*/
+	if (retval)
+		goto errout;
+
+	for (g = 0; g < fs->group_desc_count; g++) {
+		if (flex_bg) {
+			first_blk = ext2fs_group_first_block2(fs, g & ~(flexbg_size - 1));
+			last_blk = ((g | (flexbg_size - 1)) >= fs->group_desc_count - 1) ? ext2fs_blocks_count(fs->super) - 1 : ext2fs_group_first_block2(fs, (g | (flexbg_size - 1)) + 1) - 1;
+		} else {
+			first_blk = ext2fs_group_first_block2(fs, g);
+			last_blk = ext2fs_group_last_block2(fs, g);
+		}
+
+		/*the old itables whose inodes all went to new groups < g */
+		for (; reuse && next_reusable < fs->group_desc_count && (next_reusable + 1) * old_ipg <= g * new_ipg; next_reusable++)
+			mark_itable_reusable(fs, busy, reusable, next_reusable);
+
+		found = find_new_itable_place(rfs, busy, reusable, badblock_list, len, g ? planned_itable_loc[g - 1] : 0, first_blk, last_blk, flex_bg,
+					      preset_loc ? preset_loc[g] : 0, &blk);
+
+		if (!found && reuse) {
+			/*then the old itables whose inodes all go to new groups <= g, staging those overlapped */
+			for (h = next_reusable; h < fs->group_desc_count && (h + 1) * old_ipg <= (g + 1) * new_ipg; h++)
+				mark_itable_reusable(fs, busy, reusable, h);
+			found = find_new_itable_place(rfs, busy, reusable, badblock_list, len, g ? planned_itable_loc[g - 1] : 0, first_blk, last_blk, flex_bg,
+					      preset_loc ? preset_loc[g] : 0, &blk);
+			for (; found && next_reusable < h; next_reusable++) {
+				itable = ext2fs_inode_table_loc(fs, next_reusable);
+				if (itable < blk + len && blk < itable + fs->inode_blocks_per_group) {
+					staged[next_reusable] = 1;
+					log_verbose("plan_new_itables: old itable of group %u to be staged for the new itable of group %u\n", next_reusable, g);
+				}
+			}
+		}
+		if (!found) {
+			if (preset_loc)
+				printf("plan_new_itables: the saved place of the new itable of group %u, block %llu, can't be used anymore\n", g, preset_loc[g]);
+			else
+				printf("plan_new_itables: unable to find a place for the new itable of group %u\n", g);
+			retval = EXT2_ET_BLOCK_ALLOC_FAIL;
+			goto errout;
+		}
+
+		planned_itable_loc[g] = blk;
+		first_blk = blk;
+		/*a cluster shared with the previous itable has already been counted */
+		if (g && blk == planned_itable_loc[g - 1] + len && (blk & EXT2FS_CLUSTER_MASK(fs))) {
+			packed++;
+			blk += EXT2FS_CLUSTER_RATIO(fs) - (blk & EXT2FS_CLUSTER_MASK(fs));
+		}
+		for (; blk < first_blk + len; blk++) {
+			if (!ext2fs_test_block_bitmap2(fs->block_map, blk)) {
+				(*free_in_itables)++;
+			} else if (!ext2fs_test_block_bitmap2(reusable, blk)) {
+				ext2fs_mark_block_bitmap2(rfs->move_blocks, blk);
+				(*evicted)++;
+			}
+		}
+		ext2fs_mark_block_bitmap_range2(rfs->reserve_blocks, first_blk, len);
+		log_verbose("plan_new_itables: new itable of group %u in blocks %llu - %llu\n", g, first_blk, first_blk + len - 1);
 	}
 
-	rfs->new_fs->super->s_inodes_per_group = new_inodes_per_group;
-	rfs->new_fs->inode_blocks_per_group = ext2fs_div_ceil(rfs->new_fs->super->s_inodes_per_group * rfs->new_fs->super->s_inode_size, rfs->new_fs->blocksize);
-	rfs->new_fs->super->s_inodes_count = rfs->new_fs->group_desc_count * rfs->new_fs->super->s_inodes_per_group;
+	if (packed)
+		log_verbose("plan_new_itables: %u itables packed in the last cluster of the previous one\n", packed);
+	retval = 0;
 
-	display_info(rfs);
+ errout:
+	if (busy)
+		ext2fs_free_block_bitmap(busy);
+	if (reusable)
+		ext2fs_free_block_bitmap(reusable);
+	if (badblock_list)
+		ext2fs_badblocks_list_free(badblock_list);
+	if (retval) {
+		if (rfs->move_blocks) {
+			ext2fs_free_block_bitmap(rfs->move_blocks);
+			rfs->move_blocks = 0;
+		}
+		if (rfs->reserve_blocks) {
+			ext2fs_free_block_bitmap(rfs->reserve_blocks);
+			rfs->reserve_blocks = 0;
+		}
+	}
+	return retval;
+}
 
-	retval = ext2fs_resize_inode_bitmap2(rfs->new_fs->super->s_inodes_count, rfs->new_fs->super->s_inodes_count, rfs->new_fs->inode_map);
+/*blocks taken by the staging copies of the old itables marked in staged[] */
+static blk64_t staged_itable_blocks(ext2_filsys fs, char *staged)
+{
+	blk64_t count = 0;
+	dgrp_t g;
+
+	for (g = 0; g < fs->group_desc_count; g++)
+		if (staged[g])
+			count += fs->inode_blocks_per_group;
+	return count;
+}
+
+static errcode_t plan_new_itables(ext2_resize_t rfs, const blk64_t *preset_loc, blk64_t *planned_itable_loc, char *staged, blk64_t *evicted)
+{
+	ext2_filsys fs = rfs->old_fs;
+	blk64_t free_in_itables, staged_blocks, journal_need, fragments, extent_blocks;
+	errcode_t retval;
+
+	retval = place_new_itables(rfs, rfs->new_fs->inode_blocks_per_group, preset_loc, planned_itable_loc, staged, &free_in_itables, evicted);
+	if (retval == EXT2_ET_BLOCK_ALLOC_FAIL && preset_loc) {
+		printf("The saved plan doesn't fit the filesystem anymore, planning again\n");
+		memset(staged, 0, fs->group_desc_count);
+		retval = place_new_itables(rfs, rfs->new_fs->inode_blocks_per_group, NULL, planned_itable_loc, staged, &free_in_itables, evicted);
+	}
+	if (retval)
+		return retval;
+
+	retval = plan_journal_recreation(rfs, evicted, &journal_need);
 	if (retval) {
-		printf("error %li when calling ext2fs_resize_inode_bitmap2()\n", retval);
+		ext2fs_free_block_bitmap(rfs->move_blocks);
+		rfs->move_blocks = 0;
+		ext2fs_free_block_bitmap(rfs->reserve_blocks);
+		rfs->reserve_blocks = 0;
+		return retval;
+	}
+
+	/*the extent trees growth, counted as the feasibility check of main() counts it */
+	retval = increase_extent_blocks(fs, rfs->reserve_blocks, rfs->move_blocks, 1, &fragments, &extent_blocks);
+	if (retval && retval != ENOSPC) {
+		rfs->journal_blocks = 0;
+		ext2fs_free_block_bitmap(rfs->move_blocks);
+		rfs->move_blocks = 0;
+		ext2fs_free_block_bitmap(rfs->reserve_blocks);
+		rfs->reserve_blocks = 0;
+		return retval;
+	}
+
+	staged_blocks = staged_itable_blocks(fs, staged);
+	printf("plan_new_itables: %llu free blocks used by the new itables, %llu blocks to be evicted, %llu free blocks in the filesystem\n",
+		free_in_itables, *evicted, ext2fs_free_blocks_count(fs->super));
+	if (staged_blocks)
+		printf("plan_new_itables: %llu blocks of old itables to be staged\n", staged_blocks);
+	if (journal_need)
+		printf("plan_new_itables: %llu more free blocks for the journal created again\n", journal_need);
+	if (!retval)
+		printf("plan_new_itables: %llu blocks for the extent trees of %llu runs of relocated blocks\n", extent_blocks, fragments);
+	/*the evicted blocks, the staged itables, the new journal and the extent trees shall fit in the free space left outside the new itables */
+	if (retval == ENOSPC || ext2fs_free_blocks_count(fs->super) < free_in_itables + *evicted + staged_blocks + journal_need + extent_blocks) {
+		printf("plan_new_itables: not enough free space to evict the blocks\n");
+		rfs->journal_blocks = 0;
+		ext2fs_free_block_bitmap(rfs->move_blocks);
+		rfs->move_blocks = 0;
+		ext2fs_free_block_bitmap(rfs->reserve_blocks);
+		rfs->reserve_blocks = 0;
+		return ENOSPC;
+	}
+	return 0;
+}
+
+/*
+ * The placement plan_new_itables() would choose for new itables of itable_blocks blocks, without
+ * touching the filesystem. The caller frees *reserve_blocks and *move_blocks, see feasibility.c
+ */
+errcode_t plan_itable_placement(ext2_filsys fs, unsigned int itable_blocks, ext2fs_block_bitmap *reserve_blocks, ext2fs_block_bitmap *move_blocks,
+				blk64_t *free_in_itables, blk64_t *evicted, blk64_t *staged_blocks)
+{
+	struct ext2_resize_struct rfs;
+	blk64_t *planned_itable_loc;
+	char *staged;
+	errcode_t retval;
+
+	memset(&rfs, 0, sizeof(rfs));
+	rfs.old_fs = fs;
+	planned_itable_loc = calloc(fs->group_desc_count, sizeof(blk64_t));
+	staged = calloc(fs->group_desc_count, sizeof(char));
+	if (!planned_itable_loc || !staged) {
+		free(planned_itable_loc);
+		free(staged);
+		return ENOMEM;
+	}
+	retval = place_new_itables(&rfs, itable_blocks, NULL, planned_itable_loc, staged, free_in_itables, evicted);
+	*staged_blocks = staged_itable_blocks(fs, staged);
+	free(planned_itable_loc);
+	free(staged);
+	if (retval)
+		return retval;
+	*reserve_blocks = rfs.reserve_blocks;
+	*move_blocks = rfs.move_blocks;
+	return 0;
+}
+
+/*the locations plan_new_itables() would choose, to be saved by plan_save() */
+errcode_t plan_itable_locations(ext2_filsys fs, unsigned int itable_blocks, blk64_t *planned_itable_loc)
+{
+	struct ext2_resize_struct rfs;
+	blk64_t free_in_itables, evicted;
+	char *staged;
+	errcode_t retval;
+
+	memset(&rfs, 0, sizeof(rfs));
+	rfs.old_fs = fs;
+	staged = calloc(fs->group_desc_count, sizeof(char));
+	if (!staged)
+		return ENOMEM;
+	retval = place_new_itables(&rfs, itable_blocks, NULL, planned_itable_loc, staged, &free_in_itables, &evicted);
+	free(staged);
+	if (retval)
+		return retval;
+	ext2fs_free_block_bitmap(rfs.reserve_blocks);
+	ext2fs_free_block_bitmap(rfs.move_blocks);
+	return 0;
+}
+
+/*
+ * Account the blocks of a new itable. On bigalloc, it may start in the last cluster of the previous
+ * itable and end in the middle of a cluster: count each cluster once, when it starts being used.
+ */
+static void itable_alloc_stats(ext2_filsys fs, blk64_t start, unsigned int len)
+{
+	blk64_t blk, end = start + len;
+
+	if (!ext2fs_has_feature_bigalloc(fs->super)) {
+		ext2fs_block_alloc_stats_range(fs, start, len, +1);
+		return;
+	}
+	for (blk = start & ~(blk64_t)EXT2FS_CLUSTER_MASK(fs); blk < end; blk += EXT2FS_CLUSTER_RATIO(fs))
+		if (!ext2fs_test_block_bitmap2(fs->block_map, blk))
+			ext2fs_block_alloc_stats2(fs, blk, +1);
+}
+
+/*place the new itable of a group in the location chosen by plan_new_itables()*/
+static errcode_t place_planned_itable(ext2_resize_t rfs, dgrp_t group, blk64_t itable_start, int zeroed)
+{
+	errcode_t retval;
+	int len = rfs->new_fs->inode_blocks_per_group;
+
+	ext2fs_inode_table_loc_set(rfs->new_fs, group, itable_start);
+	itable_alloc_stats(rfs->new_fs, itable_start, len);
+	if (!zeroed) {
+		retval = zero_itable_blocks(rfs, itable_start, itable_blocks_to_init(rfs, group));
+		if (retval)
+			return retval;
+	}
+	set_itable_zeroed_flag(rfs, group, itable_blocks_to_init(rfs, group));
+	return 0;
+}
+
+/*zero up front, merging adjacent ones, the planned itables lying in free space.
+  The ones reusing an old itable are zeroed when placed, once it has been evacuated */
+static errcode_t prezero_planned_itables(ext2_resize_t rfs, blk64_t *planned_itable_loc, char *zeroed)
+{
+	blk64_t run_start = 0, run_len = 0, len;
+	dgrp_t group;
+	errcode_t retval;
+
+	for (group = 0; group < rfs->new_fs->group_desc_count; group++) {
+		if (!ext2fs_test_block_bitmap_range2(rfs->old_fs->block_map, planned_itable_loc[group], rfs->new_fs->inode_blocks_per_group))
+			continue;
+		zeroed[group] = 1;
+		len = itable_blocks_to_init(rfs, group);
+		if (run_len && run_start + run_len == planned_itable_loc[group]) {
+			run_len += len;
+			continue;
+		}
+		if (run_len) {
+			retval = zero_itable_blocks(rfs, run_start, run_len);
+			if (retval)
+				return retval;
+		}
+		run_start = planned_itable_loc[group];
+		run_len = len;
+	}
+	if (run_len)
+		return zero_itable_blocks(rfs, run_start, run_len);
+	return 0;
+}
+
+/*
+ * Copy aside the old itables marked in staged[] by plan_new_itables(): a new itable overwrites them
+ * while some of their inodes are still to be migrated. The old fs reads them from the copy, which
+ * is freed with the old itable, and their original blocks are released for the new itable.
+ */
+static errcode_t stage_old_itables(ext2_resize_t rfs, char *staged)
+{
+	ext2_filsys fs = rfs->old_fs;
+	unsigned int len = fs->inode_blocks_per_group, j;
+	blk64_t blk, itable;
+	dgrp_t g;
+	errcode_t retval;
+
+	for (g = 0; g < fs->group_desc_count; g++) {
+		if (!staged[g])
+			continue;
+		if (!rfs->itable_buf) {
+			retval = bulk_io_get_buf(rfs, rfs->new_fs->blocksize * rfs->new_fs->inode_blocks_per_group, &rfs->itable_buf);
+			if (retval)
+				return retval;
+			mem_account("inode table buffer", (unsigned long long)rfs->new_fs->blocksize * rfs->new_fs->inode_blocks_per_group);
+		}
+
+		/*any free run out of the planned itables will do, it is only used until the old itable is evacuated */
+		for (blk = fs->super->s_first_data_block, j = 0; blk < ext2fs_blocks_count(fs->super) && j < len; blk++) {
+			if (ext2fs_test_block_bitmap2(fs->block_map, blk) || ext2fs_test_block_bitmap2(rfs->reserve_blocks, blk))
+				j = 0;
+			else
+				j++;
+		}
+		if (j < len) {
+			printf("stage_old_itables: no room to stage the old itable of group %u\n", g);
+			return ENOSPC;
+		}
+		blk -= len;
+
+		itable = ext2fs_inode_table_loc(fs, g);
+		log_verbose("Staging old itable of group %u, blocks %llu - %llu, in blocks %llu - %llu\n", g, itable, itable + len - 1, blk, blk + len - 1);
+		retval = bulk_io_read(rfs, itable, len, rfs->itable_buf);
+		if (retval)
+			return retval;
+		retval = bulk_io_write(rfs, blk, len, rfs->itable_buf);
+		if (retval)
+			return retval;
+
+		ext2fs_block_alloc_stats_range(rfs->new_fs, blk, len, +1);
+		ext2fs_inode_table_loc_set(rfs->old_fs, g, blk);
+		ext2fs_block_alloc_stats_range(rfs->new_fs, itable, len, -1);
+	}
+	return 0;
+}
+
+/*execute the plan: one block-move pass, one reference-fix pass and one migration pass*/
+static errcode_t apply_itable_plan(ext2_resize_t rfs, blk64_t *planned_itable_loc, char *staged, blk64_t evicted, unsigned int *evacuated_inodes, itable_status *new_itable_status)
+{
+	struct ext2_inode *inode = NULL;
+	alloc_stats_batch_t stats = NULL;
+	dgrp_t group, old_group, last_old_group;
+	errcode_t retval = 0;
+	char *zeroed = NULL;
+	int prof;
+
+	init_block_alloc(rfs);
+	if (rfs->journal_blocks) {
+		retval = free_journal(rfs);
+		if (retval)
+			goto errout;
+	}
+	if (evicted) {
+		retval = move_and_remap_blocks(rfs, new_itable_status);
+		if (retval)
+			goto errout;
+	}
+	prof = profile_begin("stage_old_itables");
+	retval = stage_old_itables(rfs, staged);
+	profile_end(prof);
+	if (retval)
+		goto errout;
+	/*the planned itables are now free of data, the allocator doesn't need to avoid them anymore */
+	ext2fs_free_block_bitmap(rfs->reserve_blocks);
+	rfs->reserve_blocks = 0;
+	ext2fs_free_block_bitmap(rfs->move_blocks);
+	rfs->move_blocks = 0;
+
+	inode = malloc(EXT2_INODE_SIZE(rfs->new_fs->super));
+	zeroed = calloc(rfs->new_fs->group_desc_count, sizeof(char));
+	if (!inode || !zeroed) {
+		retval = ENOMEM;
 		goto errout;
 	}
+	retval = alloc_stats_open(rfs->new_fs, &stats);
+	if (retval)
+		goto errout;
+
+	prof = profile_begin("prezero_planned_itables");
+	retval = prezero_planned_itables(rfs, planned_itable_loc, zeroed);
+	profile_end(prof);
+	if (retval)
+		goto errout;
+
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, 0, rfs->new_fs->group_desc_count);
+		if (retval)
+			goto errout;
+	}
 
 	for (group = 0; group < rfs->new_fs->group_desc_count; group++) {
-		ext2fs_bg_used_dirs_count_set(rfs->new_fs, group, 0);
-		ext2fs_bg_free_inodes_count_set(rfs->new_fs, group, rfs->new_fs->super->s_inodes_per_group);
-		ext2fs_bg_itable_unused_set(rfs->new_fs, group, rfs->new_fs->super->s_inodes_per_group);
+		retval = place_planned_itable(rfs, group, planned_itable_loc[group], zeroed[group]);
+		if (retval)
+			goto errout;
+		new_itable_status[group] = itable_status_allocated;
+
+		retval = migrate_group_inodes(rfs, group, inode, stats, evacuated_inodes, new_itable_status);
+		if (retval)
+			goto errout;
+
+		/*only the old groups read by this new group may have been completely evacuated now */
+		old_group = ext2fs_group_of_ino(rfs->old_fs, group * rfs->new_fs->super->s_inodes_per_group + 1);
+		last_old_group = ext2fs_group_of_ino(rfs->old_fs, (group + 1) * rfs->new_fs->super->s_inodes_per_group);
+		for (; old_group <= last_old_group && old_group < rfs->old_fs->group_desc_count; old_group++) {
+			if (ext2fs_inode_table_loc(rfs->old_fs, old_group) != 0 && evacuated_inodes[old_group] == rfs->old_fs->super->s_inodes_per_group)
+				free_old_itable(rfs, old_group);
+		}
+
+		if (rfs->progress) {
+			retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, group + 1, rfs->new_fs->group_desc_count);
+			if (retval)
+				goto errout;
+		}
 	}
-	rfs->new_fs->super->s_free_inodes_count = rfs->new_fs->super->s_inodes_count;
+
+ errout:
+	alloc_stats_close(&stats);
+	if (inode)
+		free(inode);
+	if (zeroed)
+		free(zeroed);
+	return retval;
+}
+
+/*iterative approach: allocate as many new itables as possible, fill them, free the old itables, make room and retry*/
+static errcode_t allocate_and_migrate_loop(ext2_resize_t rfs, unsigned int *evacuated_inodes, itable_status *new_itable_status)
+{
+	errcode_t retval;
+	dgrp_t group = 0, allocated_new_itables = 0, prev_allocated_new_itables = 0xFFFFFFFF;	/*0xFFFFFFFF to identify the first iteration */
+	int prof_iter, prof;
 
 	do {
+		prof_iter = profile_begin("iteration");
+		prof = profile_begin("allocate_new_itables");
 		retval = allocate_new_itables(rfs, new_itable_status, &allocated_new_itables);
+		profile_add_items(allocated_new_itables);
+		profile_end(prof);
 		if (retval) {
 			printf("allocate_new_itables returned with status %li\n", retval);
 			goto errout;
@@ -919,36 +2124,127 @@ static errcode_t inode_relocation_to_bigger_tables(ext2_resize_t rfs, unsigned i
 			}
 		}
 
+		prof = profile_begin("migrate_inodes_forward_loop");
 		retval = migrate_inodes_forward_loop(rfs, evacuated_inodes, new_itable_status);
+		profile_end(prof);
 		if (retval) {
 			printf("migrate_inodes_forward_loop returned with status %li\n", retval);
 			goto errout;
 		}
 
 		for (group = 0; group < rfs->new_fs->group_desc_count; group++) {
-			itable_start = ext2fs_inode_table_loc(rfs->old_fs, group);
-			if (itable_start != 0 && evacuated_inodes[group] == rfs->old_fs->super->s_inodes_per_group) {
-				itables_blocks_to_be_freed = rfs->old_fs->inode_blocks_per_group;
-				if (ext2fs_has_feature_bigalloc(rfs->new_fs->super)) {
-					tweak_values_for_bigalloc(rfs, &itable_start, &itables_blocks_to_be_freed);
-				}
-				printf("Freeing old itable of group %u, blocks %llu - %llu\n", group, itable_start, itable_start + itables_blocks_to_be_freed - 1);
-				ext2fs_block_alloc_stats_range(rfs->old_fs, itable_start, itables_blocks_to_be_freed, -1);
-				ext2fs_block_alloc_stats_range(rfs->new_fs, itable_start, itables_blocks_to_be_freed, -1);
-				ext2fs_inode_table_loc_set(rfs->old_fs, group, 0);
-
-			}
+			if (ext2fs_inode_table_loc(rfs->old_fs, group) != 0 && evacuated_inodes[group] == rfs->old_fs->super->s_inodes_per_group)
+				free_old_itable(rfs, group);
 		}
 
 		if (allocated_new_itables < rfs->new_fs->group_desc_count) {
+			prof = profile_begin("make_room_for_new_itables");
 			retval = make_room_for_new_itables(rfs, new_itable_status);
+			profile_end(prof);
 			if (retval) {
 				goto errout;
 			}
 		}
 		prev_allocated_new_itables = allocated_new_itables;
+		profile_end(prof_iter);
 	} while (allocated_new_itables < rfs->new_fs->group_desc_count);
 
+ errout:
+	return retval;
+}
+
+static errcode_t inode_relocation_to_bigger_tables(ext2_resize_t rfs, unsigned int new_inodes_per_group)
+{
+
+	errcode_t retval;
+	dgrp_t group = 0;
+	unsigned int *evacuated_inodes = NULL;
+	itable_status *new_itable_status = NULL;
+	blk64_t *planned_itable_loc = NULL, *preset_loc = NULL, evicted = 0;
+	char *staged = NULL;
+	int prof;
+
+	evacuated_inodes = (unsigned int *)calloc(rfs->new_fs->group_desc_count, sizeof(unsigned int));
+	if (evacuated_inodes == NULL) {
+		printf("alloc_error evacuated_inodes\n");
+		retval = ENOMEM;
+		goto errout;
+	}
+	/* using calloc as itable_status_not_allocated = 0 */
+	new_itable_status = (itable_status *) calloc(rfs->new_fs->group_desc_count, sizeof(itable_status));
+	if (new_itable_status == NULL) {
+		printf("alloc_error new_itable_status\n");
+		retval = ENOMEM;
+		goto errout;
+	}
+	planned_itable_loc = (blk64_t *) calloc(rfs->new_fs->group_desc_count, sizeof(blk64_t));
+	if (planned_itable_loc == NULL) {
+		printf("alloc_error planned_itable_loc\n");
+		retval = ENOMEM;
+		goto errout;
+	}
+	staged = (char *) calloc(rfs->new_fs->group_desc_count, sizeof(char));
+	if (staged == NULL) {
+		printf("alloc_error staged\n");
+		retval = ENOMEM;
+		goto errout;
+	}
+
+	mem_account("per-group arrays", rfs->new_fs->group_desc_count * (unsigned long long)(sizeof(unsigned int) + sizeof(itable_status) + sizeof(blk64_t) + sizeof(char)));
+
+	rfs->new_fs->super->s_inodes_per_group = new_inodes_per_group;
+	rfs->new_fs->inode_blocks_per_group = ext2fs_div_ceil(rfs->new_fs->super->s_inodes_per_group * rfs->new_fs->super->s_inode_size, rfs->new_fs->blocksize);
+	rfs->new_fs->super->s_inodes_count = rfs->new_fs->group_desc_count * rfs->new_fs->super->s_inodes_per_group;
+
+	display_info(rfs);
+
+	retval = ext2fs_resize_inode_bitmap2(rfs->new_fs->super->s_inodes_count, rfs->new_fs->super->s_inodes_count, rfs->new_fs->inode_map);
+	if (retval) {
+		printf("error %li when calling ext2fs_resize_inode_bitmap2()\n", retval);
+		goto errout;
+	}
+
+	for (group = 0; group < rfs->new_fs->group_desc_count; group++) {
+		ext2fs_bg_used_dirs_count_set(rfs->new_fs, group, 0);
+		ext2fs_bg_free_inodes_count_set(rfs->new_fs, group, rfs->new_fs->super->s_inodes_per_group);
+		ext2fs_bg_itable_unused_set(rfs->new_fs, group, rfs->new_fs->super->s_inodes_per_group);
+	}
+	rfs->new_fs->super->s_free_inodes_count = rfs->new_fs->super->s_inodes_count;
+
+	if (plan_file) {
+		preset_loc = (blk64_t *) calloc(rfs->new_fs->group_desc_count, sizeof(blk64_t));
+		if (preset_loc == NULL) {
+			printf("alloc_error preset_loc\n");
+			retval = ENOMEM;
+			goto errout;
+		}
+		retval = plan_load(rfs->old_fs, new_inodes_per_group, plan_file, preset_loc);
+		if (retval) {
+			printf("Ignoring the saved plan %s, planning from scratch\n", plan_file);
+			free(preset_loc);
+			preset_loc = NULL;
+		} else
+			printf("Using the plan saved in %s\n", plan_file);
+	}
+
+	prof = profile_begin("plan_new_itables");
+	retval = plan_new_itables(rfs, preset_loc, planned_itable_loc, staged, &evicted);
+	profile_add_items(evicted);
+	profile_end(prof);
+	if (!retval) {
+		printf("All the new itables have been planned, %llu blocks to be evicted\n", evicted);
+		prof = profile_begin("apply_itable_plan");
+		retval = apply_itable_plan(rfs, planned_itable_loc, staged, evicted, evacuated_inodes, new_itable_status);
+		profile_end(prof);
+	} else if (retval == EXT2_ET_BLOCK_ALLOC_FAIL || retval == ENOSPC) {
+		printf("Unable to plan all the new itables up front, falling back to the iterative allocation\n");
+		prof = profile_begin("allocate_and_migrate_loop");
+		retval = allocate_and_migrate_loop(rfs, evacuated_inodes, new_itable_status);
+		profile_end(prof);
+	}
+	if (retval)
+		goto errout;
+
 	ext2fs_mark_super_dirty(rfs->new_fs);
 	io_channel_flush(rfs->new_fs->io);
 
@@ -957,6 +2253,11 @@ static errcode_t inode_relocation_to_bigger_tables(ext2_resize_t rfs, unsigned i
 		free(evacuated_inodes);
 	if (new_itable_status)
 		free(new_itable_status);
+	if (planned_itable_loc)
+		free(planned_itable_loc);
+	if (preset_loc)
+		free(preset_loc);
+	if (staged)
+		free(staged);
 	return retval;
 }
-
@@ -0,0 +1,51 @@
+/*
+ * log.c --- leveled, buffered logging
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+#include <stdarg.h>
+
+int log_level = RESIZE_LOG_INFO;
+int log_debug_flags;
+
+static char log_buf[1 << 16];
+
+/*
+ * Must be called before anything is written to stdout: per-item traces
+ * can be very numerous, so stdout is fully buffered even on a terminal.
+ */
+void log_init(void)
+{
+	setvbuf(stdout, log_buf, _IOFBF, sizeof(log_buf));
+}
+
+void log_setup(int level, int debug_flags)
+{
+	log_level = level;
+	log_debug_flags = debug_flags;
+}
+
+void log_printf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stdout, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Flush what has been logged so far, e.g. before writing to stderr
+ */
+void log_flush(void)
+{
+	fflush(stdout);
+}
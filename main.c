@@ -24,12 +24,7 @@
 #endif
 
 #include "config.h"
-#ifdef HAVE_GETOPT_H
 #include <getopt.h>
-#else
-extern char *optarg;
-extern int optind;
-#endif
 #include <unistd.h>
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
@@ -38,6 +33,7 @@ extern int optind;
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <signal.h>
 
 #include "resize2fs.h"
 
@@ -50,57 +46,181 @@ static void usage(char *prog)
 	   "[-p] device [-b|-s|new_size] [-S RAID-stride] "
 	   "[-z undo_file]\n\n"),
 	   prog ? prog : "resize2fs"); */
-	fprintf(stderr, _("Usage: %s [-f] -c|-r new_value device \n\n"), prog ? prog : "inode_count_modifier");
+	fprintf(stderr, _("Usage: %s [-f] [-l] [-p] [-P progress_fd] [-v] [-d debug_flags] [-j profile.json] [-m|--memory-limit size] [-t threads] [--readahead blocks] [--cache size] [--no-direct-io] [--spill-dir dir] [--verify] [--save-plan file|--plan file] -c|-r new_value device \n"
+		"       %s [-f] [-l] [-v] [-j profile.json] [-m size] [-t threads] [--verify] -B|--batch manifest [--jobs n] [--jobs-per-controller n] [--batch-logs dir]\n\n"
+		"--save-plan only saves the places of the new inode tables: with --plan, the search of these\n"
+		"places is skipped, but the blocks to move, the moves and the inode migration are all done offline.\n\n"),
+		prog ? prog : "inode_count_modifier", prog ? prog : "inode_count_modifier");
 
 	exit(1);
 }
 
+/*
+ * State of the progress reporting for the current pass, shared by the
+ * progress bar (-p), the JSON-lines stream (-P fd) and the SIGUSR1 snapshot
+ */
+static struct {
+	int		pass;
+	const char	*label;
+	unsigned long	cur, max;
+	struct timeval	start, last_bar, last_stream;
+	unsigned long long bytes_start;
+} pstate;
+
+static FILE *progress_stream;
+static volatile sig_atomic_t progress_snapshot_requested;
+
+static void progress_snapshot_handler(int sig EXT2FS_ATTR((unused)))
+{
+	progress_snapshot_requested = 1;
+}
+
+static double tv_elapsed(struct timeval *now, struct timeval *start)
+{
+	return (now->tv_sec - start->tv_sec) + ((double) (now->tv_usec - start->tv_usec)) / 1000000;
+}
+
+static unsigned long long progress_io_bytes(ext2_resize_t rfs)
+{
+	io_channel channel = rfs->old_fs ? rfs->old_fs->io : NULL;
+	io_stats stats = 0;
+
+	if (channel && channel->manager && channel->manager->get_stats)
+		channel->manager->get_stats(channel, &stats);
+	if (!stats)
+		return 0;
+	return stats->bytes_read + stats->bytes_written;
+}
+
+static const char *progress_pass_label(int pass)
+{
+	switch (pass) {
+	case E2_RSZ_EXTEND_ITABLE_PASS:
+		return _("Extending the inode table");
+	case E2_RSZ_BLOCK_RELOC_PASS:
+		return _("Relocating blocks");
+	case E2_RSZ_INODE_SCAN_PASS:
+		return _("Scanning inode table");
+	case E2_RSZ_INODE_REF_UPD_PASS:
+		return _("Updating inode references");
+	case E2_RSZ_MOVE_ITABLE_PASS:
+		return _("Moving inode table");
+	case E2_RSZ_MIGRATE_INODES_PASS:
+		return _("Migrating inodes");
+	default:
+		return _("Unknown pass?!?");
+	}
+}
+
+/*
+ * Items done per second, bytes per second and the remaining seconds (-1 if unknown yet)
+ */
+static void progress_rates(ext2_resize_t rfs, struct timeval *now, double *elapsed, double *bps, double *eta)
+{
+	*elapsed = tv_elapsed(now, &pstate.start);
+	*bps = 0;
+	*eta = -1;
+	if (*elapsed <= 0)
+		return;
+	*bps = (progress_io_bytes(rfs) - pstate.bytes_start) / *elapsed;
+	if (pstate.cur && pstate.max >= pstate.cur)
+		*eta = *elapsed * (pstate.max - pstate.cur) / pstate.cur;
+}
+
+static void progress_format_info(char *buf, size_t len, double bps, double eta)
+{
+	unsigned int pct = pstate.max ? (unsigned int) ((100.0 * pstate.cur) / pstate.max) : 0;
+
+	if (eta < 0)
+		snprintf(buf, len, "%3u%% %7.1fMB/s ETA --:--:--", pct, bps / 1048576);
+	else
+		snprintf(buf, len, "%3u%% %7.1fMB/s ETA %02lu:%02lu:%02lu", pct, bps / 1048576,
+			 (unsigned long) eta / 3600, ((unsigned long) eta / 60) % 60, (unsigned long) eta % 60);
+}
+
+static void progress_stream_event(ext2_resize_t rfs, FILE *f, const char *event, struct timeval *now)
+{
+	double elapsed, bps, eta;
+
+	progress_rates(rfs, now, &elapsed, &bps, &eta);
+	fprintf(f, "{\"event\":\"%s\",\"pass\":%d,\"label\":\"%s\",\"done\":%lu,\"total\":%lu,"
+		"\"elapsed\":%.3f,\"bytes\":%llu,\"bytes_per_sec\":%.0f,\"items_per_sec\":%.1f,\"eta\":%.1f}\n",
+		event, pstate.pass, pstate.label, pstate.cur, pstate.max, elapsed,
+		progress_io_bytes(rfs) - pstate.bytes_start, bps, elapsed > 0 ? pstate.cur / elapsed : 0, eta);
+	fflush(f);
+}
+
 static errcode_t resize_progress_func(ext2_resize_t rfs, int pass, unsigned long cur, unsigned long max)
 {
 	ext2_sim_progmeter progress;
-	const char *label;
+	struct timeval now;
+	double elapsed, bps, eta;
+	char info[64];
 	errcode_t retval;
 
 	progress = (ext2_sim_progmeter) rfs->prog_data;
 	if (max == 0)
 		return 0;
-	if (cur == 0) {
+	gettimeofday(&now, 0);
+	if (cur == 0 || pass != pstate.pass) {
+		if (cur >= max && pass != pstate.pass)
+			return 0;	/* end of a pass already reported as completed */
 		if (progress)
 			ext2fs_progress_close(progress);
 		progress = 0;
-		switch (pass) {
-		case E2_RSZ_EXTEND_ITABLE_PASS:
-			label = _("Extending the inode table");
-			break;
-		case E2_RSZ_BLOCK_RELOC_PASS:
-			label = _("Relocating blocks");
-			break;
-		case E2_RSZ_INODE_SCAN_PASS:
-			label = _("Scanning inode table");
-			break;
-		case E2_RSZ_INODE_REF_UPD_PASS:
-			label = _("Updating inode references");
-			break;
-		case E2_RSZ_MOVE_ITABLE_PASS:
-			label = _("Moving inode table");
-			break;
-		default:
-			label = _("Unknown pass?!?");
-			break;
+		rfs->prog_data = 0;
+		pstate.pass = pass;
+		pstate.label = progress_pass_label(pass);
+		pstate.start = now;
+		pstate.last_bar.tv_sec = pstate.last_stream.tv_sec = 0;
+		pstate.bytes_start = progress_io_bytes(rfs);
+		pstate.cur = cur;
+		pstate.max = max;
+		if (progress_stream)
+			progress_stream_event(rfs, progress_stream, "start", &now);
+		if (rfs->flags & RESIZE_PERCENT_COMPLETE) {
+			printf(_("Begin pass %d (max = %lu)\n"), pass, max);
+			retval = ext2fs_progress_init(&progress, pstate.label, 30, 20, max, 0);
+			if (retval)
+				progress = 0;
+			rfs->prog_data = (void *)progress;
 		}
-		printf(_("Begin pass %d (max = %lu)\n"), pass, max);
-		retval = ext2fs_progress_init(&progress, label, 30, 40, max, 0);
-		if (retval)
-			progress = 0;
-		rfs->prog_data = (void *)progress;
 	}
-	if (progress)
+	pstate.cur = cur;
+	pstate.max = max;
+
+	if (progress_snapshot_requested) {
+		progress_snapshot_requested = 0;
+		log_flush();
+		progress_rates(rfs, &now, &elapsed, &bps, &eta);
+		progress_format_info(info, sizeof(info), bps, eta);
+		fprintf(stderr, _("\nPass %d (%s): %lu/%lu, %.1f items/s, %s\n"), pass, pstate.label, cur, max, elapsed > 0 ? cur / elapsed : 0, info);
+		if (progress_stream)
+			progress_stream_event(rfs, progress_stream, "snapshot", &now);
+	}
+
+	if (progress) {
 		ext2fs_progress_update(progress, cur);
+		if (cur >= max || tv_elapsed(&now, &pstate.last_bar) >= 0.2) {
+			progress_rates(rfs, &now, &elapsed, &bps, &eta);
+			progress_format_info(info, sizeof(info), bps, eta);
+			ext2fs_progress_info(progress, info);
+			pstate.last_bar = now;
+		}
+	}
+	if (progress_stream && cur < max && tv_elapsed(&now, &pstate.last_stream) >= 1) {
+		progress_stream_event(rfs, progress_stream, "progress", &now);
+		pstate.last_stream = now;
+	}
+
 	if (cur >= max) {
 		if (progress)
 			ext2fs_progress_close(progress);
 		progress = 0;
 		rfs->prog_data = 0;
+		if (progress_stream)
+			progress_stream_event(rfs, progress_stream, "end", &now);
+		pstate.pass = 0;
 	}
 	return 0;
 }
@@ -180,10 +300,10 @@ static int resize2fs_setup_tdb(const char *device, char *undo_file, io_manager *
 	return retval;
 }
 
-static int check_space_last_group(ext2_filsys fs, unsigned int inode_blocks_per_group)
+static errcode_t check_space_last_group(ext2_filsys fs, unsigned int inode_blocks_per_group)
 {
 
-	ext2fs_block_bitmap meta_bmap;
+	ext2fs_block_bitmap meta_bmap = 0;
 	blk64_t b;
 	errcode_t retval;
 	unsigned int movable_blocks = 0;
@@ -195,12 +315,12 @@ static int check_space_last_group(ext2_filsys fs, unsigned int inode_blocks_per_
 
 	retval = mark_table_blocks(fs, meta_bmap); /*mark as used in meta_bmap the SB, BGD, reserved GDT, bitmaps, itables and MMP*/
 	if (retval)
-		return retval;
+		goto errout;
 
 	retval = ext2fs_read_bb_inode(fs, &badblock_list);
 	if (retval) {
 		printf("Error while reading badblock list in check_space_last_group()\n");
-		exit(1);
+		goto errout;
 	}
 
 	for (b = ext2fs_group_first_block2(fs, fs->group_desc_count - 1); b < ext2fs_blocks_count(fs->super); b++) {
@@ -208,9 +328,8 @@ static int check_space_last_group(ext2_filsys fs, unsigned int inode_blocks_per_
 			movable_blocks++;
 	}
 
-/*TODO: This could be further optimized. For the given filesystem and new inode count, we may calculate if
-  the last inode table could be evacuated and its space freed before we allocate the new itable. For those cases,
-  the if condition could be updated to movable_blocks < (inode_blocks_per_group-fs->inode_blocks_per_group)*/
+/*Only used when the new itables can't all be planned up front: the iterative allocation can't reuse the old
+  itable of the last group, plan_new_itables() can (see place_new_itables())*/
 	if (movable_blocks < inode_blocks_per_group) {
 		printf("************ STOP ************\n");
 		if (!ext2fs_has_feature_flex_bg(fs->super))
@@ -230,7 +349,7 @@ static int check_space_last_group(ext2_filsys fs, unsigned int inode_blocks_per_
 			printf(" - Use resize2fs to shrink the filesystem to %llu blocks, in order to get rid of the last group\n",
 				(blk64_t) EXT2_BLOCKS_PER_GROUP(fs->super) * (fs->group_desc_count - 1));
 		printf("After that, you can try again to change the inode count\n");
-		exit(1);
+		retval = ENOSPC;
 	}
 
  errout:
@@ -239,14 +358,72 @@ static int check_space_last_group(ext2_filsys fs, unsigned int inode_blocks_per_
 	if (badblock_list)
 		ext2fs_badblocks_list_free(badblock_list);
 
-	return 0;
+	return retval;
+}
+
+/*
+ * A size in bytes, with an optional K, M, G or T suffix
+ */
+static unsigned long long parse_size(const char *arg)
+{
+	char *end;
+	unsigned long long size = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'T': case 't':
+		size <<= 10;
+		/* fall through */
+	case 'G': case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		size <<= 10;
+		end++;
+		break;
+	}
+	if (end == arg || *end || !size) {
+		com_err(program_name, 0, _("invalid size - %s"), arg);
+		exit(1);
+	}
+	return size;
 }
 
+#define OPT_JOBS		256
+#define OPT_JOBS_PER_CONTROLLER	257
+#define OPT_BATCH_LOGS		258
+#define OPT_READAHEAD		259
+#define OPT_CACHE		260
+#define OPT_NO_DIRECT_IO	261
+#define OPT_SAVE_PLAN		262
+#define OPT_PLAN		263
+#define OPT_SPILL_DIR		264
+#define OPT_VERIFY		265
+
+static const struct option long_options[] = {
+	{ "memory-limit", required_argument, NULL, 'm' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "readahead", required_argument, NULL, OPT_READAHEAD },
+	{ "cache", required_argument, NULL, OPT_CACHE },
+	{ "no-direct-io", no_argument, NULL, OPT_NO_DIRECT_IO },
+	{ "save-plan", required_argument, NULL, OPT_SAVE_PLAN },
+	{ "plan", required_argument, NULL, OPT_PLAN },
+	{ "spill-dir", required_argument, NULL, OPT_SPILL_DIR },
+	{ "verify", no_argument, NULL, OPT_VERIFY },
+	{ "batch", required_argument, NULL, 'B' },
+	{ "jobs", required_argument, NULL, OPT_JOBS },
+	{ "jobs-per-controller", required_argument, NULL, OPT_JOBS_PER_CONTROLLER },
+	{ "batch-logs", required_argument, NULL, OPT_BATCH_LOGS },
+	{ NULL, 0, NULL, 0 }
+};
+
 static ext2_ino_t find_last_used_inode(ext2_filsys fs)
 {
 	ext2_ino_t ino_num = fs->super->s_inodes_count;
-	if (ext2fs_read_inode_bitmap(fs)) {
-		printf("Error while reading inode bitmap in find_last_used_inode()\n");
+	if (mem_read_bitmaps(fs)) {
+		printf("Error while reading bitmaps in find_last_used_inode()\n");
 		exit(-1);
 	}
 	while (ino_num && !ext2fs_test_inode_bitmap2(fs->inode_map, ino_num))
@@ -259,7 +436,7 @@ static ext2_ino_t find_last_used_inode(ext2_filsys fs)
 it shall replicate what is done in ext2fs_initialize(), with some extra checks
 on having at least enough inodes for what the fs already has
 */
-static int calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, long long unsigned int value, unsigned int *ipg, int force)
+errcode_t calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, long long unsigned int value, unsigned int *ipg, int force)
 {
 
 	int inode_ratio, blocksize = EXT2_BLOCK_SIZE(fs->super);
@@ -268,6 +445,10 @@ static int calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, lon
 			max_inode_blocks_per_group = blocksize * 8 * EXT2_INODE_SIZE(fs->super) / blocksize;
 	double inode_blocks_per_group_d;
 	blk64_t free_space, current_inode_blocks_space, new_inode_blocks_space, safe_margin;
+	struct increase_feasibility feas;
+	unsigned int max_itable_blocks;
+	int need_force;
+	errcode_t retval;
 
 	printf("Current inode blocks per group: %u\n", fs->inode_blocks_per_group);
 	printf("Current inode count: %u\n", fs->super->s_inodes_count);
@@ -298,11 +479,11 @@ static int calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, lon
 	if (type_of_value == 0) {
 		if (value < EXT2_FIRST_INODE(fs->super) + 1) {
 			printf("The requested inode count is too low. Minimum is %u\n\n", EXT2_FIRST_INODE(fs->super) + 1);
-			exit(1);
+			return EINVAL;
 		}
 		if (value > 0xffffffff) {
 			printf("The requested inode count is too high. Maximum is %u\n\n", 0xffffffff);
-			exit(1);
+			return EINVAL;
 		}
 		/*inode_ratio = ext2fs_blocks_count(fs->super)*blocksize/value; */
 		printf("Inode count requested by the user: %llu\n\n", value);
@@ -333,12 +514,12 @@ static int calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, lon
 	}
 	inode_blocks_per_group_rounded = (((new_inodes_per_group * EXT2_INODE_SIZE(fs->super)) + blocksize - 1) / blocksize);
 
-	if (ext2fs_has_feature_bigalloc(fs->super)
+	if (ext2fs_has_feature_bigalloc(fs->super) && !(ext2fs_has_feature_flex_bg(fs->super) && fs->super->s_log_groups_per_flex)
 	    && inode_blocks_per_group_rounded > fs->inode_blocks_per_group && inode_blocks_per_group_rounded % EXT2FS_CLUSTER_RATIO(fs)) {
 
-		/*The increaser will allocate different clusters to each inode table, they cannot be shared among different itables.
-		   Therefore, make sure the whole cluster is used, otherwise, the remaining blocks would be wasted.
-		   Ideally, we could optimize by trying to allocate contiguous blocks and compact itables so they share the same cluster... */
+		/*Without flex_bg, each itable stays in its own group, so the increaser can't pack it in the last cluster
+		   of the previous one (see find_packed_itable_window()). Make sure the whole cluster is used, otherwise,
+		   the remaining blocks would be wasted. With flex_bg, the new itables share their partial clusters. */
 
 		inode_blocks_per_group_rounded += EXT2FS_CLUSTER_RATIO(fs) - (inode_blocks_per_group_rounded % EXT2FS_CLUSTER_RATIO(fs));
 		printf("New inode blocks per group (after rounding to fill last itable cluster): %u\n", inode_blocks_per_group_rounded);
@@ -347,33 +528,26 @@ static int calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, lon
 		printf("New inode blocks per group (after rounding to fill last itable block): %u\n", inode_blocks_per_group_rounded);
 	}
 
-	if (inode_blocks_per_group_rounded < EXT2FS_CLUSTER_RATIO(fs)) {
-		if (ext2fs_has_feature_bigalloc(fs->super) && inode_blocks_per_group_rounded > fs->inode_blocks_per_group) {
-			printf("  inode_blocks_per_group was %u, forced to %i\n", inode_blocks_per_group_rounded, EXT2FS_CLUSTER_RATIO(fs));
-			inode_blocks_per_group_rounded = EXT2FS_CLUSTER_RATIO(fs);
-		} else if (inode_blocks_per_group_rounded < 1) {
-			printf("  inode_blocks_per_group was %u, forced to 1\n", inode_blocks_per_group_rounded);
-			inode_blocks_per_group_rounded = 1;
-		}
-	} else {
-		if (inode_blocks_per_group_rounded > max_inode_blocks_per_group) {
-			printf("  inode_blocks_per_group was %u, forced to %u as the remaining inodes would not be addressable in the inode bitmap\n",
-				inode_blocks_per_group_rounded, max_inode_blocks_per_group);
-			inode_blocks_per_group_rounded = max_inode_blocks_per_group;
-		}
+	if (inode_blocks_per_group_rounded < 1) {
+		printf("  inode_blocks_per_group was %u, forced to 1\n", inode_blocks_per_group_rounded);
+		inode_blocks_per_group_rounded = 1;
+	} else if (inode_blocks_per_group_rounded > max_inode_blocks_per_group) {
+		printf("  inode_blocks_per_group was %u, forced to %u as the remaining inodes would not be addressable in the inode bitmap\n",
+			inode_blocks_per_group_rounded, max_inode_blocks_per_group);
+		inode_blocks_per_group_rounded = max_inode_blocks_per_group;
 	}
 
 	if (fs->group_desc_count * ((blk64_t) inode_blocks_per_group_rounded * blocksize / EXT2_INODE_SIZE(fs->super)) > 0xffffffff) {
 		printf("ERROR: the new inode count (%llu) is above the max allowed value (%u)\n",
 			fs->group_desc_count * ((blk64_t) inode_blocks_per_group_rounded * blocksize / EXT2_INODE_SIZE(fs->super)), 0xffffffff);
-		exit(1);
+		return EINVAL;
 	}
 
 	new_inode_count = fs->group_desc_count * (inode_blocks_per_group_rounded * blocksize / EXT2_INODE_SIZE(fs->super));
 	printf("New inode count: %u\n", new_inode_count);
 	if (new_inode_count < EXT2_FIRST_INODE(fs->super) + 1) {
 		printf("The inode count is too low!\n");
-		exit(1);
+		return EINVAL;
 	}
 
 	new_inodes_per_group = inode_blocks_per_group_rounded * blocksize / EXT2_INODE_SIZE(fs->super);
@@ -382,7 +556,7 @@ static int calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, lon
 
 	if (new_inodes_per_group > EXT2_MAX_INODES_PER_GROUP(fs->super)) {
 		printf("ERROR: the new inodes per group is above the max allowed value (%u)\n", EXT2_MAX_INODES_PER_GROUP(fs->super));
-		exit(1);
+		return EINVAL;
 	}
 
 	printf("New space used by inode tables: ");
@@ -399,34 +573,61 @@ static int calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, lon
 	if (required_inodes > new_inode_count) {
 		printf("The chosen %s will not provide enough inodes for the existing filesystem, please choose a %s\n",
 			type_of_value == 1 ? "inode-ratio" : "inode count", type_of_value == 1 ? "lower bytes-per-inode ratio" : "higher inode count");
-		exit(1);
+		return EINVAL;
 	}
 
 	if (new_inode_count == fs->super->s_inodes_count) {
+		/*not an error: the caller checks *ipg against the current value */
 		printf("The existing filesystem already has %u inodes. No change needed.\n", new_inode_count);
-		exit(0);
+		*ipg = fs->super->s_inodes_per_group;
+		return 0;
 	}
 
 	if (new_inode_count > fs->super->s_inodes_count) {
-		safe_margin = new_inode_blocks_space / 2; /*TODO: think about how to calculate the safe_margin */
-		if (new_inode_blocks_space + safe_margin > free_space) {
-			if (new_inode_blocks_space - current_inode_blocks_space > free_space) {
-				printf("The free space in the filesystem is too low to perform the change:\n"
-					"It will not be possible to allocate large enough inode tables for the chosen inode %s\n",
-					type_of_value ? "ratio" : "count");
-				exit(1);
-			}
+		if (new_inode_blocks_space - current_inode_blocks_space > free_space) {
+			printf("The free space in the filesystem is too low to perform the change:\n"
+				"It will not be possible to allocate large enough inode tables for the chosen inode %s\n",
+				type_of_value ? "ratio" : "count");
+			return ENOSPC;
+		}
+
+		retval = increase_feasibility(fs, inode_blocks_per_group_rounded, 1, &feas);
+		if (retval) {
+			printf("Error while computing the free space needed by the change\n");
+			return retval;
+		}
+		if (feas.placed) {
+			printf("Free blocks needed by the change: %llu (%llu covered by the new inode tables, %llu to relocate in %llu runs, %llu for the extent trees)\n",
+				feas.min_free, feas.free_in_itables, feas.evicted, feas.fragments, feas.extent_blocks);
+			if (feas.staged)
+				printf("  including %llu blocks to copy aside the old inode tables overwritten by their replacement\n", feas.staged);
+			printf("Free blocks in the filesystem: %llu\n\n", ext2fs_free_blocks_count(fs->super));
+			need_force = !feas.feasible;
+		} else {
+			/*no room for all the new itables at once, the increase will go through several iterations */
+			printf("The new inode tables can't all be placed at once, the change will be done in several passes\n\n");
+			safe_margin = new_inode_blocks_space / 2;
+			need_force = new_inode_blocks_space + safe_margin > free_space;
+		}
+
+		if (need_force) {
+			if (!increase_max_itable_blocks(fs, inode_blocks_per_group_rounded - 1, &max_itable_blocks) && max_itable_blocks)
+				printf("With the current free space, the inode count can be increased up to %llu\n",
+					(blk64_t) fs->group_desc_count * (max_itable_blocks * blocksize / EXT2_INODE_SIZE(fs->super)));
 			printf("The filesystem doesn't have enough free space to perform the change in a safe way.\n");
 			if (force) {
 				printf("As the force flag has been provided, we will proceed with the change\n");
 			} else {
 				printf("Re-run with the force flag if you want to try anyway.\n");
-				exit(1);
+				return ENOSPC;
 			}
 		}
 
-		if (!ext2fs_has_feature_flex_bg(fs->super) || !fs->super->s_log_groups_per_flex) {
-			check_space_last_group(fs, inode_blocks_per_group_rounded);
+		/*with a complete plan, the last group has room, if need be over its own old itable */
+		if (!feas.placed && (!ext2fs_has_feature_flex_bg(fs->super) || !fs->super->s_log_groups_per_flex)) {
+			retval = check_space_last_group(fs, inode_blocks_per_group_rounded);
+			if (retval)
+				return retval;
 		}
 	}
 
@@ -457,6 +658,13 @@ int main(int argc, char **argv)
 	const char *ext2fs_version, *ext2fs_date;
 	int version_int;
 	ext2_ino_t last_used_inode;
+	int progress_fd = -1;
+	char *profile_file = NULL;
+	int verbosity = RESIZE_LOG_INFO;
+	struct sigaction sa;
+	char *batch_manifest = NULL;
+	struct batch_options batch_opts;
+	char *save_plan = NULL;
 
 #ifdef ENABLE_NLS
 	setlocale(LC_MESSAGES, "");
@@ -466,6 +674,7 @@ int main(int argc, char **argv)
 	set_com_err_gettext(gettext);
 #endif
 
+	log_init();
 	add_error_table(&et_ext2_error_table);
 
 	version_int = ext2fs_get_library_version(&ext2fs_version, &ext2fs_date);
@@ -476,7 +685,9 @@ int main(int argc, char **argv)
 	else
 		usage(NULL);
 
-	while ((c = getopt(argc, argv, "d:fFhpz:r:c:")) != EOF) {
+	memset(&batch_opts, 0, sizeof(batch_opts));
+	batch_opts.log_dir = ".";
+	while ((c = getopt_long(argc, argv, "B:d:fFhj:lm:pP:t:vz:r:c:", long_options, NULL)) != EOF) {
 		switch (c) {
 		case 'h':
 			usage(program_name);
@@ -487,12 +698,67 @@ int main(int argc, char **argv)
 		case 'F':
 			flush = 1;
 			break;
+		case 'j':
+			profile_file = optarg;
+			break;
+		case 'l':
+			flags |= RESIZE_LAZY_ITABLE_INIT;
+			break;
+		case 'm':
+			mem_limit = parse_size(optarg);
+			break;
 		case 'd':
 			flags |= atoi(optarg);
+			batch_opts.debug_flags |= atoi(optarg);
+			break;
+		case 't':
+			migrate_threads = atoi(optarg);
+			if (migrate_threads < 1)
+				usage(program_name);
+			break;
+		case OPT_READAHEAD:
+			readahead_depth = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_CACHE:
+			cache_io_size = parse_size(optarg);
+			break;
+		case OPT_NO_DIRECT_IO:
+			bulk_direct_io = 0;
+			break;
+		case OPT_SAVE_PLAN:
+			save_plan = optarg;
+			open_flags = O_RDONLY;
+			break;
+		case OPT_PLAN:
+			plan_file = optarg;
+			break;
+		case OPT_SPILL_DIR:
+			spill_dir = optarg;
+			break;
+		case OPT_VERIFY:
+			verify_mode = 1;
+			break;
+		case 'B':
+			batch_manifest = optarg;
+			break;
+		case OPT_JOBS:
+			batch_opts.max_jobs = atoi(optarg);
+			break;
+		case OPT_JOBS_PER_CONTROLLER:
+			batch_opts.jobs_per_controller = atoi(optarg);
+			break;
+		case OPT_BATCH_LOGS:
+			batch_opts.log_dir = optarg;
 			break;
 		case 'p':
 			flags |= RESIZE_PERCENT_COMPLETE;
 			break;
+		case 'P':
+			progress_fd = atoi(optarg);
+			break;
+		case 'v':
+			verbosity++;
+			break;
 		case 'z':
 			undo_file = optarg;
 			break;
@@ -508,13 +774,42 @@ int main(int argc, char **argv)
 			usage(program_name);
 		}
 	}
-	if (optind == argc)
+	if (batch_manifest) {
+		if (optind != argc || ratio_type || count_type || undo_file || progress_fd >= 0 || save_plan || plan_file)
+			usage(program_name);
+		log_setup(verbosity, flags);
+		batch_opts.force = force;
+		batch_opts.flags = flags;
+		batch_opts.verbosity = verbosity;
+		batch_opts.profile = (profile_file != NULL);
+		ret = batch_main(batch_manifest, &batch_opts);
+		remove_error_table(&et_ext2_error_table);
+		return ret;
+	}
+	if (optind == argc || (save_plan && plan_file))
 		usage(program_name);
+	if (save_plan && verify_mode) {
+		printf("--save-plan doesn't modify the filesystem, --verify is ignored\n");
+		verify_mode = 0;
+	}
+	log_setup(verbosity, flags);
 
 	device_name = argv[optind++];
 	if (optind < argc)
 		usage(program_name);
 
+	if (progress_fd >= 0) {
+		progress_stream = fdopen(progress_fd, "w");
+		if (!progress_stream) {
+			com_err(program_name, errno, _("while opening the progress stream on fd %d"), progress_fd);
+			exit(1);
+		}
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = progress_snapshot_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, 0);
+
 	io_options = strchr(device_name, '?');
 	if (io_options)
 		*io_options++ = 0;
@@ -568,11 +863,13 @@ int main(int argc, char **argv)
 	if (getenv("TEST_IO_FLAGS") || getenv("TEST_IO_BLOCK")) {
 		io_ptr = test_io_manager;
 		test_io_backing_manager = unix_io_manager;
+		bulk_direct_io = 0;
 	} else
 #endif
 		io_ptr = unix_io_manager;
 
-	if (!(mount_flags & EXT2_MF_MOUNTED))
+	/*a plan is saved without writing anything, on a mounted filesystem too */
+	if (!(mount_flags & EXT2_MF_MOUNTED) && !save_plan)
 		io_flags = EXT2_FLAG_RW | EXT2_FLAG_EXCLUSIVE;
 	if (mount_flags & EXT2_MF_MOUNTED)
 		io_flags |= EXT2_FLAG_DIRECT_IO;
@@ -582,6 +879,12 @@ int main(int argc, char **argv)
 		retval = resize2fs_setup_tdb(device_name, undo_file, &io_ptr);
 		if (retval)
 			exit(1);
+		/*the direct channel would bypass the undo file */
+		bulk_direct_io = 0;
+	}
+	if (cache_io_size) {
+		set_cache_io_backing_manager(io_ptr);
+		io_ptr = cache_io_manager;
 	}
 	retval = ext2fs_open2(device_name, io_options, io_flags, 0, 0, io_ptr, &fs);
 	if (retval) {
@@ -589,6 +892,7 @@ int main(int argc, char **argv)
 		printf("%s", _("Couldn't find valid filesystem superblock.\n"));
 		exit(1);
 	}
+	/*the block and inode bitmaps get their own backend, see mem_read_bitmaps() */
 	fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
 
 	/*
@@ -634,13 +938,17 @@ int main(int argc, char **argv)
 		goto errout;
 	}
 
-	if (mount_flags & EXT2_MF_MOUNTED) {
+	if ((mount_flags & EXT2_MF_MOUNTED) && !save_plan) {
 		printf("Filesystem is mounted. Online change is not supported\n");
 		exit(1);
 
 	} else {
 		bigalloc_check(fs, force);
 
+		retval = mem_check_budget(fs);
+		if (retval)
+			goto errout;
+
 		if (ratio_type == count_type) {
 			printf("You must specify either '-c' for inode count or '-r' for inode ratio\n");
 			exit(1);
@@ -653,6 +961,8 @@ int main(int argc, char **argv)
 		if (retval) {
 			goto errout;
 		}
+		if (new_inodes_per_group == fs->super->s_inodes_per_group)
+			exit(0);
 
 		if (ext2fs_has_feature_stable_inodes(fs->super)) {
 			if (new_inodes_per_group > fs->super->s_inodes_per_group) {
@@ -678,27 +988,71 @@ int main(int argc, char **argv)
 			}
 		}
 
+		if ((flags & RESIZE_LAZY_ITABLE_INIT) && !ext2fs_has_group_desc_csum(fs)) {
+			printf("Lazy inode table initialization needs the uninit_bg or metadata_csum feature\n");
+			goto errout;
+		}
+
+		if (save_plan) {
+			if (new_inodes_per_group <= fs->super->s_inodes_per_group) {
+				printf("Only an increase of the inode count can be planned ahead\n");
+				goto errout;
+			}
+			retval = plan_save(fs, new_inodes_per_group, save_plan);
+			if (retval)
+				goto errout;
+			free(mtpt);
+			(void)ext2fs_close_free(&fs);
+			remove_error_table(&et_ext2_error_table);
+			return 0;
+		}
+
+		if (profile_file)
+			profile_init(fs);
+		if (verify_mode) {
+			retval = verify_begin(fs);
+			if (retval) {
+				com_err(program_name, retval, _("while recording the digests of %s"), device_name);
+				goto errout;
+			}
+		}
 		if (new_inodes_per_group > fs->super->s_inodes_per_group) {
 			printf("Calling increase_inode_count\n");
-			retval = increase_inode_count(fs, flags, ((flags & RESIZE_PERCENT_COMPLETE) ? resize_progress_func : 0), new_inodes_per_group);
+			retval = increase_inode_count(fs, flags, resize_progress_func, new_inodes_per_group);
 
 		} else {
 			printf("Calling reduce_inode_count\n");
-			retval = reduce_inode_count(fs, flags, ((flags & RESIZE_PERCENT_COMPLETE) ? resize_progress_func : 0), new_inodes_per_group);
+			retval = reduce_inode_count(fs, flags, resize_progress_func, new_inodes_per_group);
 		}
 	}
 	free(mtpt);
+	log_flush();
+	if (profile_file) {
+		errcode_t err = profile_write_json(profile_file, device_name);
+
+		if (err)
+			com_err(program_name, err, _("while writing the profile to %s"), profile_file);
+	}
 	if (retval) {
 		com_err(program_name, retval, _("while trying to modify inode count on %s"), device_name);
 		fprintf(stderr, _("Please run 'e2fsck -fy %s' to fix the filesystem\n" "after the aborted operation.\n"), device_name);
 		goto errout;
 	}
+	if (verbosity > RESIZE_LOG_INFO || mem_limit)
+		mem_report();
+	cache_io_report();
 	printf(_("The filesystem on %s now has %u inodes.\n\n"), device_name, new_inodes_per_group * fs->group_desc_count);
 
+	/*the change is done and the fs closed: only report a failed verification */
+	ret = 0;
+	if (verify_mode && verify_check(device_name, io_options)) {
+		fprintf(stderr, _("The verification of %s failed, please run 'e2fsck -fn %s'.\n"), device_name, device_name);
+		ret = 1;
+	}
 	if (fd > 0)
 		close(fd);
 	remove_error_table(&et_ext2_error_table);
-	return 0;
+	return ret;
  errout:
 	(void)ext2fs_close_free(&fs);
 	remove_error_table(&et_ext2_error_table);
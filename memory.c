@@ -0,0 +1,251 @@
+/*
+ * memory.c --- memory budget and accounting
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+
+unsigned long long mem_limit;
+
+/*
+ * An rbtree bitmap costs one node per run of set bits: struct
+ * bmap_rb_extent (40 bytes) plus the malloc overhead.
+ */
+#define RBTREE_EXTENT_BYTES	48
+
+#define MEM_MAX_ENTRIES		32
+
+static struct mem_entry {
+	const char		*name;
+	unsigned long long	cur, peak;
+} mem_entries[MEM_MAX_ENTRIES];
+static int mem_num_entries;
+static unsigned long long mem_total, mem_total_peak;
+
+/*
+ * Record the memory currently held by a structure, 0 once freed
+ */
+void mem_account(const char *name, unsigned long long bytes)
+{
+	int i;
+
+	for (i = 0; i < mem_num_entries; i++)
+		if (!strcmp(mem_entries[i].name, name))
+			break;
+	if (i == mem_num_entries) {
+		if (i == MEM_MAX_ENTRIES)
+			return;
+		mem_entries[i].name = name;
+		mem_num_entries++;
+	}
+	mem_total = mem_total - mem_entries[i].cur + bytes;
+	mem_entries[i].cur = bytes;
+	if (bytes > mem_entries[i].peak)
+		mem_entries[i].peak = bytes;
+	if (mem_total > mem_total_peak)
+		mem_total_peak = mem_total;
+}
+
+void mem_report(void)
+{
+	int i;
+
+	printf("Memory accounting (peak per structure):\n");
+	for (i = 0; i < mem_num_entries; i++)
+		printf("  %-40s %12llu KiB\n", mem_entries[i].name, mem_entries[i].peak >> 10);
+	printf("  %-40s %12llu KiB", "peak total", mem_total_peak >> 10);
+	if (mem_limit)
+		printf(" (limit %llu KiB)", mem_limit >> 10);
+	printf("\n");
+}
+
+/*
+ * Runs of used blocks, as seen from the group descriptors: a full or an
+ * empty group adds at most one run, a partially used group is assumed to
+ * hold runs of 4 blocks on average.
+ */
+static __u64 estimate_block_runs(ext2_filsys fs)
+{
+	__u64 runs = 0, used, free_blocks;
+	blk64_t per_group;
+	dgrp_t g;
+
+	for (g = 0; g < fs->group_desc_count; g++) {
+		per_group = (g == fs->group_desc_count - 1) ? ext2fs_blocks_count(fs->super) - ext2fs_group_first_block2(fs, g) : fs->super->s_blocks_per_group;
+		per_group = EXT2FS_NUM_B2C(fs, per_group);
+		free_blocks = ext2fs_bg_free_blocks_count(fs, g);
+		if (free_blocks > per_group)
+			free_blocks = per_group;
+		used = per_group - free_blocks;
+		runs += 1 + (used < free_blocks ? used : free_blocks) / 4;
+	}
+	return runs;
+}
+
+/*used inodes are packed at the start of the groups: few runs, even when fragmented */
+static __u64 estimate_inode_runs(ext2_filsys fs)
+{
+	__u64 runs = 0, used, free_inodes;
+	dgrp_t g;
+
+	for (g = 0; g < fs->group_desc_count; g++) {
+		free_inodes = ext2fs_bg_free_inodes_count(fs, g);
+		if (free_inodes > fs->super->s_inodes_per_group)
+			free_inodes = fs->super->s_inodes_per_group;
+		used = fs->super->s_inodes_per_group - free_inodes;
+		runs += 1 + (used < free_inodes ? used : free_inodes) / 16;
+	}
+	return runs;
+}
+
+/*
+ * Pick the backend of a bitmap of nbits bits. The smaller one wins, but
+ * the faster bitarray is preferred when the budget allows it.
+ */
+static int smallest_bitmaps;
+
+static int choose_bitmap_type(__u64 nbits, __u64 runs, int copies, unsigned long long others, unsigned long long *bytes)
+{
+	unsigned long long bitarray = (nbits + 7) / 8, rbtree = runs * RBTREE_EXTENT_BYTES;
+
+	if (bitarray <= rbtree || (!smallest_bitmaps && mem_limit && others + copies * bitarray <= mem_limit / 2)) {
+		*bytes = bitarray;
+		return EXT2FS_BMAP64_BITARRAY;
+	}
+	*bytes = rbtree;
+	return EXT2FS_BMAP64_RBTREE;
+}
+
+static const char *bitmap_type_name(int type)
+{
+	return type == EXT2FS_BMAP64_BITARRAY ? "bitarray" : "rbtree";
+}
+
+static int block_map_type, inode_map_type;
+static unsigned long long block_map_bytes, inode_map_bytes;
+
+/*
+ * Choose the backends of the block bitmap, shared by old_fs and new_fs,
+ * and of the 2 inode bitmaps. Everything else stays on rbtree: the
+ * auxiliary bitmaps are sparse. Returns the estimated peak of memory.
+ */
+unsigned long long mem_plan_bitmaps(ext2_filsys fs)
+{
+	block_map_type = choose_bitmap_type(EXT2FS_NUM_B2C(fs, ext2fs_blocks_count(fs->super)), estimate_block_runs(fs), 1, 0, &block_map_bytes);
+	inode_map_type = choose_bitmap_type(fs->super->s_inodes_count, estimate_inode_runs(fs), 2, block_map_bytes, &inode_map_bytes);
+	log_verbose("block bitmap: %s, about %llu KiB; inode bitmaps: %s, about %llu KiB each\n",
+		bitmap_type_name(block_map_type), block_map_bytes >> 10, bitmap_type_name(inode_map_type), inode_map_bytes >> 10);
+
+	/*the per-group arrays, the itable buffer and the maps are small next to the bitmaps */
+	return block_map_bytes + 2 * inode_map_bytes + fs->group_desc_count * 32ULL + (unsigned long long)fs->blocksize * fs->inode_blocks_per_group;
+}
+
+/*
+ * Read a bitmap with the chosen backend. If it can't be allocated, try
+ * the other backend before giving up.
+ */
+static errcode_t read_bitmap_with_fallback(ext2_filsys fs, int type, errcode_t (*read_bitmap)(ext2_filsys), const char *what)
+{
+	int saved_type = fs->default_bitmap_type;
+	errcode_t retval;
+
+	fs->default_bitmap_type = type;
+	retval = read_bitmap(fs);
+	if (retval == EXT2_ET_NO_MEMORY || retval == ENOMEM) {
+		fs->default_bitmap_type = (type == EXT2FS_BMAP64_RBTREE) ? EXT2FS_BMAP64_BITARRAY : EXT2FS_BMAP64_RBTREE;
+		printf("Not enough memory for the %s as %s, retrying as %s\n", what, bitmap_type_name(type), bitmap_type_name(fs->default_bitmap_type));
+		retval = read_bitmap(fs);
+	}
+	fs->default_bitmap_type = saved_type;
+	return retval;
+}
+
+errcode_t mem_read_bitmaps(ext2_filsys fs)
+{
+	errcode_t retval;
+
+	if (!block_map_type)
+		mem_plan_bitmaps(fs);
+	if (!fs->inode_map) {
+		retval = read_bitmap_with_fallback(fs, inode_map_type, ext2fs_read_inode_bitmap, "inode bitmap");
+		if (retval)
+			return retval;
+	}
+	if (!fs->block_map) {
+		retval = read_bitmap_with_fallback(fs, block_map_type, ext2fs_read_block_bitmap, "block bitmap");
+		if (retval)
+			return retval;
+	}
+	mem_account("block bitmap", block_map_bytes);
+	mem_account("inode bitmap (old fs)", inode_map_bytes);
+	return 0;
+}
+
+/*dup_fs_handle() copies the inode bitmap, the block bitmap is shared */
+void mem_account_dup_handle(void)
+{
+	mem_account("inode bitmap (new fs)", inode_map_bytes);
+}
+
+/*
+ * Size of the block cache next to the other structures: at most half of
+ * what they leave in the memory limit
+ */
+unsigned long long mem_plan_cache(unsigned long long estimate)
+{
+	if (!mem_limit || estimate + cache_io_size <= mem_limit)
+		return cache_io_size;
+	return estimate < mem_limit ? (mem_limit - estimate) / 2 : 0;
+}
+
+/*
+ * Fit the estimate in the limit before touching the filesystem: the
+ * smaller bitmap backends, then a smaller block cache. If it still
+ * doesn't fit, the relocation maps are spilled to /var/tmp (unless
+ * --spill-dir is given) and the operation goes on: the estimate is
+ * rough, and a bitmap that can't be allocated is retried with the other
+ * backend.
+ */
+errcode_t mem_check_budget(ext2_filsys fs)
+{
+	unsigned long long estimate = mem_plan_bitmaps(fs), cache;
+	errcode_t retval;
+
+	if (mem_limit && estimate > mem_limit) {
+		smallest_bitmaps = 1;
+		estimate = mem_plan_bitmaps(fs);
+	}
+	if (fs->io->manager == cache_io_manager) {
+		cache = mem_plan_cache(estimate);
+		if (cache != cache_io_size) {
+			printf("Block cache reduced to %llu MiB to fit in the memory limit\n", cache >> 20);
+			retval = cache_io_resize(fs->io, cache);
+			if (retval)
+				return retval;
+		}
+		estimate += cache;
+	}
+
+	printf("Estimated peak memory: %llu MiB", estimate >> 20);
+	if (mem_limit)
+		printf(", limit %llu MiB", mem_limit >> 20);
+	printf("\n");
+	if (mem_limit && estimate > mem_limit) {
+		printf("The operation is not expected to fit in the memory limit: block bitmap as %s (%llu MiB), "
+			"inode bitmaps as %s (%llu MiB each)\n",
+			bitmap_type_name(block_map_type), block_map_bytes >> 20, bitmap_type_name(inode_map_type), inode_map_bytes >> 20);
+		if (!spill_dir) {
+			spill_dir = "/var/tmp";
+			printf("Spilling the relocation maps to %s\n", spill_dir);
+		}
+		printf("Going on anyway\n");
+	}
+	return 0;
+}
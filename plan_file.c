@@ -0,0 +1,177 @@
+/*
+ * plan_file.c --- relocation plan computed ahead of the increase
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * Searching a place for every new itable reads the block bitmaps and walks
+ * them group by group, which takes a while on large filesystems. With
+ * --save-plan, it is done on the mounted filesystem, opened read-only, and
+ * the places are written to a text file. The increase itself, run later
+ * on the unmounted filesystem with --plan, checks each saved place against
+ * the current bitmaps instead of searching it, and plans from scratch if
+ * one of them is not usable anymore. Only the places are saved: the blocks
+ * to evict under them are recomputed offline, the files have changed since.
+ *
+ * The file starts with a fingerprint of the geometry of the filesystem,
+ * which doesn't change while it is mounted. A plan saved for another
+ * filesystem, or for another inode count, is refused.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+
+#define PLAN_FILE_VERSION	1
+
+const char *plan_file;
+
+/*crc32c of what the saved places depend on, and that only a resize or a tune would change */
+static __u32 plan_fingerprint(ext2_filsys fs)
+{
+	struct ext2_super_block *sb = fs->super;
+	__u64 blocks = ext2fs_blocks_count(sb), loc[3];
+	/*the state the kernel sets while mounted, cleared by a clean unmount */
+	__u32 incompat = sb->s_feature_incompat & ~EXT3_FEATURE_INCOMPAT_RECOVER;
+	__u32 ro_compat = sb->s_feature_ro_compat;
+	__u32 crc = ~0U;
+	dgrp_t g;
+
+#ifdef EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT
+	ro_compat &= ~EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT;
+#endif
+
+	crc = csum_crc32c(crc, sb->s_uuid, sizeof(sb->s_uuid));
+	crc = csum_crc32c(crc, &blocks, sizeof(blocks));
+	crc = csum_crc32c(crc, &sb->s_first_data_block, sizeof(sb->s_first_data_block));
+	crc = csum_crc32c(crc, &sb->s_log_block_size, sizeof(sb->s_log_block_size));
+	crc = csum_crc32c(crc, &sb->s_log_cluster_size, sizeof(sb->s_log_cluster_size));
+	crc = csum_crc32c(crc, &sb->s_blocks_per_group, sizeof(sb->s_blocks_per_group));
+	crc = csum_crc32c(crc, &sb->s_inodes_per_group, sizeof(sb->s_inodes_per_group));
+	crc = csum_crc32c(crc, &sb->s_inode_size, sizeof(sb->s_inode_size));
+	crc = csum_crc32c(crc, &sb->s_feature_compat, sizeof(sb->s_feature_compat));
+	crc = csum_crc32c(crc, &incompat, sizeof(incompat));
+	crc = csum_crc32c(crc, &ro_compat, sizeof(ro_compat));
+	crc = csum_crc32c(crc, &sb->s_log_groups_per_flex, sizeof(sb->s_log_groups_per_flex));
+	for (g = 0; g < fs->group_desc_count; g++) {
+		loc[0] = ext2fs_block_bitmap_loc(fs, g);
+		loc[1] = ext2fs_inode_bitmap_loc(fs, g);
+		loc[2] = ext2fs_inode_table_loc(fs, g);
+		crc = csum_crc32c(crc, loc, sizeof(loc));
+	}
+	return ~crc;
+}
+
+/*plan the new itables on fs, as the increase would, and write their places to path */
+errcode_t plan_save(ext2_filsys fs, unsigned int new_inodes_per_group, const char *path)
+{
+	unsigned int itable_blocks = ext2fs_div_ceil(new_inodes_per_group * EXT2_INODE_SIZE(fs->super), fs->blocksize);
+	blk64_t *planned_itable_loc;
+	errcode_t retval;
+	FILE *f = NULL;
+	dgrp_t g;
+
+	planned_itable_loc = calloc(fs->group_desc_count, sizeof(blk64_t));
+	if (!planned_itable_loc)
+		return ENOMEM;
+
+	retval = ext2fs_read_bitmaps(fs);
+	if (retval) {
+		printf("plan_save: error %li while reading the bitmaps\n", retval);
+		goto errout;
+	}
+	retval = plan_itable_locations(fs, itable_blocks, planned_itable_loc);
+	if (retval) {
+		printf("plan_save: no place found for all the new itables (%s)\n", error_message(retval));
+		goto errout;
+	}
+
+	f = fopen(path, "w");
+	if (!f) {
+		retval = errno;
+		printf("plan_save: unable to create %s: %s\n", path, strerror(errno));
+		goto errout;
+	}
+	fprintf(f, "version %d\n", PLAN_FILE_VERSION);
+	fprintf(f, "fingerprint %08x\n", plan_fingerprint(fs));
+	fprintf(f, "inodes_per_group %u\n", new_inodes_per_group);
+	fprintf(f, "itable_blocks %u\n", itable_blocks);
+	for (g = 0; g < fs->group_desc_count; g++)
+		fprintf(f, "group %u %llu\n", g, (unsigned long long)planned_itable_loc[g]);
+	if (fclose(f) == EOF) {
+		retval = errno;
+		printf("plan_save: error writing %s: %s\n", path, strerror(errno));
+	}
+	f = NULL;
+	if (!retval)
+		printf("Plan for %u inodes per group saved in %s\n", new_inodes_per_group, path);
+
+ errout:
+	if (f)
+		fclose(f);
+	free(planned_itable_loc);
+	return retval;
+}
+
+/*
+ * Read the places saved by plan_save() in planned_itable_loc. The plan must
+ * have been made for this filesystem and for new_inodes_per_group; the
+ * places themselves are checked by the caller.
+ */
+errcode_t plan_load(ext2_filsys fs, unsigned int new_inodes_per_group, const char *path,
+		    blk64_t *planned_itable_loc)
+{
+	unsigned int version, fingerprint, ipg, itable_blocks, g, found = 0;
+	unsigned long long blk;
+	errcode_t retval = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("plan_load: unable to open %s: %s\n", path, strerror(errno));
+		return errno;
+	}
+	if (fscanf(f, "version %u\n", &version) != 1 || version != PLAN_FILE_VERSION ||
+	    fscanf(f, "fingerprint %x\n", &fingerprint) != 1 ||
+	    fscanf(f, "inodes_per_group %u\n", &ipg) != 1 ||
+	    fscanf(f, "itable_blocks %u\n", &itable_blocks) != 1) {
+		printf("plan_load: %s is not a plan saved by this version\n", path);
+		retval = EINVAL;
+		goto errout;
+	}
+	if (fingerprint != plan_fingerprint(fs)) {
+		printf("plan_load: %s was saved for another filesystem, or before a resize or a tune\n", path);
+		retval = EINVAL;
+		goto errout;
+	}
+	if (ipg != new_inodes_per_group) {
+		printf("plan_load: %s was saved for %u inodes per group, not %u\n", path, ipg, new_inodes_per_group);
+		retval = EINVAL;
+		goto errout;
+	}
+
+	memset(planned_itable_loc, 0, fs->group_desc_count * sizeof(blk64_t));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "group %u %llu", &g, &blk) != 2 || g >= fs->group_desc_count ||
+		    blk < fs->super->s_first_data_block || blk + itable_blocks > ext2fs_blocks_count(fs->super) ||
+		    planned_itable_loc[g]) {
+			printf("plan_load: %s: invalid line %s", path, line);
+			retval = EINVAL;
+			goto errout;
+		}
+		planned_itable_loc[g] = blk;
+		found++;
+	}
+	if (found != fs->group_desc_count) {
+		printf("plan_load: %s: %u groups planned out of %u\n", path, found, fs->group_desc_count);
+		retval = EINVAL;
+	}
+
+ errout:
+	fclose(f);
+	return retval;
+}
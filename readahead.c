@@ -0,0 +1,177 @@
+/*
+ * readahead.c --- metadata readahead for the long passes
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * The inode and directory passes read their metadata one block at a
+ * time, each read waiting for the previous one. Here the blocks the pass
+ * will need next are announced to the kernel with
+ * io_channel_cache_readahead(), which returns at once, so that the reads
+ * are already in the page cache when the pass gets there. At most
+ * readahead_depth blocks are requested ahead of the consumer.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+
+/*blocks requested ahead of each pass, 0 disables the readahead */
+unsigned long readahead_depth = READAHEAD_DEFAULT_DEPTH;
+
+static void readahead_blocks(io_channel io, blk64_t blk, blk64_t count)
+{
+	/*only a hint: the pass reads the blocks anyway if this fails */
+	if (count)
+		(void)io_channel_cache_readahead(io, blk, count);
+}
+
+/*
+ * Request the itable blocks holding inodes first..last of fs, skipping
+ * the part of each itable that was never used
+ */
+void readahead_inodes(ext2_filsys fs, ext2_ino_t first, ext2_ino_t last)
+{
+	ext2_ino_t ipg = fs->super->s_inodes_per_group, group_last, used;
+	int inode_size = EXT2_INODE_SIZE(fs->super);
+	dgrp_t group;
+	blk64_t itable, start, end;
+
+	while (first && first <= last) {
+		group = (first - 1) / ipg;
+		group_last = (group + 1) * ipg;
+		if (group_last > last)
+			group_last = last;
+		itable = ext2fs_inode_table_loc(fs, group);
+		used = ipg;
+		if (ext2fs_has_group_desc_csum(fs))
+			used = ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT) ? 0 : ipg - ext2fs_bg_itable_unused(fs, group);
+		if (itable && (first - 1) % ipg < used) {
+			if ((group_last - 1) % ipg >= used)
+				group_last = group * ipg + used;
+			start = (__u64)((first - 1) % ipg) * inode_size / fs->blocksize;
+			end = (__u64)((group_last - 1) % ipg) * inode_size / fs->blocksize;
+			readahead_blocks(fs->io, itable + start, end - start + 1);
+		}
+		first = (group + 1) * ipg + 1;
+	}
+}
+
+/*
+ * Keep a window of inodes requested ahead of ino: when less than half of
+ * it is left, return the next inodes to request in first..last
+ */
+int readahead_inode_window(ext2_filsys fs, ext2_ino_t ino, ext2_ino_t *next, ext2_ino_t *first, ext2_ino_t *last)
+{
+	__u64 window = (__u64)readahead_depth * fs->blocksize / EXT2_INODE_SIZE(fs->super), end;
+
+	if (!window || *next > fs->super->s_inodes_count || *next >= ino + window / 2)
+		return 0;
+	*first = *next > ino ? *next : ino;
+	end = (__u64)ino + window;
+	*last = end < fs->super->s_inodes_count ? end : fs->super->s_inodes_count;
+	*next = *last + 1;
+	return *first <= *last;
+}
+
+/*
+ * Request the blocks pointed by the index of an extent tree root, so that
+ * the walk of the tree doesn't wait for them one by one
+ */
+void readahead_extent_tree(ext2_filsys fs, struct ext2_inode *inode)
+{
+	struct ext3_extent_header *eh = (struct ext3_extent_header *)inode->i_block;
+	struct ext3_extent_idx *ix = (struct ext3_extent_idx *)(eh + 1);
+	blk64_t blk, run_start = 0, run_len = 0;
+	int i;
+
+	if (!readahead_depth || !(inode->i_flags & EXT4_EXTENTS_FL))
+		return;
+	if (ext2fs_le16_to_cpu(eh->eh_magic) != EXT3_EXT_MAGIC || !ext2fs_le16_to_cpu(eh->eh_depth))
+		return;
+	for (i = 0; i < ext2fs_le16_to_cpu(eh->eh_entries) && i < 4; i++, ix++) {
+		blk = ext2fs_le32_to_cpu(ix->ei_leaf) + ((blk64_t)ext2fs_le16_to_cpu(ix->ei_leaf_hi) << 32);
+		if (run_len && blk == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		readahead_blocks(fs->io, run_start, run_len);
+		run_start = blk;
+		run_len = 1;
+	}
+	readahead_blocks(fs->io, run_start, run_len);
+}
+
+static int collect_dir_blocks(ext2_filsys fs, struct ext2_db_entry2 *db, void *priv_data)
+{
+	struct readahead_dblist *ra = priv_data;
+
+	if (!db->blk)
+		return 0;
+	if (ra->run_len && db->blk == ra->run_start + ra->run_len) {
+		ra->run_len++;
+		return 0;
+	}
+	readahead_blocks(fs->io, ra->run_start, ra->run_len);
+	ra->run_start = db->blk;
+	ra->run_len = 1;
+	return 0;
+}
+
+/*request the next directory blocks in dblist order, once half of the window has been consumed */
+static void readahead_dblist_fill(struct readahead_dblist *ra)
+{
+	unsigned long long count, i;
+
+	if (!readahead_depth || ra->next >= ra->total || ra->next >= ra->consumed + readahead_depth / 2)
+		return;
+	count = ra->consumed + readahead_depth;
+	if (count > ra->total)
+		count = ra->total;
+	count -= ra->next;
+	ra->run_len = 0;
+	if (ra->entries) {
+		for (i = ra->next; i < ra->next + count; i++)
+			collect_dir_blocks(ra->fs, &ra->entries[i], ra);
+	} else {
+		ext2fs_dblist_iterate3(ra->dblist, collect_dir_blocks, ra->next, count, ra);
+	}
+	readahead_blocks(ra->fs->io, ra->run_start, ra->run_len);
+	ra->next += count;
+}
+
+/*
+ * Sort the dblist as ext2fs_dblist_dir_iterate() does, and request the
+ * first directory blocks
+ */
+void readahead_dblist_init(struct readahead_dblist *ra, ext2_filsys fs, ext2_dblist dblist)
+{
+	memset(ra, 0, sizeof(*ra));
+	ra->fs = fs;
+	ra->dblist = dblist;
+	ra->total = ext2fs_dblist_count2(dblist);
+	if (!readahead_depth)
+		return;
+	ext2fs_dblist_sort2(dblist, 0);
+	readahead_dblist_fill(ra);
+}
+
+/*the same, for count entries already sorted */
+void readahead_dblist_init_array(struct readahead_dblist *ra, ext2_filsys fs, struct ext2_db_entry2 *entries, unsigned long long count)
+{
+	memset(ra, 0, sizeof(*ra));
+	ra->fs = fs;
+	ra->entries = entries;
+	ra->total = count;
+	readahead_dblist_fill(ra);
+}
+
+/*one more directory block consumed by the pass */
+void readahead_dblist_advance(struct readahead_dblist *ra)
+{
+	ra->consumed++;
+	readahead_dblist_fill(ra);
+}
@@ -30,6 +30,9 @@
 
 #include "config.h"
 #include "resize2fs.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 
 static errcode_t inode_relocation_to_smaller_tables(ext2_resize_t rfs, unsigned int new_inodes_per_group);
@@ -39,6 +42,7 @@ errcode_t reduce_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (ex
 	ext2_resize_t rfs;
 	errcode_t retval;
 	struct resource_track rtrack, overall_track;
+	int prof_overall, prof;
 
 	/*
 	 * Create the data structure
@@ -55,8 +59,11 @@ errcode_t reduce_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (ex
 	rfs->progress = progress;
 
 	init_resource_track(&overall_track, "overall resize2fs", fs->io);
+	prof_overall = profile_begin("reduce_inode_count");
 	init_resource_track(&rtrack, "read_bitmaps", fs->io);
-	retval = ext2fs_read_bitmaps(fs);
+	prof = profile_begin("read_bitmaps");
+	retval = mem_read_bitmaps(fs);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 	print_resource_track(rfs, &rtrack, fs->io);
@@ -65,12 +72,17 @@ errcode_t reduce_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (ex
 	ext2fs_mark_super_dirty(fs);
 	ext2fs_flush(fs);
 
-	retval = ext2fs_dup_handle(fs, &rfs->new_fs);
+	retval = dup_fs_handle(fs, &rfs->new_fs);
+	if (retval)
+		goto errout;
+	retval = bulk_io_open(rfs);
 	if (retval)
 		goto errout;
 
 	init_resource_track(&rtrack, "inode_relocation_to_smaller_tables", fs->io);
+	prof = profile_begin("inode_relocation_to_smaller_tables");
 	retval = inode_relocation_to_smaller_tables(rfs, new_inodes_per_group);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 	print_resource_track(rfs, &rtrack, fs->io);
@@ -83,7 +95,13 @@ errcode_t reduce_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (ex
 	rfs->new_fs->flags &= ~EXT2_FLAG_MASTER_SB_ONLY;
 
 	print_resource_track(rfs, &overall_track, fs->io);
-	retval = ext2fs_close_free(&rfs->new_fs);
+	prof = profile_begin("close_and_flush");
+	retval = bulk_io_close(rfs);
+	unshare_block_map(rfs->new_fs, rfs->old_fs);
+	if (!retval)
+		retval = ext2fs_close_free(&rfs->new_fs);
+	profile_end(prof);
+	profile_end(prof_overall);
 	if (retval)
 		goto errout;
 
@@ -102,12 +120,17 @@ errcode_t reduce_inode_count(ext2_filsys fs, int flags, errcode_t(*progress) (ex
 	return 0;
 
  errout:
+	profile_end(prof_overall);
+	bulk_io_close(rfs);
 	if (rfs->new_fs) {
+		/*the caller closes the old fs, with the block bitmap*/
+		unshare_block_map(rfs->old_fs, rfs->new_fs);
 		ext2fs_free(rfs->new_fs);
 		rfs->new_fs = NULL;
 	}
 	if (rfs->itable_buf)
 		ext2fs_free_mem(&rfs->itable_buf);
+	spill_dblist_free(&rfs->dir_blocks);
 	ext2fs_free_mem(&rfs);
 	return retval;
 }
@@ -217,7 +240,7 @@ static errcode_t fix_ea_inode_refs(ext2_resize_t rfs, struct ext2_inode *inode,
 
 		blk = ext2fs_file_acl_block(fs, inode);
 		if (blk && !BLK_IN_CACHE(blk, blk_cache)) {
-			printf("fix_ea_inode_refs, inode %u, block %llu\n", ino, blk);
+			log_debug(RESIZE_DEBUG_INODEMAP, "fix_ea_inode_refs, inode %u, block %llu\n", ino, blk);
 			retval = ext2fs_read_ext_attr3(fs, blk, block_buf, ino);
 			if (retval)
 				goto out;
@@ -250,6 +273,7 @@ struct istruct {
 	errcode_t err;
 	unsigned int max_dirs;
 	unsigned int num;
+	struct readahead_dblist ra;
 };
 
 static int check_and_change_inodes(ext2_ino_t dir, int entry EXT2FS_ATTR((unused)), struct ext2_dir_entry *dirent, int offset, int blocksize EXT2FS_ATTR((unused)), char *buf EXT2FS_ATTR((unused)), void *priv_data)
@@ -267,17 +291,32 @@ static int check_and_change_inodes(ext2_ino_t dir, int entry EXT2FS_ATTR((unused
 	if (ext2fs_has_feature_metadata_csum(is->rfs->new_fs->super) && !ext2fs_test_inode_bitmap2(is->rfs->new_fs->inode_map, dir))
 		ret |= DIRENT_CHANGED;
 
+	if (offset == 0) {
+		profile_add_items(1);
+		readahead_dblist_advance(&is->ra);
+	}
+	if (is->rfs->progress && offset == 0) {
+		is->err = (is->rfs->progress)(is->rfs, E2_RSZ_INODE_REF_UPD_PASS, ++is->num, is->max_dirs);
+		if (is->err)
+			return ret | DIRENT_ABORT;
+	}
+
 	if (!dirent->inode)
 		return ret;
 
 	new_inode = ext2fs_extent_translate(is->rfs->imap, dirent->inode);
 
-	if (!new_inode)
+	if (!new_inode) {
+		if (verify_mode)
+			verify_record_dirent(dir, dirent);
 		return ret;
+	}
 
-	printf("Inode translate (dir=%u, name=%.*s, %u->%u)\n", dir, ext2fs_dirent_name_len(dirent), dirent->name, dirent->inode, new_inode);
+	log_debug(RESIZE_DEBUG_INODEMAP, "Inode translate (dir=%u, name=%.*s, %u->%u)\n", dir, ext2fs_dirent_name_len(dirent), dirent->name, dirent->inode, new_inode);
 
 	dirent->inode = new_inode;
+	if (verify_mode)
+		verify_record_dirent(dir, dirent);
 
 	/* Update the directory mtime and ctime */
 	retval = ext2fs_read_inode(is->rfs->old_fs, dir, &inode);
@@ -293,25 +332,459 @@ static int check_and_change_inodes(ext2_ino_t dir, int entry EXT2FS_ATTR((unused
 	return ret | DIRENT_CHANGED;
 }
 
+/*
+ * What ext2fs_dblist_dir_iterate() does for one entry, for the blocks kept
+ * in a plain array: the spilled list and the blocks deferred by the workers
+ */
+static errcode_t dir_block_iterate(ext2_resize_t rfs, struct ext2_db_entry2 *ent, char *buf, struct istruct *is)
+{
+	ext2_filsys fs = rfs->old_fs;
+	struct ext2_dir_entry *dirent;
+	unsigned int offset, rec_len;
+	int ret, changed = 0;
+	errcode_t retval;
+
+	/*the extent tree blocks of the directory */
+	if (ent->blockcnt < 0)
+		return 0;
+	if (!ent->blk)
+		return ext2fs_dir_iterate2(fs, ent->ino, DIRENT_FLAG_INCLUDE_EMPTY | DIRENT_FLAG_INCLUDE_INLINE_DATA, 0, check_and_change_inodes, is);
+
+	retval = ext2fs_read_dir_block4(fs, ent->blk, buf, 0, ent->ino);
+	if (retval)
+		return retval;
+	for (offset = 0; offset < fs->blocksize; offset += rec_len) {
+		dirent = (struct ext2_dir_entry *)(buf + offset);
+		if (ext2fs_get_rec_len(fs, dirent, &rec_len) || rec_len < 8 || rec_len % 4 ||
+		    offset + rec_len > fs->blocksize || (unsigned int)ext2fs_dirent_name_len(dirent) + 8 > rec_len)
+			return EXT2_ET_DIR_CORRUPTED;
+		ret = check_and_change_inodes(ent->ino, 0, dirent, offset, fs->blocksize, buf, is);
+		changed |= ret & DIRENT_CHANGED;
+		if (ret & DIRENT_ABORT)
+			break;
+	}
+	if (!changed)
+		return 0;
+	return ext2fs_write_dir_block4(fs, ent->blk, buf, 0, ent->ino);
+}
+
+/*the same for count entries, sorted by block */
+static errcode_t dir_array_iterate(ext2_resize_t rfs, struct ext2_db_entry2 *entries, unsigned long long count, struct istruct *is)
+{
+	unsigned long long i;
+	char *buf;
+	errcode_t retval;
+
+	retval = ext2fs_get_mem(rfs->old_fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	readahead_dblist_init_array(&is->ra, rfs->old_fs, entries, count);
+	for (i = 0; !retval && !is->err && i < count; i++)
+		retval = dir_block_iterate(rfs, &entries[i], buf, is);
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
+#if defined(HAVE_PTHREAD_H) && !defined(WORDS_BIGENDIAN)
+/*
+ * Parallel rewrite of the directory blocks, with -t. The sorted dblist, or
+ * the spilled list, is cut in shards of consecutive entries, taken by the
+ * workers. Each worker reads its blocks with raw block I/O, translates the
+ * entries, sets the checksum and writes the blocks back, so no libext2fs
+ * structure is shared but the I/O channel and, under the lock, the inode
+ * bitmap. The timestamps of the directories with a renumbered entry are
+ * updated once, when all the workers are done. The blocks a worker can't handle alone (inline
+ * data, htree nodes with metadata_csum, corrupted blocks) are left to the
+ * serial path.
+ */
+#define DIR_SHARD_BLOCKS	1024
+
+struct parallel_dir_rewrite {
+	ext2_resize_t	rfs;
+	struct istruct	*is;
+	/* the blocks to rewrite, a dblist or a plain array */
+	ext2_dblist	dblist;
+	struct ext2_db_entry2 *entries;
+	unsigned long long count, next;
+	/* blocks left to check_and_change_inodes(), usually a handful */
+	struct ext2_db_entry2 *deferred;
+	unsigned long long num_deferred, max_deferred;
+	/* directories to touch, with duplicates */
+	ext2_ino_t	*changed_dirs;
+	unsigned long long num_changed, max_changed;
+	errcode_t	retval;
+	pthread_mutex_t	lock;
+};
+
+struct dir_worker {
+	struct ext2_db_entry2 *shard;
+	unsigned int	num;
+	char		*buf, *inode_buf;
+	ext2_ino_t	*changed_dirs;
+	unsigned int	num_changed;
+	/* digest of the entries of the blocks handled, for --verify */
+	__u64		verify_sum, verify_count;
+	/* the directory of the last block, its generation, and whether it was renumbered */
+	ext2_ino_t	dir;
+	__u32		gen;
+	int		dir_moved;
+};
+
+static int copy_shard_entry(ext2_filsys fs EXT2FS_ATTR((unused)), struct ext2_db_entry2 *db_info, void *priv_data)
+{
+	struct dir_worker *w = priv_data;
+
+	w->shard[w->num++] = *db_info;
+	return 0;
+}
+
+/*the generation of dir, read from its itable block, for the checksums */
+static errcode_t dir_worker_set_dir(struct parallel_dir_rewrite *pd, struct dir_worker *w, ext2_ino_t dir)
+{
+	ext2_filsys fs = pd->rfs->old_fs;
+	__u64 offset = (__u64)((dir - 1) % fs->super->s_inodes_per_group) * EXT2_INODE_SIZE(fs->super);
+	errcode_t retval;
+
+	if (w->dir == dir)
+		return 0;
+	pthread_mutex_lock(&pd->lock);
+	w->dir_moved = !ext2fs_test_inode_bitmap2(pd->rfs->new_fs->inode_map, dir);
+	pthread_mutex_unlock(&pd->lock);
+	retval = bulk_io_read(pd->rfs, ext2fs_inode_table_loc(fs, (dir - 1) / fs->super->s_inodes_per_group) + offset / fs->blocksize, 1, w->inode_buf);
+	if (retval)
+		return retval;
+	w->gen = ((struct ext2_inode *)(w->inode_buf + offset % fs->blocksize))->i_generation;
+	w->dir = dir;
+	return 0;
+}
+
+/*
+ * Rewrite one directory block. *defer is set when the block must go
+ * through the serial path instead, nothing has been written then.
+ */
+static errcode_t rewrite_dir_block(struct parallel_dir_rewrite *pd, struct dir_worker *w, struct ext2_db_entry2 *ent, int *defer)
+{
+	ext2_resize_t rfs = pd->rfs;
+	ext2_filsys fs = rfs->old_fs;
+	int csum = ext2fs_has_feature_metadata_csum(fs->super);
+	struct ext2_dir_entry_tail *tail;
+	struct ext2_dir_entry *dirent;
+	unsigned int offset, rec_len, end = fs->blocksize;
+	ext2_ino_t new_inode;
+	__u64 verify_sum = 0, verify_count = 0;
+	int changed = 0;
+	errcode_t retval;
+
+	/*an extent tree block of the directory, skipped by the serial path as well */
+	*defer = ent->blockcnt >= 0;
+	if (ent->blockcnt < 0 || !ent->blk)
+		return 0;
+	retval = bulk_io_read(rfs, ent->blk, 1, w->buf);
+	if (retval)
+		return retval;
+	if (csum) {
+		tail = (struct ext2_dir_entry_tail *)(w->buf + fs->blocksize - sizeof(struct ext2_dir_entry_tail));
+		if (tail->det_reserved_zero1 || tail->det_rec_len != sizeof(struct ext2_dir_entry_tail) ||
+		    tail->det_reserved_name_len != EXT2_DIR_NAME_LEN_CSUM)
+			return 0;
+		end -= sizeof(struct ext2_dir_entry_tail);
+		retval = dir_worker_set_dir(pd, w, ent->ino);
+		if (retval)
+			return retval;
+	}
+
+	for (offset = 0; offset < end; offset += rec_len) {
+		dirent = (struct ext2_dir_entry *)(w->buf + offset);
+		if (ext2fs_get_rec_len(fs, dirent, &rec_len) || rec_len < 8 || rec_len % 4 ||
+		    offset + rec_len > end || (unsigned int)ext2fs_dirent_name_len(dirent) + 8 > rec_len)
+			return 0;
+		if (!dirent->inode)
+			continue;
+		new_inode = ext2fs_extent_translate(rfs->imap, dirent->inode);
+		if (new_inode) {
+			log_debug(RESIZE_DEBUG_INODEMAP, "Inode translate (dir=%u, name=%.*s, %u->%u)\n", ent->ino, ext2fs_dirent_name_len(dirent), dirent->name, dirent->inode, new_inode);
+			dirent->inode = new_inode;
+			changed = 1;
+		}
+		if (verify_mode) {
+			verify_sum += verify_dirent_hash(ent->ino, dirent);
+			verify_count++;
+		}
+	}
+	*defer = 0;
+	w->verify_sum += verify_sum;
+	w->verify_count += verify_count;
+
+	if (changed && (!w->num_changed || w->changed_dirs[w->num_changed - 1] != ent->ino))
+		w->changed_dirs[w->num_changed++] = ent->ino;
+	if (!changed && !(csum && w->dir_moved))
+		return 0;
+	if (csum)
+		csum_dir_block(fs, ent->ino, w->gen, w->buf);
+	return bulk_io_write(rfs, ent->blk, 1, w->buf);
+}
+
+/*merge the results of a shard, under the lock */
+static errcode_t merge_dir_shard(struct parallel_dir_rewrite *pd, struct dir_worker *w, unsigned int handled)
+{
+	ext2_resize_t rfs = pd->rfs;
+	ext2_ino_t *dirs;
+	unsigned long long size;
+
+	if (pd->num_changed + w->num_changed > pd->max_changed) {
+		size = (pd->max_changed + w->num_changed) * 2;
+		dirs = realloc(pd->changed_dirs, size * sizeof(ext2_ino_t));
+		if (!dirs)
+			return ENOMEM;
+		pd->changed_dirs = dirs;
+		pd->max_changed = size;
+	}
+	memcpy(pd->changed_dirs + pd->num_changed, w->changed_dirs, w->num_changed * sizeof(ext2_ino_t));
+	pd->num_changed += w->num_changed;
+	w->num_changed = 0;
+	if (verify_mode)
+		verify_add_dirents(w->verify_sum, w->verify_count);
+	w->verify_sum = w->verify_count = 0;
+
+	profile_add_items(handled);
+	pd->is->num += handled;
+	if (rfs->progress)
+		return (rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS, pd->is->num, pd->is->max_dirs);
+	return 0;
+}
+
+/*keep a block for the serial path, under the lock */
+static errcode_t defer_dir_block(struct parallel_dir_rewrite *pd, struct ext2_db_entry2 *ent)
+{
+	struct ext2_db_entry2 *list;
+	unsigned long long size;
+
+	if (pd->num_deferred == pd->max_deferred) {
+		size = pd->max_deferred ? pd->max_deferred * 2 : 64;
+		list = realloc(pd->deferred, size * sizeof(struct ext2_db_entry2));
+		if (!list)
+			return ENOMEM;
+		pd->deferred = list;
+		pd->max_deferred = size;
+	}
+	pd->deferred[pd->num_deferred++] = *ent;
+	return 0;
+}
+
+static void *dir_rewrite_worker(void *arg)
+{
+	struct parallel_dir_rewrite *pd = arg;
+	ext2_filsys fs = pd->rfs->old_fs;
+	struct dir_worker w;
+	unsigned long long start;
+	unsigned int i, handled;
+	int defer;
+	errcode_t retval;
+
+	memset(&w, 0, sizeof(w));
+	w.shard = malloc(DIR_SHARD_BLOCKS * sizeof(struct ext2_db_entry2));
+	w.changed_dirs = malloc(DIR_SHARD_BLOCKS * sizeof(ext2_ino_t));
+	retval = (w.shard && w.changed_dirs) ? 0 : ENOMEM;
+	if (!retval)
+		retval = bulk_io_get_buf(pd->rfs, fs->blocksize, &w.buf);
+	if (!retval)
+		retval = bulk_io_get_buf(pd->rfs, fs->blocksize, &w.inode_buf);
+
+	while (!retval) {
+		pthread_mutex_lock(&pd->lock);
+		if (pd->retval || pd->next >= pd->count) {
+			pthread_mutex_unlock(&pd->lock);
+			break;
+		}
+		start = pd->next;
+		pd->next += DIR_SHARD_BLOCKS;
+		pthread_mutex_unlock(&pd->lock);
+
+		w.num = 0;
+		if (pd->entries) {
+			w.num = pd->count - start < DIR_SHARD_BLOCKS ? pd->count - start : DIR_SHARD_BLOCKS;
+			memcpy(w.shard, pd->entries + start, w.num * sizeof(struct ext2_db_entry2));
+		} else {
+			ext2fs_dblist_iterate3(pd->dblist, copy_shard_entry, start, DIR_SHARD_BLOCKS, &w);
+		}
+		for (i = 0, handled = 0; !retval && i < w.num; i++) {
+			retval = rewrite_dir_block(pd, &w, &w.shard[i], &defer);
+			if (retval || !defer) {
+				handled++;
+				continue;
+			}
+			pthread_mutex_lock(&pd->lock);
+			retval = defer_dir_block(pd, &w.shard[i]);
+			pthread_mutex_unlock(&pd->lock);
+		}
+		pthread_mutex_lock(&pd->lock);
+		if (!retval)
+			retval = merge_dir_shard(pd, &w, handled);
+		pthread_mutex_unlock(&pd->lock);
+	}
+
+	if (retval) {
+		pthread_mutex_lock(&pd->lock);
+		if (!pd->retval)
+			pd->retval = retval;
+		pthread_mutex_unlock(&pd->lock);
+	}
+	free(w.shard);
+	free(w.changed_dirs);
+	if (w.buf)
+		ext2fs_free_mem(&w.buf);
+	if (w.inode_buf)
+		ext2fs_free_mem(&w.inode_buf);
+	return NULL;
+}
+
+static EXT2_QSORT_TYPE ino_cmp(const void *a, const void *b)
+{
+	ext2_ino_t ino_a = *(const ext2_ino_t *)a, ino_b = *(const ext2_ino_t *)b;
+
+	return ino_a < ino_b ? -1 : ino_a > ino_b;
+}
+
+/*update the mtime and ctime of each changed directory once */
+static errcode_t touch_changed_dirs(struct parallel_dir_rewrite *pd)
+{
+	ext2_resize_t rfs = pd->rfs;
+	struct ext2_inode inode;
+	unsigned long long i;
+	errcode_t retval;
+
+	qsort(pd->changed_dirs, pd->num_changed, sizeof(ext2_ino_t), ino_cmp);
+	for (i = 0; i < pd->num_changed; i++) {
+		if (i && pd->changed_dirs[i] == pd->changed_dirs[i - 1])
+			continue;
+		if (ext2fs_read_inode(rfs->old_fs, pd->changed_dirs[i], &inode))
+			continue;
+		inode.i_mtime = inode.i_ctime = rfs->new_fs->now ? rfs->new_fs->now : time(0);
+		retval = ext2fs_write_inode(rfs->old_fs, pd->changed_dirs[i], &inode);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/*the blocks of dblist, or the count entries of a sorted array if dblist is NULL */
+static errcode_t dir_rewrite_parallel(ext2_resize_t rfs, ext2_dblist dblist, struct ext2_db_entry2 *entries, unsigned long long count,
+				      struct istruct *is)
+{
+	struct parallel_dir_rewrite pd;
+	pthread_t *threads = NULL;
+	int i, started = 0;
+	errcode_t retval;
+
+	memset(&pd, 0, sizeof(pd));
+	pd.rfs = rfs;
+	pd.is = is;
+	pd.dblist = dblist;
+	pd.entries = entries;
+	pd.count = dblist ? ext2fs_dblist_count2(dblist) : count;
+	threads = calloc(migrate_threads, sizeof(pthread_t));
+	if (!threads)
+		return ENOMEM;
+
+	/*the workers only read the dblist and the map: sort them now */
+	if (dblist)
+		ext2fs_dblist_sort2(dblist, 0);
+	ext2fs_extent_translate(rfs->imap, 0);
+	/*the inode cache and the renumbered inodes must be on disk before the raw reads */
+	retval = ext2fs_flush_icache(rfs->old_fs);
+	if (!retval)
+		retval = io_channel_flush(rfs->old_fs->io);
+	if (retval)
+		goto errout;
+	/*initialize the crc32c engine before the workers use it */
+	csum_engine_name();
+
+	log_verbose("Rewriting %llu directory blocks with %d threads\n", pd.count, migrate_threads);
+	pthread_mutex_init(&pd.lock, NULL);
+	for (i = 0; i < migrate_threads; i++) {
+		if (pthread_create(&threads[i], NULL, dir_rewrite_worker, &pd))
+			break;
+		started++;
+	}
+	if (!started)
+		dir_rewrite_worker(&pd);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pd.lock);
+	retval = pd.retval;
+	if (!retval)
+		retval = touch_changed_dirs(&pd);
+	if (retval)
+		goto errout;
+
+	if (pd.num_deferred) {
+		log_verbose("%llu directory blocks left to the serial path\n", pd.num_deferred);
+		retval = dir_array_iterate(rfs, pd.deferred, pd.num_deferred, is);
+	}
+
+ errout:
+	free(pd.deferred);
+	free(pd.changed_dirs);
+	free(threads);
+	return retval;
+}
+#endif
+
+/*rewrite the directory blocks of dblist, with the workers of -t if there are several */
+static errcode_t dir_iterate(ext2_resize_t rfs, ext2_dblist dblist, struct istruct *is)
+{
+#if defined(HAVE_PTHREAD_H) && !defined(WORDS_BIGENDIAN)
+	if (migrate_threads > 1)
+		return dir_rewrite_parallel(rfs, dblist, NULL, 0, is);
+#endif
+	readahead_dblist_init(&is->ra, rfs->old_fs, dblist);
+	return ext2fs_dblist_dir_iterate(dblist, DIRENT_FLAG_INCLUDE_EMPTY, 0, check_and_change_inodes, is);
+}
+
+/*walk the directory blocks spilled to disk in the order of the disk, straight from the mapping */
+static errcode_t spilled_dir_iterate(ext2_resize_t rfs, struct istruct *is)
+{
+	struct ext2_db_entry2 *entries = spill_dblist_sort(&rfs->dir_blocks);
+
+	if (!entries)
+		return 0;
+#if defined(HAVE_PTHREAD_H) && !defined(WORDS_BIGENDIAN)
+	if (migrate_threads > 1)
+		return dir_rewrite_parallel(rfs, NULL, entries, rfs->dir_blocks.num, is);
+#endif
+	return dir_array_iterate(rfs, entries, rfs->dir_blocks.num, is);
+}
+
 static errcode_t inode_ref_fix(ext2_resize_t rfs)
 {
 	errcode_t retval;
 	struct istruct is;
 
-	if (!rfs->imap)
+	if (!rfs->imap) {
+		spill_dblist_free(&rfs->dir_blocks);
 		return 0;
+	}
 
 	/*
 	 * Now, we iterate over all of the directories to update the
 	 * inode references
 	 */
 	is.num = 0;
-	is.max_dirs = ext2fs_dblist_count2(rfs->old_fs->dblist);
+	is.max_dirs = spill_dir ? rfs->dir_blocks.num : ext2fs_dblist_count2(rfs->old_fs->dblist);
 	is.rfs = rfs;
 	is.err = 0;
 
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_INODE_REF_UPD_PASS, 0, is.max_dirs);
+		if (retval)
+			goto errout;
+	}
+
 	rfs->old_fs->flags |= EXT2_FLAG_IGNORE_CSUM_ERRORS;
-	retval = ext2fs_dblist_dir_iterate(rfs->old_fs->dblist, DIRENT_FLAG_INCLUDE_EMPTY, 0, check_and_change_inodes, &is);
+	if (spill_dir)
+		retval = spilled_dir_iterate(rfs, &is);
+	else
+		retval = dir_iterate(rfs, rfs->old_fs->dblist, &is);
 	rfs->old_fs->flags &= ~EXT2_FLAG_IGNORE_CSUM_ERRORS;
 	if (retval)
 		goto errout;
@@ -323,10 +796,20 @@ static errcode_t inode_ref_fix(ext2_resize_t rfs)
  errout:
 	ext2fs_free_extent_table(rfs->imap);
 	rfs->imap = 0;
+	mem_account("inode relocation map", 0);
+	spill_dblist_free(&rfs->dir_blocks);
 	return retval;
 }
 
-static int feed_dblist(ext2_filsys fs, blk64_t *block_nr, e2_blkcnt_t blockcnt, blk64_t ref_block EXT2FS_ATTR((unused)), int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
+/*with --spill-dir, the directory blocks go to disk instead of old_fs->dblist */
+static errcode_t add_dir_block(ext2_resize_t rfs, ext2_ino_t ino, blk64_t blk, e2_blkcnt_t blockcnt)
+{
+	if (spill_dir)
+		return spill_dblist_add(&rfs->dir_blocks, ino, blk, blockcnt);
+	return ext2fs_add_dir_block2(rfs->old_fs->dblist, ino, blk, (int)blockcnt);
+}
+
+static int feed_dblist(ext2_filsys fs EXT2FS_ATTR((unused)), blk64_t *block_nr, e2_blkcnt_t blockcnt, blk64_t ref_block EXT2FS_ATTR((unused)), int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
 {
 	struct process_block_struct *pb;
 	errcode_t retval;
@@ -337,7 +820,7 @@ static int feed_dblist(ext2_filsys fs, blk64_t *block_nr, e2_blkcnt_t blockcnt,
 	block = *block_nr;
 
 	if (pb->is_dir) {
-		retval = ext2fs_add_dir_block2(fs->dblist, pb->ino, block, (int)blockcnt);
+		retval = add_dir_block(pb->rfs, pb->ino, block, blockcnt);
 		if (retval) {
 			pb->error = retval;
 			ret |= BLOCK_ABORT;
@@ -346,10 +829,30 @@ static int feed_dblist(ext2_filsys fs, blk64_t *block_nr, e2_blkcnt_t blockcnt,
 	return ret;
 }
 
+static errcode_t progress_callback(ext2_filsys fs, ext2_inode_scan scan EXT2FS_ATTR((unused)), dgrp_t group, void *priv_data)
+{
+	ext2_resize_t rfs = (ext2_resize_t) priv_data;
+	errcode_t retval;
+
+	/*
+	 * This check is to protect against old ext2 libraries.  It
+	 * shouldn't be needed against new libraries.
+	 */
+	if ((group + 1) == 0)
+		return 0;
+
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_INODE_SCAN_PASS, group + 1, fs->group_desc_count);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
 static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 {
 	struct process_block_struct pb;
-	ext2_ino_t ino, new_inode;
+	ext2_ino_t ino, new_inode, ra_next = 1, ra_first, ra_last;
 	struct ext2_inode *inode = NULL;
 	ext2_inode_scan scan = NULL;
 	errcode_t retval;
@@ -366,9 +869,18 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 	if (retval)
 		goto errout;
 
-	retval = ext2fs_init_dblist(rfs->old_fs, 0);
-	if (retval)
-		goto errout;
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_INODE_SCAN_PASS, 0, rfs->old_fs->group_desc_count);
+		if (retval)
+			goto errout;
+	}
+	ext2fs_set_inode_callback(scan, progress_callback, (void *)rfs);
+
+	if (!spill_dir) {
+		retval = ext2fs_init_dblist(rfs->old_fs, 0);
+		if (retval)
+			goto errout;
+	}
 	retval = ext2fs_get_array(rfs->old_fs->blocksize, 3, &block_buf);
 	if (retval)
 		goto errout;
@@ -407,9 +919,13 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 		if (!ino)
 			break;
 
+		if (readahead_inode_window(rfs->old_fs, ino, &ra_next, &ra_first, &ra_last))
+			readahead_inodes(rfs->old_fs, ra_first, ra_last);
+
 		if (inode->i_links_count == 0 && ino != EXT2_RESIZE_INO)
 			continue;	/* inode not in use */
 
+		profile_add_items(1);
 		pb.is_dir = LINUX_S_ISDIR(inode->i_mode);
 		pb.changed = 0;
 
@@ -433,23 +949,25 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 		 */
 		if (inode->i_flags & EXT4_EA_INODE_FL) {
 			update_ea_inode_refs = 1;
-			printf("EA inode: old %u, new %u\n", ino, new_inode);
+			log_debug(RESIZE_DEBUG_INODEMAP, "EA inode: old %u, new %u\n", ino, new_inode);
 		} else
 			inode->i_ctime = rfs->old_fs->now ? rfs->old_fs->now : time(0);
 
-		retval = ext2fs_write_inode_full(rfs->old_fs, new_inode, inode, inode_size);
+		retval = csum_write_inode(rfs->old_fs, new_inode, inode, inode_size);
 		if (retval)
 			goto errout;
 		pb.changed = 0;
 
-		printf("Inode moved %u->%u\n", ino, new_inode);
+		log_debug(RESIZE_DEBUG_INODEMAP, "Inode moved %u->%u\n", ino, new_inode);
 
 		if (!rfs->imap) {
 			retval = ext2fs_create_extent_table(&rfs->imap, 0);
 			if (retval)
 				goto errout;
 		}
-		ext2fs_add_extent_entry(rfs->imap, ino, new_inode);
+		retval = ext2fs_add_extent_entry(rfs->imap, ino, new_inode);
+		if (retval)
+			goto errout;
 
  remap_inodes:
 
@@ -462,6 +980,7 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 			pb.ino = new_inode;
 			pb.old_ino = ino;
 			pb.has_extents = inode->i_flags & EXT4_EXTENTS_FL;
+			readahead_extent_tree(rfs->old_fs, inode);
 			retval = ext2fs_block_iterate3(rfs->old_fs, new_inode, 0, block_buf, feed_dblist, &pb);
 			if (retval)
 				goto errout;
@@ -471,7 +990,7 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 			}
 		} else if ((inode->i_flags & EXT4_INLINE_DATA_FL) && (pb.is_dir)) {
 			/* inline data dir; update it too */
-			retval = ext2fs_add_dir_block2(rfs->old_fs->dblist, new_inode, 0, 0);
+			retval = add_dir_block(rfs, new_inode, 0, 0);
 			if (retval)
 				goto errout;
 		}
@@ -484,6 +1003,12 @@ static errcode_t inode_scan_and_fix(ext2_resize_t rfs)
 		}
 	}
 
+	if (rfs->imap)
+		mem_account("inode relocation map", ext2fs_extent_table_memory(rfs->imap));
+	/*with --spill-dir, it is in the page cache only */
+	if (!spill_dir)
+		mem_account("directory block list", ext2fs_dblist_count2(rfs->old_fs->dblist) * (unsigned long long)sizeof(struct ext2_db_entry2));
+
 	if (update_ea_inode_refs && ext2fs_has_feature_ea_inode(rfs->old_fs->super)) {
 		retval = fix_ea_inode_refs(rfs, inode, block_buf, start_to_move);
 		if (retval)
@@ -513,26 +1038,32 @@ static errcode_t reubicate_and_free_itables(ext2_resize_t rfs)
 	if (ext2fs_has_feature_flex_bg(rfs->new_fs->super)) {
 		flexbg_size = 1U << rfs->new_fs->super->s_log_groups_per_flex;
 		if (!rfs->itable_buf) {
-			retval = ext2fs_get_array(rfs->new_fs->blocksize, rfs->new_fs->inode_blocks_per_group, &rfs->itable_buf);
+			retval = bulk_io_get_buf(rfs, rfs->new_fs->blocksize * rfs->new_fs->inode_blocks_per_group, &rfs->itable_buf);
 			if (retval)
 				goto errout;
 
 			memset(rfs->itable_buf, 0, rfs->new_fs->blocksize * rfs->new_fs->inode_blocks_per_group);
+			mem_account("inode table buffer", (unsigned long long)rfs->new_fs->blocksize * rfs->new_fs->inode_blocks_per_group);
+		}
+		if (rfs->progress) {
+			retval = (rfs->progress)(rfs, E2_RSZ_MOVE_ITABLE_PASS, 0, rfs->new_fs->group_desc_count);
+			if (retval)
+				goto errout;
 		}
 		for (flexbg_i = 0; flexbg_i < rfs->new_fs->group_desc_count; flexbg_i += flexbg_size) {
 
 			after_prev_itable = ext2fs_inode_table_loc(rfs->old_fs, flexbg_i) + rfs->new_fs->inode_blocks_per_group;
 			for (group = flexbg_i + 1; group < flexbg_i + flexbg_size && group < rfs->new_fs->group_desc_count; group++) {
-				printf("group %u, after_prev_itable: %llu\n", group, after_prev_itable);
+				log_verbose("group %u, after_prev_itable: %llu\n", group, after_prev_itable);
 				if (ext2fs_inode_table_loc(rfs->old_fs, group - 1) + rfs->old_fs->inode_blocks_per_group == ext2fs_inode_table_loc(rfs->old_fs, group)) {
-					printf("moving itables, contiguous groups %u, %u, itables in %llu, %llu\n",
+					log_verbose("moving itables, contiguous groups %u, %u, itables in %llu, %llu\n",
 						group - 1, group, ext2fs_inode_table_loc(rfs->old_fs, group - 1), ext2fs_inode_table_loc(rfs->old_fs, group));
 
 					ext2fs_inode_table_loc_set(rfs->new_fs, group, after_prev_itable);
-					retval = io_channel_read_blk64(rfs->old_fs->io, ext2fs_inode_table_loc(rfs->old_fs, group), rfs->new_fs->inode_blocks_per_group, rfs->itable_buf);
+					retval = bulk_io_read(rfs, ext2fs_inode_table_loc(rfs->old_fs, group), rfs->new_fs->inode_blocks_per_group, rfs->itable_buf);
 					if (retval)
 						goto errout;
-					retval = io_channel_write_blk64(rfs->old_fs->io, after_prev_itable, rfs->new_fs->inode_blocks_per_group, rfs->itable_buf);
+					retval = bulk_io_write(rfs, after_prev_itable, rfs->new_fs->inode_blocks_per_group, rfs->itable_buf);
 					if (retval)
 						goto errout;
 
@@ -544,7 +1075,7 @@ static errcode_t reubicate_and_free_itables(ext2_resize_t rfs)
 					if (ext2fs_has_feature_bigalloc(rfs->new_fs->super))
 						tweak_values_for_bigalloc(rfs, &after_prev_itable, &itables_blocks_to_be_freed);
 					ext2fs_block_alloc_stats_range(rfs->new_fs, after_prev_itable, itables_blocks_to_be_freed, -1);
-					printf("partial continuity, unmarking %u blocks starting on itable %llu\n", itables_blocks_to_be_freed, after_prev_itable);
+					log_verbose("partial continuity, unmarking %u blocks starting on itable %llu\n", itables_blocks_to_be_freed, after_prev_itable);
 
 					after_prev_itable = ext2fs_inode_table_loc(rfs->old_fs, group) + rfs->new_fs->inode_blocks_per_group;
 				}
@@ -554,7 +1085,13 @@ static errcode_t reubicate_and_free_itables(ext2_resize_t rfs)
 			if (ext2fs_has_feature_bigalloc(rfs->new_fs->super))
 				tweak_values_for_bigalloc(rfs, &after_prev_itable, &itables_blocks_to_be_freed);
 			ext2fs_block_alloc_stats_range(rfs->new_fs, after_prev_itable, itables_blocks_to_be_freed, -1);
-			printf("full continuity, unmarking %u blocks starting on itable %llu\n", itables_blocks_to_be_freed, after_prev_itable);
+			log_verbose("full continuity, unmarking %u blocks starting on itable %llu\n", itables_blocks_to_be_freed, after_prev_itable);
+
+			if (rfs->progress) {
+				retval = (rfs->progress)(rfs, E2_RSZ_MOVE_ITABLE_PASS, group, rfs->new_fs->group_desc_count);
+				if (retval)
+					goto errout;
+			}
 
 		}
 	} else { /*no flex_bg */
@@ -609,6 +1146,7 @@ static errcode_t migrate_inodes_backwards_loop(ext2_resize_t rfs)
 {
 	ext2_ino_t ino;
 	struct ext2_inode *inode = NULL;
+	alloc_stats_batch_t stats = NULL;
 	errcode_t retval;
 	int inode_size = EXT2_INODE_SIZE(rfs->new_fs->super);
 
@@ -617,30 +1155,57 @@ static errcode_t migrate_inodes_backwards_loop(ext2_resize_t rfs)
 		retval = ENOMEM;
 		goto errout;
 	}
+	/*the group descriptors are updated once per group */
+	retval = alloc_stats_open(rfs->new_fs, &stats);
+	if (retval)
+		goto errout;
+
+	if (rfs->progress) {
+		retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, 0, rfs->new_fs->group_desc_count);
+		if (retval)
+			goto errout;
+	}
 
 	for (ino = rfs->new_fs->super->s_inodes_count; ino > 0; ino--) {
 
-		retval = ext2fs_read_inode2(rfs->old_fs, ino, inode, inode_size, 0);	/*we might use READ_INODE_NOCSUM instead of checking retval */
-		printf("Migrating inode %u to new itable: links_count: %u, i_size_lo: %u, i_blocks: %u, old group: %u, new group: %u, read_retval: %li",
+		/*the loop goes backwards, report the groups completed so far */
+		if (rfs->progress && (ino % rfs->new_fs->super->s_inodes_per_group) == 1) {
+			retval = (rfs->progress)(rfs, E2_RSZ_MIGRATE_INODES_PASS, rfs->new_fs->group_desc_count - ext2fs_group_of_ino(rfs->new_fs, ino), rfs->new_fs->group_desc_count);
+			if (retval)
+				goto errout;
+		}
+
+		retval = ext2fs_read_inode2(rfs->old_fs, ino, inode, inode_size, READ_INODE_NOCSUM);
+		log_debug(RESIZE_DEBUG_INODEMAP, "Migrating inode %u to new itable: links_count: %u, i_size_lo: %u, i_blocks: %u, old group: %u, new group: %u, read_retval: %li",
 			ino, inode->i_links_count, inode->i_size, inode->i_blocks, ext2fs_group_of_ino(rfs->old_fs, ino), ext2fs_group_of_ino(rfs->new_fs, ino), retval);
 		/*we require to run fsck before changing the inode count, and that will fix inode checksums on used inodes. However, an unused inode with a wrong
-		   checksum will not be detected by fsck. We don't want to stop the whole process now and leave a messy fs because of that, just log it and continue */
-		if (retval && retval != EXT2_ET_INODE_CSUM_INVALID)
+		   checksum will not be detected by fsck. We don't want to stop the whole process now because of that: the checksum is not verified here,
+		   and it is recomputed when the inode is written to the new itable */
+		if (retval)
 			goto errout;
 
 		if (inode->i_links_count != 0 || ino < EXT2_FIRST_INODE(rfs->new_fs->super)) {
-			ext2fs_inode_alloc_stats2(rfs->new_fs, ino, +1, LINUX_S_ISDIR(inode->i_mode));
+			retval = alloc_stats_inode(stats, ino, +1, LINUX_S_ISDIR(inode->i_mode));
+			if (retval)
+				goto errout;
 		}
 
 		/*if not in use, write the zeros from the inode to the itable anyway, as it may contain the previous inode */
-		retval = ext2fs_write_inode2(rfs->new_fs, ino, inode, inode_size, 0);
-		printf(" - write_retval: %li\n", retval);
+		retval = csum_write_inode(rfs->new_fs, ino, inode, inode_size);
+		log_debug(RESIZE_DEBUG_INODEMAP, " - write_retval: %li\n", retval);
 		if (retval)
 			goto errout;
 
+		profile_add_items(1);
+		if ((ino % rfs->new_fs->super->s_inodes_per_group) == 1) {
+			retval = alloc_stats_flush(stats);
+			if (retval)
+				goto errout;
+		}
 	}
 
  errout:
+	alloc_stats_close(&stats);
 	if (inode)
 		free(inode);
 
@@ -651,6 +1216,7 @@ static errcode_t inode_relocation_to_smaller_tables(ext2_resize_t rfs, unsigned
 {
 	errcode_t retval;
 	dgrp_t group;
+	int prof;
 
 	rfs->new_fs->super->s_inodes_per_group = new_inodes_per_group;
 	rfs->new_fs->inode_blocks_per_group = ext2fs_div_ceil(rfs->new_fs->super->s_inodes_per_group * rfs->new_fs->super->s_inode_size, rfs->new_fs->blocksize);
@@ -659,12 +1225,16 @@ static errcode_t inode_relocation_to_smaller_tables(ext2_resize_t rfs, unsigned
 	display_info(rfs);
 
 	printf("calling inode_scan_and_fix()\n");
+	prof = profile_begin("inode_scan_and_fix");
 	retval = inode_scan_and_fix(rfs);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 
 	printf("calling inode_ref_fix()\n");
+	prof = profile_begin("inode_ref_fix");
 	retval = inode_ref_fix(rfs);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 
@@ -678,12 +1248,16 @@ static errcode_t inode_relocation_to_smaller_tables(ext2_resize_t rfs, unsigned
 	rfs->new_fs->super->s_free_inodes_count = rfs->new_fs->super->s_inodes_count;
 
 	printf("calling migrate_inodes_backwards_loop()\n");
+	prof = profile_begin("migrate_inodes_backwards_loop");
 	retval = migrate_inodes_backwards_loop(rfs);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 
 	printf("calling reubicate_and_free_itables()\n");
+	prof = profile_begin("reubicate_and_free_itables");
 	retval = reubicate_and_free_itables(rfs);
+	profile_end(prof);
 	if (retval)
 		goto errout;
 
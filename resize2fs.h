@@ -83,6 +83,8 @@ typedef struct ext2_sim_progress *ext2_sim_progmeter;
 #define RESIZE_ENABLE_64BIT		0x0400
 #define RESIZE_DISABLE_64BIT		0x0800
 
+#define RESIZE_LAZY_ITABLE_INIT		0x1000
+
 /*
  * This structure is used for keeping track of how much resources have
  * been used for a particular resize2fs pass.
@@ -97,6 +99,17 @@ struct resource_track {
 	unsigned long long bytes_written;
 };
 
+/* disk-backed arrays, see spill.c */
+struct spill_map {
+	int		fd;
+	void		*addr;
+	__u64		bytes;
+};
+struct spill_dblist {
+	struct spill_map map;
+	__u64		num;
+};
+
 /*
  * The core state structure for the ext2 resizer
  */
@@ -112,6 +125,13 @@ struct ext2_resize_struct {
 	blk64_t		needed_blocks;
 	int		flags;
 	char		*itable_buf;
+	/* direct channel for the bulk copies, see bulk_io.c */
+	io_channel	bulk_io;
+	/* size of the journal to create again at the end, and of its fast commit area, see plan_journal_recreation() */
+	blk64_t		journal_blocks;
+	blk64_t		journal_fc_blocks;
+	/* directory blocks to rewrite, in place of old_fs->dblist with --spill-dir */
+	struct spill_dblist dir_blocks;
 
 	/*
 	 * For the block allocator
@@ -136,6 +156,7 @@ struct ext2_resize_struct {
 #define E2_RSZ_INODE_SCAN_PASS		3
 #define E2_RSZ_INODE_REF_UPD_PASS	4
 #define E2_RSZ_MOVE_ITABLE_PASS		5
+#define E2_RSZ_MIGRATE_INODES_PASS	6
 
 
 /* prototypes */
@@ -143,7 +164,12 @@ extern errcode_t increase_inode_count(ext2_filsys fs, int flags,
 			   errcode_t	(*progress)(ext2_resize_t rfs,
 					    int pass, unsigned long cur,
 					    unsigned long max), unsigned int new_inodes_per_group);
-					    
+extern int migrate_threads;
+extern errcode_t plan_itable_placement(ext2_filsys fs, unsigned int itable_blocks,
+				       ext2fs_block_bitmap *reserve_blocks, ext2fs_block_bitmap *move_blocks,
+				       blk64_t *free_in_itables, blk64_t *evicted, blk64_t *staged_blocks);
+extern errcode_t plan_itable_locations(ext2_filsys fs, unsigned int itable_blocks, blk64_t *planned_itable_loc);
+
 extern errcode_t reduce_inode_count(ext2_filsys fs, int flags,
 			   errcode_t	(*progress)(ext2_resize_t rfs,
 					    int pass, unsigned long cur,
@@ -163,11 +189,26 @@ extern errcode_t ext2fs_add_extent_entry(ext2_extent extent,
 					 __u64 old_loc, __u64 new_loc);
 extern __u64 ext2fs_extent_translate(ext2_extent extent, __u64 old_loc);
 extern void ext2fs_extent_dump(ext2_extent extent, FILE *out);
+extern __u64 ext2fs_extent_table_memory(ext2_extent extent);
 extern errcode_t ext2fs_iterate_extent(ext2_extent extent, __u64 *old_loc,
 				       __u64 *new_loc, __u64 *size);
 
 /* main.c */
 extern char *program_name;
+extern errcode_t calculate_new_inodes_per_group(ext2_filsys fs, int type_of_value, long long unsigned int value, unsigned int *ipg, int force);
+
+/* batch.c */
+struct batch_options {
+	int		force;
+	int		flags;
+	int		debug_flags;
+	int		verbosity;
+	int		profile;
+	const char	*log_dir;
+	int		max_jobs;
+	int		jobs_per_controller;
+};
+extern int batch_main(const char *manifest, struct batch_options *opts);
 
 
 /* resource_track.c */
@@ -176,6 +217,162 @@ extern void init_resource_track(struct resource_track *track, const char *desc,
 extern void print_resource_track(ext2_resize_t rfs,
 				 struct resource_track *track,
 				 io_channel channel);
+extern void profile_init(ext2_filsys fs);
+extern int profile_begin(const char *name);
+extern void profile_add_items(unsigned long long items);
+extern void profile_end(int token);
+extern errcode_t profile_write_json(const char *path, const char *device);
+
+/* csum.c */
+extern __u32 csum_crc32c(__u32 crc, const void *buf, size_t len);
+extern const char *csum_engine_name(void);
+extern errcode_t csum_write_inode(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, int bufsize);
+extern void csum_inode_record(ext2_filsys fs, ext2_ino_t ino, void *record);
+extern void csum_dir_block(ext2_filsys fs, ext2_ino_t dir, __u32 gen, void *block);
+
+/* alloc_stats.c */
+typedef struct alloc_stats_batch *alloc_stats_batch_t;
+extern errcode_t alloc_stats_open(ext2_filsys fs, alloc_stats_batch_t *ret);
+extern void alloc_stats_block(alloc_stats_batch_t batch, blk64_t blk, int inuse);
+extern void alloc_stats_block_range(alloc_stats_batch_t batch, blk64_t blk, blk_t num, int inuse);
+extern errcode_t alloc_stats_inode(alloc_stats_batch_t batch, ext2_ino_t ino, int inuse, int isdir);
+extern errcode_t alloc_stats_flush(alloc_stats_batch_t batch);
+extern errcode_t alloc_stats_close(alloc_stats_batch_t *ret);
+
+/* readahead.c */
+struct readahead_dblist {
+	ext2_filsys	fs;
+	ext2_dblist	dblist;
+	/* or a plain array of them */
+	struct ext2_db_entry2 *entries;
+	/* directory blocks consumed by the pass, requested, and in the list */
+	unsigned long long consumed;
+	unsigned long long next;
+	unsigned long long total;
+	/* run of contiguous blocks being collected */
+	blk64_t		run_start;
+	blk64_t		run_len;
+};
+#define READAHEAD_DEFAULT_DEPTH	1024
+extern unsigned long readahead_depth;
+extern void readahead_inodes(ext2_filsys fs, ext2_ino_t first, ext2_ino_t last);
+extern int readahead_inode_window(ext2_filsys fs, ext2_ino_t ino, ext2_ino_t *next, ext2_ino_t *first, ext2_ino_t *last);
+extern void readahead_extent_tree(ext2_filsys fs, struct ext2_inode *inode);
+extern void readahead_dblist_init(struct readahead_dblist *ra, ext2_filsys fs, ext2_dblist dblist);
+extern void readahead_dblist_init_array(struct readahead_dblist *ra, ext2_filsys fs, struct ext2_db_entry2 *entries, unsigned long long count);
+extern void readahead_dblist_advance(struct readahead_dblist *ra);
+
+/* spill.c */
+extern const char *spill_dir;
+extern errcode_t spill_map_open(struct spill_map *map, const void *init, __u64 bytes);
+extern errcode_t spill_map_resize(struct spill_map *map, __u64 bytes);
+extern void spill_map_close(struct spill_map *map);
+extern void spill_map_sequential(struct spill_map *map);
+extern void spill_map_random(struct spill_map *map);
+extern int spill_wanted(__u64 bytes);
+extern errcode_t spill_dblist_add(struct spill_dblist *list, ext2_ino_t ino, blk64_t blk, e2_blkcnt_t blockcnt);
+extern struct ext2_db_entry2 *spill_dblist_sort(struct spill_dblist *list);
+extern void spill_dblist_free(struct spill_dblist *list);
+
+/* verify.c */
+extern int verify_mode;
+extern errcode_t verify_begin(ext2_filsys fs);
+extern errcode_t verify_record_blocks(blk64_t blk, int count, const void *buf, int blocksize);
+extern errcode_t verify_forget_block(blk64_t blk);
+extern void verify_new_pass(void);
+extern errcode_t verify_moved_blocks(blk64_t blk, blk64_t count);
+extern __u64 verify_dirent_hash(ext2_ino_t dir, struct ext2_dir_entry *dirent);
+extern void verify_add_dirents(__u64 sum, __u64 count);
+extern void verify_record_dirent(ext2_ino_t dir, struct ext2_dir_entry *dirent);
+extern errcode_t verify_check(const char *device_name, const char *io_options);
+
+/* cache_io.c */
+#define CACHE_IO_DEFAULT_SIZE	(256ULL << 20)
+extern io_manager cache_io_manager;
+extern unsigned long long cache_io_size;
+extern errcode_t set_cache_io_backing_manager(io_manager manager);
+extern errcode_t cache_io_resize(io_channel channel, unsigned long long size);
+extern errcode_t cache_io_sync_range(io_channel channel, blk64_t blk, blk64_t count);
+extern void cache_io_invalidate(io_channel channel, blk64_t blk, blk64_t count);
+extern void cache_io_report(void);
+
+/* bulk_io.c */
+extern int bulk_direct_io;
+extern errcode_t bulk_io_open(ext2_resize_t rfs);
+extern errcode_t bulk_io_close(ext2_resize_t rfs);
+extern errcode_t bulk_io_get_buf(ext2_resize_t rfs, unsigned long size, void *ptr);
+extern errcode_t bulk_io_read(ext2_resize_t rfs, blk64_t blk, int count, void *buf);
+extern errcode_t bulk_io_write(ext2_resize_t rfs, blk64_t blk, int count, const void *buf);
+extern errcode_t bulk_io_zero(ext2_resize_t rfs, blk64_t blk, blk64_t count);
+
+/* feasibility.c */
+struct increase_feasibility {
+	unsigned int	itable_blocks;		/* new inode_blocks_per_group */
+	int		placed;			/* a place was found for every new itable */
+	int		feasible;		/* placed, and enough free blocks */
+	blk64_t		free_in_itables;	/* free blocks covered by the new itables */
+	blk64_t		evicted;		/* data blocks to relocate */
+	blk64_t		staged;			/* blocks of old itables copied aside */
+	blk64_t		fragments;		/* runs of relocated blocks */
+	blk64_t		extent_blocks;		/* new extent tree blocks */
+	blk64_t		min_free;		/* free blocks needed by the increase */
+};
+
+extern errcode_t increase_extent_blocks(ext2_filsys fs, ext2fs_block_bitmap reserve_blocks, ext2fs_block_bitmap move_blocks,
+				       int exact, blk64_t *fragments, blk64_t *extent_blocks);
+extern errcode_t increase_feasibility(ext2_filsys fs, unsigned int itable_blocks, int exact,
+				      struct increase_feasibility *res);
+extern errcode_t increase_max_itable_blocks(ext2_filsys fs, unsigned int max_blocks, unsigned int *ret);
+
+/* plan_file.c */
+extern const char *plan_file;
+extern errcode_t plan_save(ext2_filsys fs, unsigned int new_inodes_per_group, const char *path);
+extern errcode_t plan_load(ext2_filsys fs, unsigned int new_inodes_per_group, const char *path,
+			   blk64_t *planned_itable_loc);
+
+/* memory.c */
+extern unsigned long long mem_limit;
+extern void mem_account(const char *name, unsigned long long bytes);
+extern void mem_report(void);
+extern unsigned long long mem_plan_bitmaps(ext2_filsys fs);
+extern errcode_t mem_read_bitmaps(ext2_filsys fs);
+extern void mem_account_dup_handle(void);
+extern unsigned long long mem_plan_cache(unsigned long long estimate);
+extern errcode_t mem_check_budget(ext2_filsys fs);
+
+/* log.c */
+#define RESIZE_LOG_ERROR		0
+#define RESIZE_LOG_INFO			1
+#define RESIZE_LOG_VERBOSE		2
+
+extern int log_level;
+extern int log_debug_flags;
+extern void log_init(void);
+extern void log_setup(int level, int debug_flags);
+extern void log_printf(const char *fmt, ...)
+	__attribute__ ((format (printf, 1, 2)));
+extern void log_flush(void);
+
+/*
+ * The arguments are not evaluated when the message is disabled.
+ * log_debug() prints per-item traces for the subsystems selected with
+ * the RESIZE_DEBUG_* flags (-d), it is compiled out with --disable-debug-log
+ */
+#define log_verbose(...)						\
+	do {								\
+		if (log_level >= RESIZE_LOG_VERBOSE)			\
+			log_printf(__VA_ARGS__);			\
+	} while (0)
+
+#ifdef DISABLE_DEBUG_LOG
+#define log_debug(subsys, ...)	do { } while (0)
+#else
+#define log_debug(subsys, ...)						\
+	do {								\
+		if (log_debug_flags & (subsys))				\
+			log_printf(__VA_ARGS__);			\
+	} while (0)
+#endif
 
 /* sim_progress.c */
 extern errcode_t ext2fs_progress_init(ext2_sim_progmeter *ret_prog,
@@ -184,6 +381,8 @@ extern errcode_t ext2fs_progress_init(ext2_sim_progmeter *ret_prog,
 				      __u32 maxdone, int flags);
 extern void ext2fs_progress_update(ext2_sim_progmeter prog,
 					__u32 current);
+extern void ext2fs_progress_info(ext2_sim_progmeter prog,
+				 const char *info);
 extern void ext2fs_progress_close(ext2_sim_progmeter prog);
 
 
@@ -207,6 +406,8 @@ struct process_block_struct {
 errcode_t mark_table_blocks(ext2_filsys fs, ext2fs_block_bitmap bmap);
 errcode_t tweak_values_for_bigalloc(ext2_resize_t rfs, blk64_t *first_block, unsigned int *num_blocks);
 void display_info(ext2_resize_t rfs);
+errcode_t dup_fs_handle(ext2_filsys fs, ext2_filsys *ret);
+void unshare_block_map(ext2_filsys keep, ext2_filsys drop);
 
 
 /* Some bigalloc helper macros which are more succinct... */
@@ -70,7 +70,7 @@ errcode_t tweak_values_for_bigalloc(ext2_resize_t rfs, blk64_t *first_block, uns
 
 	start = *first_block;
 	end = *first_block + *num_blocks - 1;
-	printf("tweak_values_for_bigalloc: before values: first_block: %llu, num_blocks %u, end %llu\n", *first_block, *num_blocks, end);
+	log_debug(RESIZE_DEBUG_ITABLEMOVE, "tweak_values_for_bigalloc: before values: first_block: %llu, num_blocks %u, end %llu\n", *first_block, *num_blocks, end);
 
 	/*If the first block to free is not aligned with the beginning of the cluster, we will move it to the beginning of the next cluster. */
 	if (start % cluster_size) {
@@ -97,10 +97,41 @@ errcode_t tweak_values_for_bigalloc(ext2_resize_t rfs, blk64_t *first_block, uns
 		else
 			*num_blocks -= cluster_size;
 	}
-	printf("tweak_values_for_bigalloc: after values: first_block: %llu, num_blocks %u, end %llu\n", *first_block, *num_blocks, *first_block + *num_blocks - 1);
+	log_debug(RESIZE_DEBUG_ITABLEMOVE, "tweak_values_for_bigalloc: after values: first_block: %llu, num_blocks %u, end %llu\n", *first_block, *num_blocks, *first_block + *num_blocks - 1);
 
 }
 
+/*
+ * Duplicate the handle of fs for the new layout. Each handle keeps its
+ * group descriptors, as the itable locations and the inode counts differ,
+ * and its inode bitmap, numbered differently. The block bitmap is shared:
+ * a block allocated or freed through either handle is seen by the other,
+ * and only the counters of the new fs, which is written at the end, need
+ * to be kept up to date.
+ */
+errcode_t dup_fs_handle(ext2_filsys fs, ext2_filsys *ret)
+{
+	ext2fs_block_bitmap block_map = fs->block_map;
+	errcode_t retval;
+
+	/*don't let ext2fs_dup_handle() copy it*/
+	fs->block_map = NULL;
+	retval = ext2fs_dup_handle(fs, ret);
+	fs->block_map = block_map;
+	if (retval)
+		return retval;
+	(*ret)->block_map = block_map;
+	mem_account_dup_handle();
+	return 0;
+}
+
+/*before freeing drop, so that the shared block bitmap is only freed with keep*/
+void unshare_block_map(ext2_filsys keep, ext2_filsys drop)
+{
+	if (keep && drop && keep->block_map == drop->block_map)
+		drop->block_map = NULL;
+}
+
 void display_info(ext2_resize_t rfs)
 {
 
@@ -126,5 +157,7 @@ void display_info(ext2_resize_t rfs)
 	printf("new_fs->cluster_ratio_bits: %u\n", rfs->new_fs->cluster_ratio_bits);
 	printf("new_fs->super->s_first_meta_bg: %u\n", rfs->new_fs->super->s_first_meta_bg);
 	printf("EXT2_DESC_PER_BLOCK(fs->super): %u\n", EXT2_DESC_PER_BLOCK(rfs->new_fs->super));
+	if (ext2fs_has_feature_metadata_csum(rfs->new_fs->super))
+		printf("crc32c engine: %s\n", csum_engine_name());
 
 }
@@ -17,6 +17,7 @@
 #include <malloc.h>
 #endif
 #include <sys/resource.h>
+#include <fcntl.h>
 
 void init_resource_track(struct resource_track *track, const char *desc,
 			 io_channel channel)
@@ -133,3 +134,251 @@ skip_io:
 	fflush(stdout);
 }
 
+
+/*
+ * Hierarchical phase profiler
+ *
+ * Phases are opened with profile_begin() and closed with profile_end().
+ * Phases with the same name under the same parent (e.g. the per-group
+ * work) are accumulated in the same node. The whole tree is written as
+ * JSON by profile_write_json().
+ */
+#define PROFILE_MAX_NODES	256
+#define PROFILE_MAX_DEPTH	16
+
+struct profile_node {
+	const char	*name;
+	int		parent;
+	unsigned long	calls;
+	double		wall, user, sys, wall_max;
+	long		peak_rss_kb;
+	unsigned long long bytes_read, bytes_written;
+	unsigned long long read_reqs, write_reqs;
+	unsigned long long items;
+};
+
+struct profile_frame {
+	int			node;
+	struct resource_track	track;
+	unsigned long long	read_reqs, write_reqs;
+	unsigned long long	samples;
+};
+
+static struct {
+	int			enabled;
+	io_channel		channel;
+	unsigned int		blocksize, group_desc_count, inodes_count, used_inodes;
+	unsigned long long	blocks_count;
+	int			num_nodes;
+	struct profile_node	nodes[PROFILE_MAX_NODES];
+	int			depth;
+	struct profile_frame	stack[PROFILE_MAX_DEPTH];
+	unsigned long long	io_samples;
+} profile;
+
+/*
+ * Number of read and write syscalls done so far, as an approximation of
+ * the I/O requests sent to the device. The file is read with a single
+ * read(), which only shows up in the next sample: profile_end() takes the
+ * samples out of the count using io_samples.
+ */
+static void get_io_requests(unsigned long long *reads, unsigned long long *writes)
+{
+	char buf[512], *p;
+	ssize_t len;
+	int fd;
+
+	*reads = *writes = 0;
+	fd = open("/proc/self/io", O_RDONLY);
+	if (fd < 0)
+		return;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	profile.io_samples++;
+	buf[len] = 0;
+	p = strstr(buf, "syscr:");
+	if (p)
+		*reads = strtoull(p + 6, NULL, 10);
+	p = strstr(buf, "syscw:");
+	if (p)
+		*writes = strtoull(p + 6, NULL, 10);
+}
+
+void profile_init(ext2_filsys fs)
+{
+	memset(&profile, 0, sizeof(profile));
+	profile.enabled = 1;
+	profile.channel = fs->io;
+	profile.blocksize = fs->blocksize;
+	profile.blocks_count = ext2fs_blocks_count(fs->super);
+	profile.group_desc_count = fs->group_desc_count;
+	profile.inodes_count = fs->super->s_inodes_count;
+	profile.used_inodes = fs->super->s_inodes_count - fs->super->s_free_inodes_count;
+}
+
+static int profile_find_node(const char *name, int parent)
+{
+	int i;
+
+	for (i = 0; i < profile.num_nodes; i++)
+		if (profile.nodes[i].parent == parent && !strcmp(profile.nodes[i].name, name))
+			return i;
+	if (profile.num_nodes == PROFILE_MAX_NODES)
+		return -1;
+	i = profile.num_nodes++;
+	memset(&profile.nodes[i], 0, sizeof(struct profile_node));
+	profile.nodes[i].name = name;
+	profile.nodes[i].parent = parent;
+	return i;
+}
+
+/*
+ * Returns a token to be given to profile_end(): it closes this phase
+ * and any inner phase left open by an error path
+ */
+int profile_begin(const char *name)
+{
+	struct profile_frame *frame;
+	int parent, node;
+
+	if (!profile.enabled)
+		return 0;
+	if (profile.depth == PROFILE_MAX_DEPTH)
+		return profile.depth;
+	parent = profile.depth ? profile.stack[profile.depth - 1].node : -1;
+	node = profile_find_node(name, parent);
+	if (node < 0)
+		return profile.depth;
+
+	frame = &profile.stack[profile.depth];
+	frame->node = node;
+	init_resource_track(&frame->track, name, profile.channel);
+	get_io_requests(&frame->read_reqs, &frame->write_reqs);
+	frame->samples = profile.io_samples;
+	return profile.depth++;
+}
+
+void profile_add_items(unsigned long long items)
+{
+	if (profile.enabled && profile.depth)
+		profile.nodes[profile.stack[profile.depth - 1].node].items += items;
+}
+
+void profile_end(int token)
+{
+	struct profile_frame *frame;
+	struct profile_node *node;
+	struct timeval time_end;
+	struct rusage r;
+	unsigned long long reads, writes, own;
+	io_stats stats = 0;
+	double wall;
+
+	if (!profile.enabled)
+		return;
+	while (profile.depth > token) {
+		frame = &profile.stack[--profile.depth];
+		node = &profile.nodes[frame->node];
+
+		gettimeofday(&time_end, 0);
+		wall = timeval_subtract(&time_end, &frame->track.time_start);
+		node->calls++;
+		node->wall += wall;
+		if (wall > node->wall_max)
+			node->wall_max = wall;
+		memset(&r, 0, sizeof(struct rusage));
+		if (getrusage(RUSAGE_SELF, &r) == 0) {
+			node->user += timeval_subtract(&r.ru_utime, &frame->track.user_start);
+			node->sys += timeval_subtract(&r.ru_stime, &frame->track.system_start);
+			if (r.ru_maxrss > node->peak_rss_kb)
+				node->peak_rss_kb = r.ru_maxrss;
+		}
+		if (profile.channel && profile.channel->manager && profile.channel->manager->get_stats)
+			profile.channel->manager->get_stats(profile.channel, &stats);
+		if (stats) {
+			node->bytes_read += stats->bytes_read - frame->track.bytes_read;
+			node->bytes_written += stats->bytes_written - frame->track.bytes_written;
+		}
+		/* the samples taken since the one of profile_begin(), included */
+		own = profile.io_samples - frame->samples + 1;
+		get_io_requests(&reads, &writes);
+		if (reads >= frame->read_reqs + own)
+			node->read_reqs += reads - frame->read_reqs - own;
+		node->write_reqs += writes - frame->write_reqs;
+	}
+}
+
+static void profile_write_node(FILE *f, int idx, int indent)
+{
+	struct profile_node *node = &profile.nodes[idx];
+	int i, first = 1;
+
+	fprintf(f, "%*s{\"name\": \"%s\", \"calls\": %lu, \"wall\": %.6f, \"wall_max\": %.6f, "
+		"\"user\": %.6f, \"sys\": %.6f, \"peak_rss_kb\": %ld, "
+		"\"bytes_read\": %llu, \"bytes_written\": %llu, "
+		"\"read_requests\": %llu, \"write_requests\": %llu, \"items\": %llu, \"children\": [",
+		indent, "", node->name, node->calls, node->wall, node->wall_max,
+		node->user, node->sys, node->peak_rss_kb,
+		node->bytes_read, node->bytes_written,
+		node->read_reqs, node->write_reqs, node->items);
+	for (i = idx + 1; i < profile.num_nodes; i++) {
+		if (profile.nodes[i].parent != idx)
+			continue;
+		fprintf(f, "%s\n", first ? "" : ",");
+		profile_write_node(f, i, indent + 2);
+		first = 0;
+	}
+	if (!first)
+		fprintf(f, "\n%*s", indent, "");
+	fprintf(f, "]}");
+}
+
+/*
+ * Write the profile, along with some information to compare runs across
+ * versions and hardware. Any phase left open is closed first, without
+ * I/O stats as the channel may be gone by now.
+ */
+errcode_t profile_write_json(const char *path, const char *device)
+{
+	FILE *f;
+	const char *lib_version, *lib_date;
+	char host[256];
+	int i, first = 1;
+
+	if (!profile.enabled)
+		return 0;
+	profile.channel = 0;
+	profile_end(0);
+
+	f = fopen(path, "w");
+	if (!f)
+		return errno;
+	if (gethostname(host, sizeof(host)))
+		strcpy(host, "unknown");
+	host[sizeof(host) - 1] = 0;
+	ext2fs_get_library_version(&lib_version, &lib_date);
+
+	fprintf(f, "{\n  \"tool_version\": \"%s\",\n  \"libext2fs_version\": \"%s\",\n"
+		"  \"host\": \"%s\",\n  \"online_cpus\": %ld,\n  \"timestamp\": %ld,\n"
+		"  \"device\": \"%s\",\n",
+		PACKAGE_VERSION, lib_version, host, sysconf(_SC_NPROCESSORS_ONLN),
+		(long) time(0), device ? device : "");
+	fprintf(f, "  \"blocksize\": %u,\n  \"blocks_count\": %llu,\n  \"group_desc_count\": %u,\n"
+		"  \"inodes_count\": %u,\n  \"used_inodes\": %u,\n",
+		profile.blocksize, profile.blocks_count, profile.group_desc_count,
+		profile.inodes_count, profile.used_inodes);
+	fprintf(f, "  \"phases\": [");
+	for (i = 0; i < profile.num_nodes; i++) {
+		if (profile.nodes[i].parent != -1)
+			continue;
+		fprintf(f, "%s\n", first ? "" : ",");
+		profile_write_node(f, i, 4);
+		first = 0;
+	}
+	fprintf(f, "\n  ]\n}\n");
+	if (fclose(f))
+		return errno;
+	return 0;
+}
@@ -24,6 +24,7 @@ struct ext2_sim_progress {
 	__u32	current;
 	int	shown;
 	int	flags;
+	int	infowidth;
 };
 
 static errcode_t ext2fs_progress_display(ext2_sim_progmeter prog)
@@ -75,6 +76,31 @@ void ext2fs_progress_update(ext2_sim_progmeter prog, __u32 current)
 	fflush(prog->f);
 }
 
+/*
+ * Show some text (rate, ETA...) after the bar, keeping the cursor
+ * where ext2fs_progress_update() expects it.
+ */
+void ext2fs_progress_info(ext2_sim_progmeter prog, const char *info)
+{
+	int	i, level, len, num;
+
+	level = prog->barwidth * prog->current / prog->maxdone;
+	if (level > prog->barwidth)
+		level = prog->barwidth;
+	for (i = level; i < prog->barwidth; i++)
+		putc('-', prog->f);
+	len = fprintf(prog->f, " %s", info);
+	if (len < 0)
+		len = 0;
+	for (i = len; i < prog->infowidth; i++)
+		putc(' ', prog->f);
+	num = prog->barwidth - level + (len > prog->infowidth ? len : prog->infowidth);
+	prog->infowidth = len;
+	for (i = 0; i < num; i++)
+		putc('\b', prog->f);
+	fflush(prog->f);
+}
+
 errcode_t ext2fs_progress_init(ext2_sim_progmeter *ret_prog,
 			       const char *label,
 			       int labelwidth, int barwidth,
@@ -100,6 +126,7 @@ errcode_t ext2fs_progress_init(ext2_sim_progmeter *ret_prog,
 	prog->maxdone = maxdone;
 	prog->current = 0;
 	prog->shown = 0;
+	prog->infowidth = 0;
 	prog->f = stdout;
 
 	*ret_prog = prog;
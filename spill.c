@@ -0,0 +1,179 @@
+/*
+ * spill.c --- disk-backed arrays for the biggest relocation structures
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * On the largest filesystems, the block and inode relocation maps of
+ * extent.c and the list of the directory blocks to rewrite of the reduce
+ * path can outgrow the memory. With --spill-dir, once they pass 1 MiB
+ * they are moved to an unlinked file of that directory and mapped in
+ * memory: the kernel keeps the pages in use and writes back the others.
+ * The directory block list is sorted and walked in place, one page after
+ * the other; the relocation maps are searched at random once sorted.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+#include <limits.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+const char *spill_dir;
+
+/*growth of a mapped array, not to call ftruncate() and mmap() for each entry */
+#define SPILL_MIN_BYTES		(1ULL << 20)
+
+/*
+ * Create the backing file of map, and map its first bytes, initialized
+ * from init when given
+ */
+errcode_t spill_map_open(struct spill_map *map, const void *init, __u64 bytes)
+{
+	char path[PATH_MAX];
+	errcode_t retval;
+	int fd;
+
+	map->fd = -1;
+	map->addr = NULL;
+	map->bytes = 0;
+	if (!spill_dir)
+		return EINVAL;
+	snprintf(path, sizeof(path), "%s/inode_count_modifier.XXXXXX", spill_dir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		retval = errno;
+		printf("spill_map_open: unable to create a file in %s: %s\n", spill_dir, strerror(errno));
+		return retval;
+	}
+	/*nothing to clean up if the run is interrupted */
+	unlink(path);
+	map->fd = fd;
+
+	retval = spill_map_resize(map, bytes);
+	if (retval) {
+		spill_map_close(map);
+		return retval;
+	}
+	if (init)
+		memcpy(map->addr, init, bytes);
+	log_verbose("Spilling %llu KiB to %s\n", (unsigned long long)bytes >> 10, spill_dir);
+	return 0;
+}
+
+/*
+ * Grow the file to bytes and map it again, the content is kept by the
+ * file. On failure, the previous mapping is left in place.
+ */
+errcode_t spill_map_resize(struct spill_map *map, __u64 bytes)
+{
+	void *addr;
+
+	if (bytes < SPILL_MIN_BYTES)
+		bytes = SPILL_MIN_BYTES;
+	if (ftruncate(map->fd, bytes) < 0)
+		return errno;
+	addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+	if (addr == MAP_FAILED)
+		return errno;
+	if (map->addr)
+		munmap(map->addr, map->bytes);
+	map->addr = addr;
+	map->bytes = bytes;
+	return 0;
+}
+
+void spill_map_close(struct spill_map *map)
+{
+	if (map->addr)
+		munmap(map->addr, map->bytes);
+	if (map->fd >= 0)
+		close(map->fd);
+	map->addr = NULL;
+	map->bytes = 0;
+	map->fd = -1;
+}
+
+/*tell the kernel that the map is now read in order, it can read ahead and drop behind */
+void spill_map_sequential(struct spill_map *map)
+{
+	if (map->addr)
+		madvise(map->addr, map->bytes, MADV_SEQUENTIAL);
+}
+
+/*or that it is searched, in no particular order */
+void spill_map_random(struct spill_map *map)
+{
+	if (map->addr)
+		madvise(map->addr, map->bytes, MADV_RANDOM);
+}
+
+/*
+ * Should a table of bytes bytes in memory move to disk before growing
+ */
+int spill_wanted(__u64 bytes)
+{
+	return spill_dir && bytes >= SPILL_MIN_BYTES;
+}
+
+/*
+ * Directory block list of the reduce path, in place of fs->dblist
+ */
+errcode_t spill_dblist_add(struct spill_dblist *list, ext2_ino_t ino, blk64_t blk, e2_blkcnt_t blockcnt)
+{
+	struct ext2_db_entry2 *ent;
+	errcode_t retval;
+
+	if (!list->map.addr) {
+		retval = spill_map_open(&list->map, NULL, SPILL_MIN_BYTES);
+		if (retval)
+			return retval;
+		list->num = 0;
+	}
+	if ((list->num + 1) * sizeof(struct ext2_db_entry2) > list->map.bytes) {
+		retval = spill_map_resize(&list->map, list->map.bytes * 2);
+		if (retval)
+			return retval;
+	}
+	ent = (struct ext2_db_entry2 *)list->map.addr + list->num++;
+	ent->ino = ino;
+	ent->blk = blk;
+	ent->blockcnt = blockcnt;
+	return 0;
+}
+
+/*the order of ext2fs_dblist_sort2(): by block, then by logical block */
+static EXT2_QSORT_TYPE dblist_cmp(const void *a, const void *b)
+{
+	const struct ext2_db_entry2 *db_a = a, *db_b = b;
+
+	if (db_a->blk != db_b->blk)
+		return db_a->blk < db_b->blk ? -1 : 1;
+	if (db_a->blockcnt != db_b->blockcnt)
+		return db_a->blockcnt < db_b->blockcnt ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort the list in place, in the order of ext2fs_dblist_sort2(), and return
+ * it: it is walked straight from the mapping, without a copy in memory
+ */
+struct ext2_db_entry2 *spill_dblist_sort(struct spill_dblist *list)
+{
+	if (!list->map.addr)
+		return NULL;
+	qsort(list->map.addr, list->num, sizeof(struct ext2_db_entry2), dblist_cmp);
+	spill_map_sequential(&list->map);
+	return list->map.addr;
+}
+
+void spill_dblist_free(struct spill_dblist *list)
+{
+	if (list->map.addr)
+		spill_map_close(&list->map);
+	list->num = 0;
+}
@@ -118,6 +118,14 @@ e2fsck -vf $image_file  || { echo 'test 4 failed' ; exit 1; }
 $path_to_bin -f -r 12345 $image_file > ${script_name}_output_test_5 || { echo 'modification 5 failed' ; exit 1; }
 e2fsck -vf $image_file  || { echo 'test 5 failed' ; exit 1; }
 
+# --verify on the iterative allocation, where a block relocated by one iteration may be moved again by the next
+$path_to_bin -r 16384 $image_file > ${script_name}_output_test_6 || { echo 'modification 6 failed' ; exit 1; }
+e2fsck -vf $image_file  || { echo 'test 6 failed' ; exit 1; }
+
+$path_to_bin --verify -f -r 8192 $image_file > ${script_name}_output_test_7 || { echo 'modification 7 failed' ; exit 1; }
+grep -q "falling back to the iterative allocation" ${script_name}_output_test_7 || { echo 'test 7 did not take the iterative path' ; exit 1; }
+e2fsck -vf $image_file  || { echo 'test 7 failed' ; exit 1; }
+
 sudo mount -o loop $image_file ${mount_dir}
 
 rhash --skip-ok -c ${script_name}_SHA1SUM
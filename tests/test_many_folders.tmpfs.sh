@@ -109,6 +109,15 @@ e2fsck -vf $image_file  || { echo 'test 3 failed' ; exit 1; }
 $path_to_bin -r 4567 $image_file > ${script_name}_output_test_4 || { echo 'modification 4 failed' ; exit 1; }
 e2fsck -vf $image_file  || { echo 'test 4 failed' ; exit 1; }
 
+# --verify on an increase, which relocates the blocks under the new itables, then on a reduce, which rewrites the dirents
+$path_to_bin --verify -r 4096 $image_file > ${script_name}_output_test_5 || { echo 'modification 5 failed' ; exit 1; }
+grep -q "^Verified [0-9]* inodes, [1-9][0-9]* relocated blocks" ${script_name}_output_test_5 || { echo 'test 5 verified no relocated block' ; exit 1; }
+e2fsck -vf $image_file  || { echo 'test 5 failed' ; exit 1; }
+
+$path_to_bin --verify -c $new_count $image_file > ${script_name}_output_test_6 || { echo 'modification 6 failed' ; exit 1; }
+grep -q "^Verified .* [1-9][0-9]* directory entries" ${script_name}_output_test_6 || { echo 'test 6 verified no directory entry' ; exit 1; }
+e2fsck -vf $image_file  || { echo 'test 6 failed' ; exit 1; }
+
 sudo mount -o loop $image_file ${mount_dir}
 HASH_B=`find ${mount_dir} | sort | sha1sum | cut -f1 -d" "`
 if [[ "$HASH_A" == "$HASH_B" ]]
@@ -0,0 +1,794 @@
+/*
+ * verify.c --- built-in check of the filesystem after the change
+ *
+ * Copyright (C) 2025 by danim7 (https://github.com/danim7)
+ *
+ * With --verify, compact digests of what the change must preserve are
+ * recorded while it runs, and checked once the filesystem is closed,
+ * against a new read-only handle:
+ *
+ *  - the used inodes: a crc of the fields neither the increase nor the
+ *    reduce touches (not the number, the checksum, the ctime, the block
+ *    pointers, nor the mtime of a directory), summed over the filesystem so
+ *    that the renumbered inodes are found too. Read before the change, and
+ *    read again after it with the inode checksums verified.
+ *  - the blocks relocated by block_mover(): a crc per block of the data read
+ *    before the copy, checked at the new place. The extent, indirect and
+ *    EA blocks rewritten after their move are left out.
+ *  - the directory entries written by the reduce: a sum of the crcs of
+ *    directory, inode, type and name, compared with the entries found in
+ *    all the directories afterwards.
+ *  - the group descriptors: checksums, placement of the bitmaps and itables,
+ *    and free counts against the bitmaps and the inodes found in use.
+ *
+ * The itables and the relocated blocks are read in large sequential
+ * requests, shared between the threads of -t.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include "resize2fs.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+int verify_mode;
+
+/*largest read of the relocated blocks, and of a relocated range */
+#define VERIFY_READ_BLOCKS	1024
+
+/*mismatches printed per kind, the others are only counted */
+#define VERIFY_MAX_REPORTS	10
+
+#define VERIFY_INODE_SEED	0x696e6f64
+#define VERIFY_DIRENT_SEED	0x64697265
+
+/*relocated blocks blk..blk+count-1, their crcs start at crcs[first] */
+struct verify_range {
+	blk64_t		blk;
+	__u64		first;
+	__u32		count;
+};
+
+/*a relocated block whose crcs recorded before the before-th one are stale */
+struct verify_skip {
+	blk64_t		blk;
+	__u64		before;
+};
+
+/*the fields of an inode the change must keep, in host order */
+struct verify_inode {
+	__u16		mode, links;
+	__u32		uid, gid, size, size_high, atime, mtime, flags, generation;
+	__u32		block[EXT2_N_BLOCKS];
+};
+
+static struct {
+	/* used inodes before the change */
+	__u64		inode_sum, inode_count;
+	/* relocated blocks, and the crc of each */
+	struct verify_range *ranges;
+	__u64		num_ranges, max_ranges;
+	/* the ranges of the previous passes of block_mover(), sorted by block */
+	__u64		sorted_ranges;
+	__u32		*crcs;
+	__u64		num_crcs, max_crcs;
+	struct spill_map crc_spill;
+	/* relocated blocks written again, or moved again, after their move */
+	struct verify_skip *skip;
+	__u64		num_skip, max_skip;
+	/* directory entries written by the reduce */
+	__u64		dirent_sum, dirent_count;
+	int		dirents_recorded;
+} vd;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+#define VERIFY_LOCK()	pthread_mutex_lock(&verify_lock)
+#define VERIFY_UNLOCK()	pthread_mutex_unlock(&verify_lock)
+#else
+#define VERIFY_LOCK()	do { } while (0)
+#define VERIFY_UNLOCK()	do { } while (0)
+#endif
+
+/*the finalizer of splitmix64, so that the sums don't add the crcs linearly */
+static __u64 verify_mix(__u32 crc, __u32 len)
+{
+	__u64 h = ((__u64)len << 32) | crc;
+
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+/*run worker(arg) on the threads of -t, or here */
+static void verify_run(void *(*worker)(void *), void *arg)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_t *threads;
+	int i, started = 0;
+
+	threads = calloc(migrate_threads, sizeof(pthread_t));
+	if (threads && migrate_threads > 1) {
+		for (i = 0; i < migrate_threads; i++) {
+			if (pthread_create(&threads[i], NULL, worker, arg))
+				break;
+			started++;
+		}
+	}
+	if (!started)
+		worker(arg);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+#else
+	worker(arg);
+#endif
+}
+
+static __u64 verify_memory(void)
+{
+	return vd.max_ranges * sizeof(struct verify_range) + vd.max_skip * sizeof(struct verify_skip) +
+	       (vd.crc_spill.addr ? 0 : vd.max_crcs * sizeof(__u32));
+}
+
+static void verify_free(void)
+{
+	free(vd.ranges);
+	free(vd.skip);
+	if (vd.crc_spill.addr)
+		spill_map_close(&vd.crc_spill);
+	else
+		free(vd.crcs);
+	memset(&vd, 0, sizeof(vd));
+	mem_account("verification digests", 0);
+}
+
+/*
+ * Inode digests
+ */
+
+static __u64 verify_inode_hash(ext2_filsys fs, struct ext2_inode *inode)
+{
+	struct verify_inode vi;
+
+	memset(&vi, 0, sizeof(vi));
+	vi.mode = inode->i_mode;
+	vi.links = inode->i_links_count;
+	vi.uid = inode_uid(*inode);
+	vi.gid = inode_gid(*inode);
+	vi.size = inode->i_size;
+	vi.size_high = inode->i_size_high;
+	vi.atime = inode->i_atime;
+	/*the reduce touches the directories with a renumbered entry */
+	if (!LINUX_S_ISDIR(inode->i_mode))
+		vi.mtime = inode->i_mtime;
+	vi.flags = inode->i_flags;
+	vi.generation = inode->i_generation;
+	/*the block pointers change with the relocations, but not inline data or a fast symlink */
+	if (!ext2fs_inode_has_valid_blocks2(fs, inode))
+		memcpy(vi.block, inode->i_block, sizeof(vi.block));
+	return verify_mix(csum_crc32c(VERIFY_INODE_SEED, &vi, sizeof(vi)), sizeof(vi));
+}
+
+struct verify_scan {
+	ext2_filsys	fs;
+	/* after the change: check the inode checksums, collect the directories */
+	int		after;
+	dgrp_t		next;
+	__u64		sum, count, bad_csum;
+	/* per group, the inodes in use from the first non-reserved one, and the directories */
+	ext2_ino_t	*used, *used_dirs;
+	ext2_ino_t	*dirs;
+	__u64		num_dirs, max_dirs;
+	errcode_t	retval;
+};
+
+/*the inodes of group g in use, in sum and count, and the directories in the local list */
+static errcode_t scan_group(struct verify_scan *vs, dgrp_t g, char *buf, char *record,
+			    ext2_ino_t *dirs, unsigned int *num_dirs, __u64 *sum, __u64 *count)
+{
+	ext2_filsys fs = vs->fs;
+	ext2_ino_t ipg = fs->super->s_inodes_per_group, used = ipg, i, ino;
+	int inode_size = EXT2_INODE_SIZE(fs->super);
+	struct ext2_inode *inode;
+	blk64_t blocks;
+	errcode_t retval;
+
+	if (ext2fs_has_group_desc_csum(fs))
+		used = ext2fs_bg_flags_test(fs, g, EXT2_BG_INODE_UNINIT) ? 0 : ipg - ext2fs_bg_itable_unused(fs, g);
+	if (!used)
+		return 0;
+	blocks = ext2fs_div_ceil((__u64)used * inode_size, fs->blocksize);
+	retval = io_channel_read_blk64(fs->io, ext2fs_inode_table_loc(fs, g), blocks, buf);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < used; i++) {
+		ino = g * ipg + i + 1;
+		inode = (struct ext2_inode *)(buf + (__u64)i * inode_size);
+#ifdef WORDS_BIGENDIAN
+		ext2fs_swap_inode_full(fs, (struct ext2_inode_large *)record, (struct ext2_inode_large *)inode, 0, inode_size);
+		inode = (struct ext2_inode *)record;
+#endif
+		if (ino < EXT2_FIRST_INODE(fs->super) && ino != EXT2_ROOT_INO)
+			continue;
+		if (!inode->i_links_count)
+			continue;
+		*sum += verify_inode_hash(fs, inode);
+		(*count)++;
+		if (ino >= EXT2_FIRST_INODE(fs->super))
+			vs->used[g]++;
+		if (!vs->after)
+			continue;
+		if (LINUX_S_ISDIR(inode->i_mode)) {
+			vs->used_dirs[g]++;
+			dirs[(*num_dirs)++] = ino;
+		}
+#ifndef WORDS_BIGENDIAN
+		if (ext2fs_has_feature_metadata_csum(fs->super)) {
+			memcpy(record, inode, inode_size);
+			csum_inode_record(fs, ino, record);
+			if (memcmp(record, inode, inode_size)) {
+				VERIFY_LOCK();
+				if (vs->bad_csum++ < VERIFY_MAX_REPORTS)
+					printf("verify: inode %u has a wrong checksum\n", ino);
+				VERIFY_UNLOCK();
+			}
+		}
+#endif
+	}
+	return 0;
+}
+
+static void *verify_scan_worker(void *arg)
+{
+	struct verify_scan *vs = arg;
+	ext2_filsys fs = vs->fs;
+	ext2_ino_t *dirs = NULL, *list;
+	unsigned int num_dirs;
+	char *buf = NULL, *record = NULL;
+	__u64 sum = 0, count = 0;
+	errcode_t retval;
+	dgrp_t g;
+
+	retval = ext2fs_get_array(fs->blocksize, fs->inode_blocks_per_group, &buf);
+	if (!retval)
+		retval = ext2fs_get_mem(EXT2_INODE_SIZE(fs->super), &record);
+	if (!retval && vs->after)
+		retval = ext2fs_get_array(fs->super->s_inodes_per_group, sizeof(ext2_ino_t), &dirs);
+
+	while (!retval) {
+		VERIFY_LOCK();
+		if (vs->retval || vs->next >= fs->group_desc_count) {
+			VERIFY_UNLOCK();
+			break;
+		}
+		g = vs->next++;
+		VERIFY_UNLOCK();
+
+		num_dirs = 0;
+		retval = scan_group(vs, g, buf, record, dirs, &num_dirs, &sum, &count);
+		if (retval || !num_dirs)
+			continue;
+		VERIFY_LOCK();
+		if (vs->num_dirs + num_dirs > vs->max_dirs) {
+			list = realloc(vs->dirs, (vs->max_dirs + num_dirs) * 2 * sizeof(ext2_ino_t));
+			if (list) {
+				vs->dirs = list;
+				vs->max_dirs = (vs->max_dirs + num_dirs) * 2;
+			} else
+				retval = ENOMEM;
+		}
+		if (!retval) {
+			memcpy(vs->dirs + vs->num_dirs, dirs, num_dirs * sizeof(ext2_ino_t));
+			vs->num_dirs += num_dirs;
+		}
+		VERIFY_UNLOCK();
+	}
+
+	VERIFY_LOCK();
+	vs->sum += sum;
+	vs->count += count;
+	if (retval && !vs->retval)
+		vs->retval = retval;
+	VERIFY_UNLOCK();
+	if (buf)
+		ext2fs_free_mem(&buf);
+	if (record)
+		ext2fs_free_mem(&record);
+	if (dirs)
+		ext2fs_free_mem(&dirs);
+	return NULL;
+}
+
+static errcode_t verify_scan_inodes(ext2_filsys fs, int after, struct verify_scan *vs)
+{
+	memset(vs, 0, sizeof(*vs));
+	vs->fs = fs;
+	vs->after = after;
+	vs->used = calloc(fs->group_desc_count, sizeof(ext2_ino_t));
+	vs->used_dirs = calloc(fs->group_desc_count, sizeof(ext2_ino_t));
+	if (!vs->used || !vs->used_dirs)
+		return ENOMEM;
+	/*initialize the crc32c engine before the workers use it */
+	csum_engine_name();
+	verify_run(verify_scan_worker, vs);
+	return vs->retval;
+}
+
+static void verify_scan_free(struct verify_scan *vs)
+{
+	free(vs->used);
+	free(vs->used_dirs);
+	free(vs->dirs);
+}
+
+/*
+ * Record the digest of the used inodes of fs, before the change
+ */
+errcode_t verify_begin(ext2_filsys fs)
+{
+	struct verify_scan vs;
+	errcode_t retval;
+
+	retval = verify_scan_inodes(fs, 0, &vs);
+	if (!retval) {
+		vd.inode_sum = vs.sum;
+		vd.inode_count = vs.count;
+		log_verbose("Verification: digest of %llu inodes recorded\n", (unsigned long long)vs.count);
+	}
+	verify_scan_free(&vs);
+	return retval;
+}
+
+/*
+ * Relocated blocks
+ */
+
+static errcode_t grow_crcs(void)
+{
+	__u64 size = vd.max_crcs ? vd.max_crcs * 2 : 65536;
+	__u32 *crcs;
+	errcode_t retval;
+
+	if (vd.crc_spill.addr || spill_wanted(vd.max_crcs * sizeof(__u32))) {
+		if (!vd.crc_spill.addr) {
+			retval = spill_map_open(&vd.crc_spill, vd.crcs, vd.max_crcs * sizeof(__u32));
+			if (retval)
+				return retval;
+			free(vd.crcs);
+			vd.crcs = vd.crc_spill.addr;
+		}
+		retval = spill_map_resize(&vd.crc_spill, size * sizeof(__u32));
+		if (retval)
+			return retval;
+		vd.crcs = vd.crc_spill.addr;
+	} else {
+		crcs = realloc(vd.crcs, size * sizeof(__u32));
+		if (!crcs)
+			return ENOMEM;
+		vd.crcs = crcs;
+	}
+	vd.max_crcs = size;
+	return 0;
+}
+
+/*
+ * Record the crc of each of the count blocks of buf, about to be written
+ * at blk by block_mover()
+ */
+errcode_t verify_record_blocks(blk64_t blk, int count, const void *buf, int blocksize)
+{
+	struct verify_range *range, *ranges;
+	errcode_t retval;
+	int i;
+
+	range = vd.num_ranges > vd.sorted_ranges ? &vd.ranges[vd.num_ranges - 1] : NULL;
+	if (!range || range->blk + range->count != blk || range->count + count > VERIFY_READ_BLOCKS) {
+		if (vd.num_ranges == vd.max_ranges) {
+			ranges = realloc(vd.ranges, (vd.max_ranges ? vd.max_ranges * 2 : 1024) * sizeof(struct verify_range));
+			if (!ranges)
+				return ENOMEM;
+			vd.ranges = ranges;
+			vd.max_ranges = vd.max_ranges ? vd.max_ranges * 2 : 1024;
+		}
+		range = &vd.ranges[vd.num_ranges++];
+		range->blk = blk;
+		range->first = vd.num_crcs;
+		range->count = 0;
+	}
+	for (i = 0; i < count; i++) {
+		if (vd.num_crcs == vd.max_crcs) {
+			retval = grow_crcs();
+			if (retval)
+				return retval;
+		}
+		vd.crcs[vd.num_crcs++] = csum_crc32c(~0U, (const char *)buf + (__u64)i * blocksize, blocksize);
+	}
+	range->count += count;
+	mem_account("verification digests", verify_memory());
+	return 0;
+}
+
+static EXT2_QSORT_TYPE range_cmp(const void *a, const void *b)
+{
+	const struct verify_range *ra = a, *rb = b;
+
+	if (ra->blk != rb->blk)
+		return ra->blk < rb->blk ? -1 : 1;
+	return 0;
+}
+
+/*
+ * The relocated block blk is written again after its move, as an extent,
+ * indirect or EA block pointing to other relocated blocks: don't check
+ * what was recorded for it so far
+ */
+errcode_t verify_forget_block(blk64_t blk)
+{
+	struct verify_skip *skip;
+
+	if (vd.num_skip == vd.max_skip) {
+		skip = realloc(vd.skip, (vd.max_skip ? vd.max_skip * 2 : 1024) * sizeof(struct verify_skip));
+		if (!skip)
+			return ENOMEM;
+		vd.skip = skip;
+		vd.max_skip = vd.max_skip ? vd.max_skip * 2 : 1024;
+	}
+	vd.skip[vd.num_skip].blk = blk;
+	vd.skip[vd.num_skip++].before = vd.num_crcs;
+	return 0;
+}
+
+/*
+ * A new pass of block_mover() starts. The iterative increase may move
+ * again blocks relocated by an earlier pass, see verify_moved_blocks()
+ */
+void verify_new_pass(void)
+{
+	qsort(vd.ranges, vd.num_ranges, sizeof(struct verify_range), range_cmp);
+	vd.sorted_ranges = vd.num_ranges;
+}
+
+/*
+ * The count blocks at blk are moved away by block_mover(): forget those
+ * relocated by an earlier pass, their old place will be overwritten
+ */
+errcode_t verify_moved_blocks(blk64_t blk, blk64_t count)
+{
+	__u64 low = 0, high = vd.sorted_ranges, mid;
+	struct verify_range *range;
+	blk64_t b, end;
+	errcode_t retval;
+
+	/*the first range that may end after blk, they hold VERIFY_READ_BLOCKS blocks at most */
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (vd.ranges[mid].blk + VERIFY_READ_BLOCKS <= blk)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for (; low < vd.sorted_ranges && vd.ranges[low].blk < blk + count; low++) {
+		range = &vd.ranges[low];
+		b = range->blk > blk ? range->blk : blk;
+		end = range->blk + range->count < blk + count ? range->blk + range->count : blk + count;
+		for (; b < end; b++) {
+			retval = verify_forget_block(b);
+			if (retval)
+				return retval;
+		}
+	}
+	return 0;
+}
+
+/*by block, then in the order they were forgotten */
+static EXT2_QSORT_TYPE skip_cmp(const void *a, const void *b)
+{
+	const struct verify_skip *sa = a, *sb = b;
+
+	if (sa->blk != sb->blk)
+		return sa->blk < sb->blk ? -1 : 1;
+	return sa->before < sb->before ? -1 : sa->before > sb->before;
+}
+
+/*is the crc-th crc recorded, for block blk, stale */
+static int verify_stale(blk64_t blk, __u64 crc)
+{
+	__u64 low = 0, high = vd.num_skip, mid;
+
+	/*the last skip of blk */
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (vd.skip[mid].blk <= blk)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low && vd.skip[low - 1].blk == blk && vd.skip[low - 1].before > crc;
+}
+
+struct verify_blocks {
+	ext2_filsys	fs;
+	__u64		next, checked, skipped, bad;
+	errcode_t	retval;
+};
+
+static void *verify_blocks_worker(void *arg)
+{
+	struct verify_blocks *vb = arg;
+	ext2_filsys fs = vb->fs;
+	struct verify_range *range;
+	__u64 checked = 0, skipped = 0;
+	blk64_t blk;
+	char *buf = NULL;
+	errcode_t retval;
+	__u32 i;
+
+	retval = ext2fs_get_array(fs->blocksize, VERIFY_READ_BLOCKS, &buf);
+	while (!retval) {
+		VERIFY_LOCK();
+		if (vb->retval || vb->next >= vd.num_ranges) {
+			VERIFY_UNLOCK();
+			break;
+		}
+		range = &vd.ranges[vb->next++];
+		VERIFY_UNLOCK();
+
+		retval = io_channel_read_blk64(fs->io, range->blk, range->count, buf);
+		if (retval)
+			break;
+		for (i = 0; i < range->count; i++) {
+			blk = range->blk + i;
+			if (verify_stale(blk, range->first + i)) {
+				skipped++;
+				continue;
+			}
+			checked++;
+			if (csum_crc32c(~0U, buf + (__u64)i * fs->blocksize, fs->blocksize) == vd.crcs[range->first + i])
+				continue;
+			VERIFY_LOCK();
+			if (vb->bad++ < VERIFY_MAX_REPORTS)
+				printf("verify: relocated block %llu doesn't hold the data copied there\n", (unsigned long long)blk);
+			VERIFY_UNLOCK();
+		}
+	}
+
+	VERIFY_LOCK();
+	vb->checked += checked;
+	vb->skipped += skipped;
+	if (retval && !vb->retval)
+		vb->retval = retval;
+	VERIFY_UNLOCK();
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return NULL;
+}
+
+/*
+ * Directory entries
+ */
+
+__u64 verify_dirent_hash(ext2_ino_t dir, struct ext2_dir_entry *dirent)
+{
+	__u32 hdr[3], crc;
+
+	hdr[0] = dir;
+	hdr[1] = dirent->inode;
+	hdr[2] = ext2fs_dirent_name_len(dirent) | ext2fs_dirent_file_type(dirent) << 8;
+	crc = csum_crc32c(VERIFY_DIRENT_SEED, hdr, sizeof(hdr));
+	crc = csum_crc32c(crc, dirent->name, ext2fs_dirent_name_len(dirent));
+	return verify_mix(crc, ext2fs_dirent_name_len(dirent));
+}
+
+/*add the entries of a directory block, as written by the reduce */
+void verify_add_dirents(__u64 sum, __u64 count)
+{
+	vd.dirent_sum += sum;
+	vd.dirent_count += count;
+	vd.dirents_recorded = 1;
+}
+
+void verify_record_dirent(ext2_ino_t dir, struct ext2_dir_entry *dirent)
+{
+	if (dirent->inode)
+		verify_add_dirents(verify_dirent_hash(dir, dirent), 1);
+}
+
+struct verify_dirents {
+	__u64		sum, count;
+	struct readahead_dblist ra;
+};
+
+static int sum_dirent(ext2_ino_t dir, int entry EXT2FS_ATTR((unused)), struct ext2_dir_entry *dirent, int offset, int blocksize EXT2FS_ATTR((unused)), char *buf EXT2FS_ATTR((unused)), void *priv_data)
+{
+	struct verify_dirents *vdir = priv_data;
+
+	if (offset == 0)
+		readahead_dblist_advance(&vdir->ra);
+	if (dirent->inode) {
+		vdir->sum += verify_dirent_hash(dir, dirent);
+		vdir->count++;
+	}
+	return 0;
+}
+
+static EXT2_QSORT_TYPE ino_cmp(const void *a, const void *b)
+{
+	ext2_ino_t ino_a = *(const ext2_ino_t *)a, ino_b = *(const ext2_ino_t *)b;
+
+	return ino_a < ino_b ? -1 : ino_a > ino_b;
+}
+
+static int add_verify_dir_block(ext2_filsys fs, blk64_t *block_nr, e2_blkcnt_t blockcnt, blk64_t ref_block EXT2FS_ATTR((unused)), int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
+{
+	ext2_ino_t *dir = priv_data;
+
+	if (ext2fs_add_dir_block2(fs->dblist, *dir, *block_nr, blockcnt))
+		return BLOCK_ABORT;
+	return 0;
+}
+
+/*sum the entries of all the directories, reading their blocks in the order of the disk */
+static errcode_t verify_sum_dirents(ext2_filsys fs, struct verify_scan *vs, struct verify_dirents *vdir)
+{
+	struct ext2_inode inode;
+	errcode_t retval;
+	__u64 i;
+
+	memset(vdir, 0, sizeof(*vdir));
+	retval = ext2fs_init_dblist(fs, 0);
+	if (retval)
+		return retval;
+	qsort(vs->dirs, vs->num_dirs, sizeof(ext2_ino_t), ino_cmp);
+	for (i = 0; i < vs->num_dirs; i++) {
+		retval = ext2fs_read_inode(fs, vs->dirs[i], &inode);
+		if (retval)
+			return retval;
+		if (ext2fs_inode_has_valid_blocks2(fs, &inode))
+			retval = ext2fs_block_iterate3(fs, vs->dirs[i], BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY, 0, add_verify_dir_block, &vs->dirs[i]);
+		else if (inode.i_flags & EXT4_INLINE_DATA_FL)
+			retval = ext2fs_add_dir_block2(fs->dblist, vs->dirs[i], 0, 0);
+		if (retval)
+			return retval;
+	}
+	ext2fs_dblist_sort2(fs->dblist, 0);
+	readahead_dblist_init(&vdir->ra, fs, fs->dblist);
+	return ext2fs_dblist_dir_iterate(fs->dblist, DIRENT_FLAG_INCLUDE_EMPTY, 0, sum_dirent, vdir);
+}
+
+/*
+ * Group descriptors and bitmaps
+ */
+
+/*the free counts of the descriptors against the bitmaps and the inodes found in use */
+static __u64 verify_groups(ext2_filsys fs, struct verify_scan *vs)
+{
+	ext2_ino_t ipg = fs->super->s_inodes_per_group, used_inodes;
+	__u64 free_clusters = 0, free_inodes = 0, bad = 0;
+	blk64_t start = EXT2FS_B2C(fs, fs->super->s_first_data_block), clusters;
+	char *bits = NULL;
+	dgrp_t g;
+
+	if (ext2fs_get_mem(fs->blocksize > ipg / 8 + 1 ? fs->blocksize : ipg / 8 + 1, &bits))
+		return 1;
+	for (g = 0; g < fs->group_desc_count; g++) {
+		if (!ext2fs_group_desc_csum_verify(fs, g) && bad++ < VERIFY_MAX_REPORTS)
+			printf("verify: group %u has a wrong descriptor checksum\n", g);
+
+		clusters = EXT2FS_NUM_B2C(fs, ext2fs_group_blocks_count(fs, g));
+		memset(bits, 0, fs->blocksize);
+		if (ext2fs_get_block_bitmap_range2(fs->block_map, start + (blk64_t)g * fs->super->s_clusters_per_group, clusters, bits))
+			clusters = 0;
+		clusters -= ext2fs_bitcount(bits, (clusters + 7) / 8);
+		free_clusters += clusters;
+		if (clusters != ext2fs_bg_free_blocks_count(fs, g) && bad++ < VERIFY_MAX_REPORTS)
+			printf("verify: group %u: %u free clusters in the descriptor, %llu in the bitmap\n", g, ext2fs_bg_free_blocks_count(fs, g), (unsigned long long)clusters);
+
+		memset(bits, 0, ipg / 8 + 1);
+		ext2fs_get_inode_bitmap_range2(fs->inode_map, g * ipg + 1, ipg, bits);
+		used_inodes = ext2fs_bitcount(bits, (ipg + 7) / 8);
+		free_inodes += ipg - used_inodes;
+		if (ipg - used_inodes != ext2fs_bg_free_inodes_count(fs, g) && bad++ < VERIFY_MAX_REPORTS)
+			printf("verify: group %u: %u free inodes in the descriptor, %u in the bitmap\n", g, ext2fs_bg_free_inodes_count(fs, g), ipg - used_inodes);
+		/*the reserved inodes are always marked, used or not */
+		if (!g)
+			used_inodes -= EXT2_FIRST_INODE(fs->super) - 1;
+		if (used_inodes != vs->used[g] && bad++ < VERIFY_MAX_REPORTS)
+			printf("verify: group %u: %u inodes marked in use, %u found in the itable\n", g, used_inodes, vs->used[g]);
+		if (ext2fs_bg_used_dirs_count(fs, g) != vs->used_dirs[g] && bad++ < VERIFY_MAX_REPORTS)
+			printf("verify: group %u: %u directories in the descriptor, %u found in the itable\n", g, ext2fs_bg_used_dirs_count(fs, g), vs->used_dirs[g]);
+	}
+	if (EXT2FS_C2B(fs, free_clusters) != ext2fs_free_blocks_count(fs->super) && bad++ < VERIFY_MAX_REPORTS)
+		printf("verify: %llu free blocks in the superblock, %llu in the bitmaps\n", (unsigned long long)ext2fs_free_blocks_count(fs->super), (unsigned long long)EXT2FS_C2B(fs, free_clusters));
+	if (free_inodes != fs->super->s_free_inodes_count && bad++ < VERIFY_MAX_REPORTS)
+		printf("verify: %u free inodes in the superblock, %llu in the bitmaps\n", fs->super->s_free_inodes_count, (unsigned long long)free_inodes);
+	ext2fs_free_mem(&bits);
+	return bad;
+}
+
+/*
+ * Open the filesystem again, read-only, and check it against the digests
+ * recorded during the change
+ */
+errcode_t verify_check(const char *device_name, const char *io_options)
+{
+	struct verify_scan vs;
+	struct verify_blocks vb;
+	struct verify_dirents vdir;
+	ext2_filsys fs = NULL;
+	__u64 bad = 0;
+	errcode_t retval;
+
+	memset(&vs, 0, sizeof(vs));
+	printf("Verifying %s\n", device_name);
+	retval = ext2fs_open2(device_name, io_options, EXT2_FLAG_64BITS | EXT2_FLAG_THREADS, 0, 0, unix_io_manager, &fs);
+	if (retval)
+		goto errout;
+
+	/*the placement of the bitmaps and itables, then their checksums as they are read */
+	retval = ext2fs_check_desc(fs);
+	if (!retval)
+		retval = ext2fs_read_bitmaps(fs);
+	if (retval)
+		goto errout;
+
+	retval = verify_scan_inodes(fs, 1, &vs);
+	if (retval)
+		goto errout;
+	bad += vs.bad_csum;
+	if (vs.count != vd.inode_count || vs.sum != vd.inode_sum) {
+		printf("verify: %llu inodes in use, %llu before the change, and their digests differ\n", (unsigned long long)vs.count, (unsigned long long)vd.inode_count);
+		bad++;
+	}
+	bad += verify_groups(fs, &vs);
+
+	memset(&vb, 0, sizeof(vb));
+	vb.fs = fs;
+	if (vd.num_ranges) {
+		qsort(vd.ranges, vd.num_ranges, sizeof(struct verify_range), range_cmp);
+		qsort(vd.skip, vd.num_skip, sizeof(struct verify_skip), skip_cmp);
+		spill_map_sequential(&vd.crc_spill);
+		verify_run(verify_blocks_worker, &vb);
+		retval = vb.retval;
+		if (retval)
+			goto errout;
+		bad += vb.bad;
+	}
+
+	memset(&vdir, 0, sizeof(vdir));
+	if (vd.dirents_recorded) {
+		retval = verify_sum_dirents(fs, &vs, &vdir);
+		if (retval)
+			goto errout;
+		if (vdir.count != vd.dirent_count || vdir.sum != vd.dirent_sum) {
+			printf("verify: %llu directory entries found, %llu written, and their digests differ\n", (unsigned long long)vdir.count, (unsigned long long)vd.dirent_count);
+			bad++;
+		}
+	}
+
+	printf("Verified %llu inodes, %llu relocated blocks (%llu rewritten since), %llu directory entries and %u groups: ",
+	       (unsigned long long)vs.count, (unsigned long long)vb.checked, (unsigned long long)vb.skipped,
+	       (unsigned long long)vdir.count, fs->group_desc_count);
+	if (bad) {
+		printf("%llu mismatches\n", (unsigned long long)bad);
+		retval = EXT2_ET_FILESYSTEM_CORRUPTED;
+	} else
+		printf("OK\n");
+
+ errout:
+	if (retval && retval != EXT2_ET_FILESYSTEM_CORRUPTED)
+		printf("verify: %s while checking %s\n", error_message(retval), device_name);
+	verify_scan_free(&vs);
+	verify_free();
+	if (fs)
+		ext2fs_close_free(&fs);
+	return retval;
+}